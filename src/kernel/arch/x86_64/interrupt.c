@@ -3,6 +3,7 @@
 #include "arch/x86_64/gdt.h"
 #include "arch/x86_64/opcodes.h" // for arch_outb, arch_inb
 #include "drivers/kbd.h"
+#include "mem/kfence.h"  // for kfence_handle_page_fault
 #include "sched/sched.h" // for schedule
 
 // TODO(jlam55555): We shouldn't really be printf()-ing in interrupts.
@@ -76,6 +77,9 @@ static __attribute__((interrupt)) void
 _pf_isr(__attribute((unused)) struct exception_frame *frame) {
   uint64_t cr2;
   __asm__("movq %%cr2, %0" : "=r"(cr2));
+
+  // Bit 1 of the error code is set for writes.
+  kfence_handle_page_fault((void *)cr2, frame->code & 2, (void *)frame->ip);
   printf("page fault (code=0x%x cr2=0x%lx)\r\n", frame->code, cr2);
   for (;;) {
   }
@@ -21,6 +21,39 @@ uint8_t arch_inb(uint16_t port);
 
 uint64_t arch_readtsc(void);
 
+// Disable IRQs, and return the previous RFLAGS for `arch_irq_restore()`. These
+// are inline since they guard every allocator entry point.
+static inline uint64_t arch_irq_save(void) {
+  uint64_t flags;
+  __asm__ volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(flags) : : "memory");
+  return flags;
+}
+
+// Re-enable IRQs iff they were enabled (RFLAGS.IF) before the matching
+// `arch_irq_save()`.
+static inline void arch_irq_restore(uint64_t flags) {
+  if (flags & (1lu << 9)) {
+    __asm__ volatile("sti" : : : "memory");
+  }
+}
+
 uint64_t arch_bsr(uint64_t n);
 
+// Bit-Scan Forward (index of the lowest set bit). UB if n is 0. This is inline
+// since it is used in tight bitmap-scanning loops.
+static inline uint64_t arch_bsf(uint64_t n) {
+  uint64_t rv;
+  __asm__("bsfq %1, %0" : "=r"(rv) : "rm"(n));
+  return rv;
+}
+
+// Copy `n` quadwords from `src` to `dest` (`rep movsq`). The regions must not
+// overlap. This is inline since it is a single instruction.
+static inline void arch_movsq(void *dest, const void *src, uint64_t n) {
+  __asm__ volatile("rep movsq"
+                   : "+D"(dest), "+S"(src), "+c"(n)
+                   :
+                   : "memory");
+}
+
 #endif // ARCH_X86_64_OPCODES_H
@@ -2,18 +2,65 @@
 
 #include <assert.h>
 
-#include "common/libc.h" // for memset
-#include "mem/phys.h"    // for phys_alloc_page
-#include "mem/vm.h"      // for VM_TO_HHDM
+#include "mem/phys.h" // for phys_alloc_zeroed_bulk, phys_free_bulk
+#include "mem/vm.h"   // for VM_TO_HHDM
 
 /**
- * Allocates and returns a pointer to an empty (zeroed) PMLx table.
+ * Building a page table (e.g., the HHDM at boot) requires many PMLx tables, so
+ * they are allocated from the physical allocator in batches. These come from
+ * the pre-zeroed page pool when possible. Unused pages are returned by
+ * `_virt_release_pmlx_reserve()`. After boot, page tables are only extended a
+ * few tables at a time (e.g., by `arch_pt_map_page()`), so the batch size
+ * drops to a single table.
+ */
+#define PMLX_RESERVE_SZ 32
+static void *_pmlx_reserve[PMLX_RESERVE_SZ];
+static size_t _pmlx_reserve_next, _pmlx_reserve_count;
+static size_t _pmlx_reserve_batch = PMLX_RESERVE_SZ;
+
+/**
+ * The kernel page table (HHDM address), built by `arch_pt_init()`.
+ */
+static struct pmlx_entry *_virt_kernel_pml4;
+
+/**
+ * Allocates and returns a pointer to an empty (zeroed) PMLx table, or NULL if
+ * physical pages are exhausted.
  */
 static struct pmlx_entry *_virt_alloc_pmlx_table(void) {
-  struct pmlx_entry *rv;
-  assert(rv = phys_alloc_page());
-  memset(rv, 0, PG_SZ);
-  return rv;
+  if (_pmlx_reserve_next == _pmlx_reserve_count) {
+    _pmlx_reserve_next = 0;
+    _pmlx_reserve_count =
+        phys_alloc_zeroed_bulk(_pmlx_reserve_batch, _pmlx_reserve);
+    if (!_pmlx_reserve_count) {
+      return NULL;
+    }
+  }
+  return _pmlx_reserve[_pmlx_reserve_next++];
+}
+
+static void _virt_release_pmlx_reserve(void) {
+  phys_free_bulk(_pmlx_reserve_count - _pmlx_reserve_next,
+                 _pmlx_reserve + _pmlx_reserve_next);
+  _pmlx_reserve_next = _pmlx_reserve_count = 0;
+}
+
+/**
+ * Returns the next-level table of a PMLx entry, creating it if it doesn't
+ * exist. Returns NULL if a new table is needed but can't be allocated.
+ */
+static struct pmlx_entry *_virt_get_pmlx_next(struct pmlx_entry *pmle) {
+  if (!pmle->p) {
+    struct pmlx_entry *const table = _virt_alloc_pmlx_table();
+    if (!table) {
+      return NULL;
+    }
+    pmle->p = true;
+    pmle->addr = ((size_t)VM_TO_IDM(table) & (PM_MAX_BIT - 1)) >> PG_SZ_BITS;
+    pmle->rw = true;
+    pmle->us = 1;
+  }
+  return VM_TO_HHDM(pmle->addr << PG_SZ_BITS);
 }
 
 /**
@@ -23,8 +70,10 @@ static struct pmlx_entry *_virt_alloc_pmlx_table(void) {
  *
  * Assumes the page isn't already mapped since there's no reason we should
  * map a virtual page twice -- this would mean there's an error in our VMM.
+ *
+ * Returns false if a page table couldn't be allocated.
  */
-static void _virt_map_page(struct pmlx_entry *pml4, void *phys_addr,
+static bool _virt_map_page(struct pmlx_entry *pml4, void *phys_addr,
                            void *virt_addr, bool is_hugepage) {
   struct pmlx_entry *pml4e, *pml3, *pml3e, *pml2, *pml2e, *pml1, *pml1e;
 
@@ -37,16 +86,9 @@ static void _virt_map_page(struct pmlx_entry *pml4, void *phys_addr,
   pmle = &pml[((size_t)virt_addr >> offset) & 0x1ff];
 #define GET_PMLNEXT(pml, pmle, pmlnext, offset)                                \
   GET_PMLE(pml, pmle, offset);                                                 \
-  if (!pmle->p) {                                                              \
-    /* TODO(jlam55555): Turn this into a function. */                          \
-    pmle->p = true;                                                            \
-    pmle->addr =                                                               \
-        ((size_t)VM_TO_IDM(_virt_alloc_pmlx_table()) & (PM_MAX_BIT - 1)) >>    \
-        PG_SZ_BITS;                                                            \
-    pmle->rw = true;                                                           \
-    pmle->us = 1;                                                              \
-  }                                                                            \
-  pmlnext = VM_TO_HHDM(pmle->addr << PG_SZ_BITS);
+  if (!(pmlnext = _virt_get_pmlx_next(pmle))) {                                \
+    return false;                                                              \
+  }
 
   GET_PMLNEXT(pml4, pml4e, pml3, 39);
   GET_PMLNEXT(pml3, pml3e, pml2, 30);
@@ -73,6 +115,7 @@ static void _virt_map_page(struct pmlx_entry *pml4, void *phys_addr,
   }
 #undef GET_PMLNEXT
 #undef GET_PMLE
+  return true;
 }
 
 // TODO(jlam55555): Write diagnostic function to check if a page is mapped. To
@@ -90,7 +133,7 @@ void _virt_map_region(struct pmlx_entry *pml4, void *phys_addr, void *virt_addr,
   for (size_t i = 0; i < len;) {
     bool is_hgpg = i + VM_HGPG_SZ <= len && VM_HGPG_ALIGNED(phys_addr + i) &&
                    VM_HGPG_ALIGNED(virt_addr + i);
-    _virt_map_page(pml4, phys_addr + i, virt_addr + i, is_hgpg);
+    assert(_virt_map_page(pml4, phys_addr + i, virt_addr + i, is_hgpg));
     i += is_hgpg ? VM_HGPG_SZ : PG_SZ;
   }
 }
@@ -129,7 +172,9 @@ static void _virt_set_pt(struct pmlx_entry *pml4) {
 
 void arch_pt_init(struct limine_memmap_entry *init_mmap, size_t entry_count) {
   // Create an entry page table.
-  struct pmlx_entry *pml4 = VM_TO_HHDM(_virt_alloc_pmlx_table());
+  struct pmlx_entry *const pml4_idm = _virt_alloc_pmlx_table();
+  assert(pml4_idm);
+  struct pmlx_entry *pml4 = VM_TO_HHDM(pml4_idm);
 
   // Create a HHDM.
   _virt_create_hhdm(pml4, init_mmap, entry_count);
@@ -144,6 +189,54 @@ void arch_pt_init(struct limine_memmap_entry *init_mmap, size_t entry_count) {
   void *video_mem = (void *)0xB8000;
   _virt_map_region(pml4, video_mem, VM_TO_HHDM(video_mem), PG_SZ);
 
+  // Create the PML3 tables for the vmalloc area and the KFENCE pool up front,
+  // so that the kernel's PML4 entries don't change after boot.
+  static_assert(VM_VMALLOC_SZ == 1lu << 39);
+  static_assert(!(VM_VMALLOC_START & (VM_VMALLOC_SZ - 1)));
+  assert(_virt_get_pmlx_next(&pml4[(VM_VMALLOC_START >> 39) & 0x1ff]));
+#ifdef KFENCE
+  static_assert(VM_KFENCE_SZ == 1lu << 39);
+  static_assert(!(VM_KFENCE_START & (VM_KFENCE_SZ - 1)));
+  assert(_virt_get_pmlx_next(&pml4[(VM_KFENCE_START >> 39) & 0x1ff]));
+#endif // KFENCE
+
+  _virt_release_pmlx_reserve();
+  _pmlx_reserve_batch = 1;
+  _virt_kernel_pml4 = pml4;
+
   // Switch to the new page table, which should be a physical address.
   _virt_set_pt(VM_TO_IDM(pml4));
 }
+
+bool arch_pt_map_page(void *virt_addr, void *phys_addr) {
+  assert(_virt_kernel_pml4);
+  return _virt_map_page(_virt_kernel_pml4, VM_TO_IDM(phys_addr), virt_addr,
+                        false);
+}
+
+void *arch_pt_unmap_page(void *virt_addr) {
+  assert(PG_ALIGNED(virt_addr));
+  struct pmlx_entry *pml = _virt_kernel_pml4;
+  for (unsigned offset = 39; offset > 12; offset -= 9) {
+    const struct pmlx_entry *const pmle =
+        &pml[((size_t)virt_addr >> offset) & 0x1ff];
+    if (!pmle->p) {
+      return NULL;
+    }
+    assert(!pmle->ps);
+    pml = VM_TO_HHDM(pmle->addr << PG_SZ_BITS);
+  }
+
+  struct pmlx_entry *const pml1e = &pml[((size_t)virt_addr >> 12) & 0x1ff];
+  if (!pml1e->p) {
+    return NULL;
+  }
+  void *const phys_addr = VM_TO_HHDM(pml1e->addr << PG_SZ_BITS);
+  *pml1e = (struct pmlx_entry){0};
+  return phys_addr;
+}
+
+void arch_pt_flush_tlb(void) {
+  // Reloading CR3 flushes all (non-global) TLB entries.
+  _virt_set_pt(VM_TO_IDM(_virt_kernel_pml4));
+}
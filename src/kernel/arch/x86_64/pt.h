@@ -44,6 +44,16 @@
 static_assert(VM_CANON_BITS == VM_HM_START,
               "Canonical bits/high memory computation failure");
 
+// vmalloc area (see mem/vmalloc.h). This is the region covered by one PML4
+// entry (512GiB), at the same address as in Linux.
+#define VM_VMALLOC_START 0xffffc90000000000lu
+#define VM_VMALLOC_SZ (1lu << 39)
+
+// KFENCE pool (see mem/kfence.h). This is in the PML4 entry after the vmalloc
+// area, and only the start of it is used.
+#define VM_KFENCE_START (VM_VMALLOC_START + VM_VMALLOC_SZ)
+#define VM_KFENCE_SZ (1lu << 39)
+
 // Number of paging levels. Assume 4-level paging for now.
 #define VM_PG_LV 4
 
@@ -53,7 +63,7 @@ static_assert(VM_CANON_BITS == VM_HM_START,
 
 // Size of a hugepage (2MiB).
 #define VM_HGPG_SZ 2097152
-#define VM_HGPG_SZ_BITS 24
+#define VM_HGPG_SZ_BITS 21
 
 // Similar to the PG_ALIGNED macro.
 #define VM_HGPG_ALIGNED(sz) (!((size_t)(sz) & (VM_HGPG_SZ - 1)))
@@ -121,4 +131,26 @@ static inline bool va_is_canonical(void *addr) {
  */
 void arch_pt_init(struct limine_memmap_entry *init_mmap, size_t entry_count);
 
+/**
+ * Map a 4KiB page (HHDM address) at `virt_addr` in the kernel page table,
+ * allocating page tables as needed. The virtual page must not be mapped.
+ * Returns false if a page table couldn't be allocated.
+ *
+ * This doesn't flush the TLB, since the page was not mapped.
+ */
+bool arch_pt_map_page(void *virt_addr, void *phys_addr);
+
+/**
+ * Unmap a 4KiB page from the kernel page table. Returns the page (HHDM
+ * address), or NULL if it wasn't mapped. Page tables are not freed.
+ *
+ * This doesn't flush the TLB; see `arch_pt_flush_tlb()`.
+ */
+void *arch_pt_unmap_page(void *virt_addr);
+
+/**
+ * Flush the TLB.
+ */
+void arch_pt_flush_tlb(void);
+
 #endif // ARCH_X86_64_PT_H
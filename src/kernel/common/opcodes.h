@@ -21,12 +21,18 @@
 #define op_sti arch_sti // Enable IRQs.
 #define op_cli arch_cli // Disable IRQs.
 
+#define op_irq_save arch_irq_save       // Disable IRQs, return previous state.
+#define op_irq_restore arch_irq_restore // Restore IRQ state from op_irq_save.
+
 #define op_outb arch_outb // Write one byte to a port.
 #define op_outw arch_outw // Write one word to a port.
 #define op_inb arch_inb   // Read one byte from a port.
 
-#define op_rdtsc arch_rdtsc // Read HW timestamp counter.
+#define op_rdtsc arch_readtsc // Read HW timestamp counter.
 
 #define op_bsr arch_bsr // Bit-Scan Reverse.
+#define op_bsf arch_bsf // Bit-Scan Forward.
+
+#define op_movsq arch_movsq // Copy quadwords (`rep movsq`).
 
 #endif // COMMON_OPCODES_H
@@ -0,0 +1,20 @@
+/**
+ * Per-CPU data. Per-CPU data is declared as an array of `NR_CPUS` elements and
+ * indexed by `cpu_id()`, so that each CPU can access its own element without
+ * synchronizing with other CPUs (only with interrupts on the same CPU).
+ *
+ * There is no SMP support yet, so there is exactly one CPU. Once more CPUs are
+ * brought up, `cpu_id()` should read the CPU number from a per-CPU segment
+ * (e.g., %gs on x86_64) and `NR_CPUS` should become a build option.
+ */
+#ifndef COMMON_PERCPU_H
+#define COMMON_PERCPU_H
+
+#define NR_CPUS 1
+
+/**
+ * Index of the current CPU.
+ */
+static inline unsigned cpu_id(void) { return 0; }
+
+#endif // COMMON_PERCPU_H
@@ -5,6 +5,7 @@
 #include "diag/mm.h"
 #include "drivers/console.h"
 #include "drivers/term.h"
+#include "mem/stat.h" // for mem_stat_*
 #include "sched/sched.h"
 #include "test/test.h"
 
@@ -50,6 +51,12 @@ void _shell_dispatch(const char *cmd) {
     print_mm();
   } else if (!strncmp(cmd, "phys", SHELL_INPUT_BUF_SZ)) {
     phys_mem_print_stats();
+  } else if (!strncmp(cmd, "memstat", SHELL_INPUT_BUF_SZ)) {
+    mem_stat_print();
+  } else if (!strncmp(cmd, "memstat raw", SHELL_INPUT_BUF_SZ)) {
+    mem_stat_dump();
+  } else if (!strncmp(cmd, "memstat reset", SHELL_INPUT_BUF_SZ)) {
+    mem_stat_reset();
   } else if (!strncmp(cmd, "pa", SHELL_INPUT_BUF_SZ)) {
     // Allocate a random page. For testing purposes.
     printf("\rret=%lx\r\n", phys_alloc_page());
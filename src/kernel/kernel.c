@@ -2,11 +2,13 @@
 
 #include "arch/x86_64/init.h" // for arch_init
 #include "common/libc.h"      // for printf
-#include "common/opcodes.h"   // for op_hlt
+#include "common/opcodes.h"   // for op_hlt, op_rdtsc
 #include "common/util.h"      // for macro2str
 #include "diag/shell.h"       // for shell_init
 #include "diag/sys.h"         // for print_limine_mmap
 #include "drivers/serial.h"   // for serial_init
+#include "mem/phys.h"         // for phys_zero_task, phys_mem_print_stats
+#include "mem/reclaim.h"      // for reclaim_task
 #include "mem/virt.h"         // for virt_mem_init
 #include "sched/sched.h"      // for sched_*
 
@@ -19,6 +21,11 @@ static volatile struct limine_memmap_request _limine_memmap_request = {
     .revision = 0,
 };
 
+#ifdef DEBUG
+// TSC at kernel entry, for measuring boot time.
+static uint64_t _boot_tsc;
+#endif // DEBUG
+
 /**
  * Stage 2 of kernel initialization, after the memory manager has been set up.
  *
@@ -33,6 +40,12 @@ static __attribute__((noreturn)) void _start_2(void) {
   // Bootstrap into main scheduler.
   sched_init_bootstrap();
 
+#ifdef DEBUG
+  printf("Entered scheduler %lu cycles after kernel entry\r\n",
+         op_rdtsc() - _boot_tsc);
+  phys_mem_print_stats();
+#endif // DEBUG
+
   // Kernel initialization is done by this point. We can schedule threads to run
   // now. In the future we should just spawn the `init` process.
   //
@@ -40,10 +53,18 @@ static __attribute__((noreturn)) void _start_2(void) {
   // processes):
   // - Keep running the current "main" thread.
   // - Also spawn a "shell" thread.
+  // - Also spawn a thread that pre-zeroes free pages in the background.
+  // - Also spawn a thread that reclaims cached memory when memory runs low.
 
   // Simple diagnostic shell.
   sched_new(&shell_init);
 
+  // Pre-zeroed page pool.
+  sched_new(&phys_zero_task);
+
+  // Background memory reclaim.
+  sched_new(&reclaim_task);
+
   // We're done, just wait for interrupt...
   for (;;) {
     printf("main thread\r\n");
@@ -72,6 +93,10 @@ static __attribute__((noreturn)) void _start_2(void) {
  * If RUNTEST is set, then the specified tests are run after step 2.
  */
 __attribute__((noreturn)) void _start(void) {
+#ifdef DEBUG
+  _boot_tsc = op_rdtsc();
+#endif // DEBUG
+
   arch_init();
 
   // Check the Limine requests.
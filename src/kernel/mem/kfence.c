@@ -0,0 +1,265 @@
+#include "mem/kfence.h"
+
+#ifdef KFENCE
+
+#include <assert.h>
+
+#include "arch/x86_64/pt.h" // for arch_pt_*
+#include "common/libc.h"    // for memset, printf
+#include "common/list.h"
+#include "common/opcodes.h" // for op_irq_*
+#include "mem/phys.h"       // for phys_alloc_page
+#include "mem/slab.h"       // for _kmalloc, _slab_caches
+
+/**
+ * Fill byte for the unused part of an object's page.
+ */
+#define KFENCE_CANARY 0xaa
+
+enum kfence_state {
+  KFENCE_UNUSED, // Never allocated, or no backing page.
+  KFENCE_ALLOCATED,
+  KFENCE_FREED,
+};
+
+/**
+ * An object slot in the KFENCE pool.
+ */
+struct kfence_object {
+  // Backing page (HHDM address). It's only mapped in the pool while the object
+  // is allocated.
+  void *page;
+
+  // Address (in the pool) and requested size of the object.
+  void *addr;
+  size_t sz;
+
+  enum kfence_state state;
+
+  // Callers of the last `kmalloc()` and `kfree()`.
+  const void *alloc_site;
+  const void *free_site;
+
+  // Link in `_kfence_freelist`.
+  struct list_head ll;
+};
+
+static struct kfence_object _kfence_objects[KFENCE_NR_OBJECTS];
+
+/**
+ * Free object slots, oldest first.
+ */
+static struct list_head _kfence_freelist = {&_kfence_freelist,
+                                            &_kfence_freelist};
+
+// The countdown starts at 0, so sampling is off until `kfence_init()`.
+size_t _kfence_countdown[NR_CPUS];
+static size_t _kfence_sample_interval = KFENCE_SAMPLE_INTERVAL;
+
+static size_t _kfence_nr_errors;
+
+/**
+ * Address of the page of object slot `i` in the pool.
+ */
+static void *_kfence_object_page(size_t i) {
+  return (void *)VM_KFENCE_START + ((2 * i + 1) << PG_SZ_BITS);
+}
+
+/**
+ * Index of the page of `addr` in the pool. Odd pages are object pages, and even
+ * pages are guard pages.
+ */
+static size_t _kfence_pool_page(const void *addr) {
+  return ((uint64_t)addr - VM_KFENCE_START) >> PG_SZ_BITS;
+}
+
+void kfence_init(void) {
+  for (size_t i = 0; i < KFENCE_NR_OBJECTS; ++i) {
+    struct kfence_object *const obj = &_kfence_objects[i];
+    if (!(obj->page = phys_alloc_page())) {
+      // Make do with a smaller pool.
+      break;
+    }
+    list_add_tail(&_kfence_freelist, &obj->ll);
+  }
+  kfence_set_sample_interval(_kfence_sample_interval);
+}
+
+void kfence_set_sample_interval(size_t interval) {
+  assert(interval);
+  _kfence_sample_interval = interval;
+  for (unsigned cpu = 0; cpu < NR_CPUS; ++cpu) {
+    _kfence_countdown[cpu] = interval;
+  }
+}
+
+size_t kfence_nr_errors(void) { return _kfence_nr_errors; }
+
+/**
+ * Finish an error report: count it, and print the allocation (and free) site of
+ * the object involved, if any.
+ */
+static void _kfence_report_object(const struct kfence_object *obj) {
+  ++_kfence_nr_errors;
+  if (!obj || obj->state == KFENCE_UNUSED) {
+    return;
+  }
+  printf("kfence: %lu-byte object 0x%lx allocated at 0x%lx", obj->sz,
+         obj->addr, obj->alloc_site);
+  if (obj->state == KFENCE_FREED) {
+    printf(", freed at 0x%lx", obj->free_site);
+  }
+  printf("\r\n");
+}
+
+/**
+ * Allocate an object of `sz` bytes from the pool. Returns NULL if it doesn't
+ * fit in a page, or if the pool is full.
+ */
+static void *_kfence_alloc(size_t sz, const void *site) {
+  if (!sz || sz > PG_SZ || list_empty(&_kfence_freelist)) {
+    return NULL;
+  }
+  struct kfence_object *const obj =
+      list_entry(_kfence_freelist.next, struct kfence_object, ll);
+  void *const page = _kfence_object_page(obj - _kfence_objects);
+  if (!arch_pt_map_page(page, obj->page)) {
+    return NULL;
+  }
+  list_del(&obj->ll);
+
+  // Put the object as close to the end of the page as the `kmalloc()` alignment
+  // (the largest power of two dividing the size class) allows.
+  const size_t class_sz = _slab_caches[_slab_kmalloc_const_index(sz)].size;
+  const size_t align = class_sz & -class_sz;
+  memset(obj->page, KFENCE_CANARY, PG_SZ);
+  obj->addr = page + PG_SZ - ((sz + align - 1) & ~(align - 1));
+  obj->sz = sz;
+  obj->state = KFENCE_ALLOCATED;
+  obj->alloc_site = site;
+  return obj->addr;
+}
+
+__attribute__((noinline)) void *_kfence_kmalloc(size_t sz) {
+  _kfence_countdown[cpu_id()] = _kfence_sample_interval;
+
+  // Since `kmalloc()` is inlined, this is in its caller.
+  const uint64_t irq = op_irq_save();
+  void *const obj = _kfence_alloc(sz, __builtin_return_address(0));
+  op_irq_restore(irq);
+  return obj ? obj : _kmalloc(sz);
+}
+
+/**
+ * Look up the allocated object at `addr`. Returns NULL if there is none.
+ */
+static struct kfence_object *_kfence_get_object(const void *addr) {
+  const size_t pg = _kfence_pool_page(addr);
+  if (!(pg & 1)) {
+    return NULL;
+  }
+  struct kfence_object *const obj = &_kfence_objects[pg >> 1];
+  return obj->state == KFENCE_ALLOCATED && obj->addr == addr ? obj : NULL;
+}
+
+static void _kfence_free(const void *addr, const void *site) {
+  struct kfence_object *const obj = _kfence_get_object(addr);
+  if (!obj) {
+    const size_t pg = _kfence_pool_page(addr);
+    struct kfence_object *const owner =
+        pg & 1 ? &_kfence_objects[pg >> 1] : NULL;
+    printf("kfence: %s of 0x%lx at 0x%lx\r\n",
+           owner && owner->state == KFENCE_FREED && owner->addr == addr
+               ? "double free"
+               : "invalid free",
+           addr, site);
+    _kfence_report_object(owner);
+    return;
+  }
+
+  // Check the canary on both sides of the object.
+  const size_t off = obj->addr - _kfence_object_page(obj - _kfence_objects);
+  const uint8_t *const canary = obj->page;
+  for (size_t i = 0; i < PG_SZ; ++i) {
+    if (i == off) {
+      i += obj->sz - 1;
+    } else if (canary[i] != KFENCE_CANARY) {
+      printf("kfence: out-of-bounds write at 0x%lx (%lu bytes %s of the "
+             "object), found by kfree() at 0x%lx\r\n",
+             obj->addr - off + i, i < off ? off - i : i - off - obj->sz,
+             i < off ? "left" : "right", site);
+      _kfence_report_object(obj);
+      break;
+    }
+  }
+
+  obj->state = KFENCE_FREED;
+  obj->free_site = site;
+
+  // The object page must not be accessible in the TLB once it's freed. Frees
+  // are rare enough that a full flush is fine.
+  void *const page __attribute__((unused)) =
+      arch_pt_unmap_page(_kfence_object_page(obj - _kfence_objects));
+  assert(page == obj->page);
+  arch_pt_flush_tlb();
+  list_add_tail(&_kfence_freelist, &obj->ll);
+}
+
+void kfence_free(const void *addr, const void *site) {
+  const uint64_t irq = op_irq_save();
+  _kfence_free(addr, site);
+  op_irq_restore(irq);
+}
+
+size_t kfence_ksize(const void *addr) {
+  const struct kfence_object *const obj = _kfence_get_object(addr);
+  assert(obj);
+  return obj->sz;
+}
+
+bool kfence_handle_page_fault(const void *addr, bool is_write,
+                              const void *ip) {
+  if (!is_kfence_addr(addr)) {
+    return false;
+  }
+  const char *const access = is_write ? "write" : "read";
+  const size_t pg = _kfence_pool_page(addr);
+  if (pg & 1) {
+    // Object pages are only unmapped while the object is free.
+    const struct kfence_object *const obj = &_kfence_objects[pg >> 1];
+    printf("kfence: %s %s at 0x%lx (ip=0x%lx)\r\n",
+           obj->state == KFENCE_FREED ? "use-after-free" : "invalid", access,
+           addr, ip);
+    _kfence_report_object(obj);
+    return true;
+  }
+
+  // Guard page: blame the nearer of the objects on either side. Distances are
+  // as in the canary check in `kfence_free()`.
+  const struct kfence_object *const left =
+      pg && _kfence_objects[(pg >> 1) - 1].state != KFENCE_UNUSED
+          ? &_kfence_objects[(pg >> 1) - 1]
+          : NULL;
+  const struct kfence_object *const right =
+      (pg >> 1) < KFENCE_NR_OBJECTS &&
+              _kfence_objects[pg >> 1].state != KFENCE_UNUSED
+          ? &_kfence_objects[pg >> 1]
+          : NULL;
+  const size_t left_dist =
+      left ? (size_t)(addr - (left->addr + left->sz)) : SIZE_MAX;
+  const size_t right_dist = right ? (size_t)(right->addr - addr) : SIZE_MAX;
+  if (!left && !right) {
+    printf("kfence: invalid %s at 0x%lx (ip=0x%lx)\r\n", access, addr, ip);
+    _kfence_report_object(NULL);
+    return true;
+  }
+  const bool is_right_of = left_dist <= right_dist;
+  printf("kfence: out-of-bounds %s at 0x%lx (%lu bytes %s of the object, "
+         "ip=0x%lx)\r\n",
+         access, addr, is_right_of ? left_dist : right_dist,
+         is_right_of ? "right" : "left", ip);
+  _kfence_report_object(is_right_of ? left : right);
+  return true;
+}
+
+#endif // KFENCE
@@ -0,0 +1,130 @@
+/**
+ * Sampling memory error detector, like Linux's KFENCE. This is only built in
+ * with `make KFENCE=1` (which defines KFENCE); otherwise, the hooks compile to
+ * nothing.
+ *
+ * Roughly every KFENCE_SAMPLE_INTERVAL-th `kmalloc()` is served from the KFENCE
+ * pool instead of the slab caches. The pool is a dedicated region of the kernel
+ * address space (VM_KFENCE_START) of KFENCE_NR_OBJECTS object pages, each
+ * surrounded by unmapped guard pages:
+ *
+ *     | guard | object 0 | guard | object 1 | guard | ... | guard |
+ *
+ * An object is placed at the end of its page (as far as its `kmalloc()`
+ * alignment allows), so that overflows fault on the next guard page. The rest
+ * of the page is filled with a canary byte, which is checked when the object is
+ * freed, to catch smaller overflows and underflows. A freed object's page is
+ * unmapped, so that use-after-frees fault. Freed objects are reused in FIFO
+ * order, to keep them unmapped for as long as possible.
+ *
+ * Faults in the pool are reported by the page fault handler, along with the
+ * allocation (and free) site of the object. Errors found by `kfree()` (canary
+ * corruption, double and invalid frees) are reported immediately.
+ *
+ * Unsampled allocations only pay for a per-CPU countdown and a well-predicted
+ * branch in `kmalloc()`, and `kfree()` and `ksize()` for an address range
+ * check.
+ */
+#ifndef MEM_KFENCE_H
+#define MEM_KFENCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/percpu.h" // for NR_CPUS, cpu_id
+#include "mem/vm.h"        // for VM_KFENCE_START, VM_PG_SZ_BITS
+
+#define KFENCE_NR_OBJECTS 255
+#define KFENCE_POOL_SZ ((2lu * KFENCE_NR_OBJECTS + 1) << VM_PG_SZ_BITS)
+
+#ifndef KFENCE_SAMPLE_INTERVAL
+#define KFENCE_SAMPLE_INTERVAL 512
+#endif // KFENCE_SAMPLE_INTERVAL
+
+/**
+ * Check if an address is in the KFENCE pool.
+ */
+static inline bool is_kfence_addr(const void *addr) {
+#ifdef KFENCE
+  return (uint64_t)addr - VM_KFENCE_START < KFENCE_POOL_SZ;
+#else
+  (void)addr;
+  return false;
+#endif // KFENCE
+}
+
+#ifdef KFENCE
+
+/**
+ * Number of `kmalloc()`s until the next sampled one, per CPU.
+ */
+extern size_t _kfence_countdown[NR_CPUS];
+
+/**
+ * Check if the current `kmalloc()` should be sampled. If so, it must call
+ * `_kfence_kmalloc()`, which restarts the countdown.
+ */
+static inline bool kfence_sample(void) {
+  return __builtin_expect(!--_kfence_countdown[cpu_id()], false);
+}
+
+/**
+ * Set up the KFENCE pool. Must be called after `arch_pt_init()`. Allocations
+ * aren't sampled until then.
+ */
+void kfence_init(void);
+
+/**
+ * Serve a sampled `kmalloc()` from the KFENCE pool, and restart the countdown.
+ * Falls back to the slab caches if the object doesn't fit in a page, or if the
+ * pool is full.
+ */
+void *_kfence_kmalloc(size_t sz);
+
+/**
+ * Free an object in the KFENCE pool. `site` is the caller of `kfree()`, for
+ * error reports.
+ */
+void kfence_free(const void *obj, const void *site);
+
+/**
+ * Size of an object in the KFENCE pool. This is the requested size, since
+ * anything past it is checked for corruption.
+ */
+size_t kfence_ksize(const void *obj);
+
+/**
+ * Report a page fault at `addr` in the KFENCE pool. Returns false if `addr`
+ * isn't in the pool.
+ */
+bool kfence_handle_page_fault(const void *addr, bool is_write, const void *ip);
+
+/**
+ * Set the sampling interval (for testing). This also restarts the countdown.
+ */
+void kfence_set_sample_interval(size_t interval);
+
+/**
+ * Number of errors reported so far.
+ */
+size_t kfence_nr_errors(void);
+
+#else
+
+static inline void kfence_init(void) {}
+static inline void kfence_free(__attribute__((unused)) const void *obj,
+                               __attribute__((unused)) const void *site) {}
+static inline size_t kfence_ksize(__attribute__((unused)) const void *obj) {
+  return 0;
+}
+static inline bool
+kfence_handle_page_fault(__attribute__((unused)) const void *addr,
+                         __attribute__((unused)) bool is_write,
+                         __attribute__((unused)) const void *ip) {
+  return false;
+}
+
+#endif // KFENCE
+
+#endif // MEM_KFENCE_H
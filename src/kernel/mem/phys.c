@@ -1,30 +1,124 @@
 #include "mem/phys.h"
 
 #include "common/libc.h"
-#include "mem/vm.h" // for VM_TO_HHDM, VM_TO_IDM
+#include "common/list.h"
+#include "common/opcodes.h" // for op_irq_*, op_cli, op_sti, op_hlt
+#include "common/percpu.h"  // for NR_CPUS, cpu_id
+#include "common/util.h"    // for static_assert
+#include "mem/reclaim.h"    // for reclaim_shrink
+#include "mem/stat.h"       // for mem_stat_*
+#include "mem/vm.h"         // for VM_TO_HHDM, VM_TO_IDM
 
 #include <assert.h>
 #include <limine.h>
 
+/**
+ * Make sure the `struct page` array doesn't grow unexpectedly.
+ */
+static_assert(sizeof(struct page) == 64);
+static_assert(_Alignof(struct page) == 64);
+static_assert(PHYS_HUGE_PUD <= PHYS_MAX_ORDER);
+
 /**
  * Main physical memory page allocator.
  */
 static struct phys_rra _phys_allocator;
+static struct phys_pcp _phys_pcps[NR_CPUS];
+
+/**
+ * Copy of the (normalized) memmap for deferred initialization of the main
+ * allocator. The bootloader's copy lives in bootloader-reclaimable memory.
+ */
+static struct limine_memmap_entry _phys_mmap[PHYS_MMAP_MAX_ENTRIES];
+
+/**
+ * Number of buddy free lists looked at by allocations, for statistics (see
+ * mem/stat.h).
+ */
+static size_t _phys_scan_len;
+
+static void _phys_rra_free_range(struct phys_rra *rra, size_t pfn,
+                                 size_t pfn_end);
+static void _phys_bm_clear_used(struct phys_rra *rra, size_t pfn);
+static void _phys_pcp_free(struct phys_rra *rra, const void *pg, bool cold);
+static void _phys_buddy_free(struct phys_rra *rra, const void *pg,
+                             unsigned order);
+static bool _phys_cma_free(struct phys_rra *rra, const void *pg,
+                           size_t pg_count);
+static bool _phys_rra_init_next_chunk(struct phys_rra *rra);
+
+/**
+ * Convert between physical addresses and page frame numbers (indices into the
+ * `struct page` array) of a RRA.
+ */
+static inline size_t _phys_rra_pfn(const struct phys_rra *rra,
+                                   const void *addr) {
+  return (size_t)(addr - rra->phys_offset) >> PG_SZ_BITS;
+}
+static inline void *_phys_rra_addr(const struct phys_rra *rra, size_t pfn) {
+  return rra->phys_offset + (pfn << PG_SZ_BITS);
+}
+
+/**
+ * Returns the zone that page `pfn` belongs to.
+ */
+static inline enum phys_zone_type _phys_pfn_zone(size_t pfn) {
+  if (pfn < PHYS_ZONE_DMA_LIMIT >> PG_SZ_BITS) {
+    return PHYS_ZONE_DMA;
+  }
+  if (pfn < PHYS_ZONE_DMA32_LIMIT >> PG_SZ_BITS) {
+    return PHYS_ZONE_DMA32;
+  }
+  return PHYS_ZONE_NORMAL;
+}
+static inline struct phys_zone *_phys_rra_zone(struct phys_rra *rra,
+                                               size_t pfn) {
+  return &rra->zones[_phys_pfn_zone(pfn)];
+}
+
+/**
+ * Convert between page frame numbers and `struct page`s. The page must be in a
+ * present section.
+ */
+static inline struct page *_phys_rra_page(const struct phys_rra *rra,
+                                          size_t pfn) {
+  struct page *const pages = rra->sections[pfn >> PHYS_SECTION_PG_BITS];
+  assert(pages);
+  return &pages[pfn & (PHYS_SECTION_PG - 1)];
+}
+static inline size_t _phys_page_pfn(const struct phys_rra *rra,
+                                    const struct page *page) {
+  return ((size_t)page->section << PHYS_SECTION_PG_BITS) +
+         (size_t)(page - rra->sections[page->section]);
+}
 
 /**
  * Helper function for phys_reclaim_bootloader_mem(). Bootloader-reclaimable
  * pages are marked unusable by _phys_region_alloc(). Once we're done with the
- * bootloader-reclaimable memory, we can mark them as usable and update the
- * unusable page count.
+ * bootloader-reclaimable memory, we can mark them as usable, update the
+ * unusable page count, and hand them to the buddy allocator.
  */
 static void _phys_region_mark_usable(void *addr, size_t pg_count) {
-  for (size_t i = 0; i < pg_count; ++i, addr += PG_SZ) {
-    const size_t pg = (size_t)addr >> PG_SZ_BITS;
-    assert(!_phys_allocator.mem_bitmap[pg].present);
-    assert(_phys_allocator.mem_bitmap[pg].unusable);
-    _phys_allocator.mem_bitmap[pg].unusable = false;
+  const size_t pfn = (size_t)addr >> PG_SZ_BITS;
+
+  // Pages that haven't been initialized yet will be initialized as usable.
+  if (pfn >= _phys_allocator.init_pg) {
+    return;
+  }
+  if (pfn + pg_count > _phys_allocator.init_pg) {
+    pg_count = _phys_allocator.init_pg - pfn;
+  }
+
+  for (size_t pg = pfn; pg < pfn + pg_count; ++pg) {
+    struct page *const page = _phys_rra_page(&_phys_allocator, pg);
+    assert(!page->present);
+    assert(page->unusable);
+    page->unusable = false;
+    _phys_bm_clear_used(&_phys_allocator, pg);
+    --_phys_rra_zone(&_phys_allocator, pg)->unusable_pg;
   }
   _phys_allocator.unusable_pg -= pg_count;
+  _phys_rra_free_range(&_phys_allocator, pfn, pfn + pg_count);
 }
 
 void phys_mem_init(struct limine_memmap_entry *init_mmap, size_t entry_count) {
@@ -34,30 +128,13 @@ void phys_mem_init(struct limine_memmap_entry *init_mmap, size_t entry_count) {
       init_mmap[entry_count - 1].base + init_mmap[entry_count - 1].length;
   assert(PG_ALIGNED(mem_limit));
 
-  // Bitmap size is (dimensional analysis):
-  // mem_limit bytes * page/4096bytes * sizeof(struct page) bytes/page.
-  const size_t bm_sz = (mem_limit >> PG_SZ_BITS) * sizeof(struct page);
-
-#ifdef DEBUG
-  // For diagnostic purposes.
-  printf("Maximum physical address=%lx\r\nstruct page array size=%lx\r\n",
-         mem_limit, bm_sz);
-#endif // DEBUG
-
-  // Allocate physical memory for bitmap in first usable region
-  // large enough for it.
-  void *mem_bitmap_paddr = NULL;
+  // Make sure regions are usable. If not usable, we perform some normalization
+  // on the region. The Limine spec guarantees that usable regions are
+  // page-aligned and usable, whereas neither are guaranteed for non-usable
+  // regions. This has to be done before sizing the metadata, which depends on
+  // which sections contain usable memory.
   for (size_t mmap_entry_i = 0; mmap_entry_i < entry_count; ++mmap_entry_i) {
     struct limine_memmap_entry *mmap_entry = init_mmap + mmap_entry_i;
-
-    // Make sure region is usable. If not usable, we perform some
-    // normalization on the region. The Limine spec guarantees that usable
-    // regions are page-aligned and usable, whereas neither are guaranteed for
-    // non-usable regions.
-    //
-    // TODO(jlam55555): Should separate the normalization logic out into a
-    // separate function. Currently we do it inline because it doesn't require
-    // an extra pass, but it's a little confusing to be included here.
     if (mmap_entry->type != LIMINE_MEMMAP_USABLE) {
       // Normalize region; make sure it's page-aligned. The Limine spec dictates
       // that entries that are not usable or bootloader-reclaimable may be
@@ -73,31 +150,63 @@ void phys_mem_init(struct limine_memmap_entry *init_mmap, size_t entry_count) {
                               mmap_entry->base) {
         (mmap_entry - 1)->length = mmap_entry->base - (mmap_entry - 1)->base;
       }
-      continue;
     }
+  }
+
+  // Metadata size is (dimensional analysis):
+  // present sections * pages/section * sizeof(struct page) bytes/page, plus
+  // the section table and summary bitmaps.
+  const size_t md_sz = phys_rra_metadata_sz(mem_limit, init_mmap, entry_count);
 
-    // Found a region large enough.
-    if (!mem_bitmap_paddr && mmap_entry->length >= bm_sz) {
-      mem_bitmap_paddr = (void *)mmap_entry->base;
+#ifdef DEBUG
+  // For diagnostic purposes.
+  printf("Maximum physical address=%lx\r\nstruct page metadata size=%lx\r\n",
+         mem_limit, md_sz);
+#endif // DEBUG
+
+  // Allocate physical memory for the metadata in the first usable region large
+  // enough for it. This doesn't have to be in the first 4GiB, since Limine's
+  // HHDM (and ours) also maps all memmap entries above 4GiB.
+  void *md_paddr = NULL;
+  for (size_t mmap_entry_i = 0; mmap_entry_i < entry_count; ++mmap_entry_i) {
+    struct limine_memmap_entry *mmap_entry = init_mmap + mmap_entry_i;
+    if (mmap_entry->type == LIMINE_MEMMAP_USABLE &&
+        mmap_entry->length >= md_sz) {
+      md_paddr = (void *)mmap_entry->base;
+      break;
     }
   }
 
-  // No usable regions large enough for memory bitmap.
-  assert(mem_bitmap_paddr);
+  // No usable regions large enough for the metadata.
+  assert(md_paddr);
+
+  // Initialize the round robin allocator. Only the first chunk of memory is
+  // initialized now; the rest is initialized in the background (or on demand),
+  // using a copy of the memmap.
+  assert(entry_count <= PHYS_MMAP_MAX_ENTRIES);
+  memcpy(_phys_mmap, init_mmap, entry_count * sizeof(*init_mmap));
+  phys_rra_init(&_phys_allocator, md_paddr, mem_limit, _phys_mmap, entry_count,
+                0);
 
-  // Make sure this usable region lies within the identity-mapped region
-  // provided by Limine (first four GiB), otherwise we will fall outside the VM
-  // address space. This is not unsolvable, but it may be a little annoying to
-  // deal with.
-  assert((size_t)mem_bitmap_paddr + bm_sz <= 4 * GiB);
+  // Only the main allocator has per-CPU page caches.
+  for (unsigned cpu = 0; cpu < NR_CPUS; ++cpu) {
+    phys_pcp_init(&_phys_pcps[cpu]);
+  }
+  _phys_allocator.pcp = _phys_pcps;
 
-  // Initialize the round robin allocator.
-  phys_rra_init(&_phys_allocator, mem_bitmap_paddr, mem_limit, init_mmap,
-                entry_count, 0);
+  // Reserve the contiguous memory area while memory is still unfragmented.
+  // Device buffers usually need to be in 32-bit memory.
+  if (!phys_rra_cma_reserve(&_phys_allocator, PHYS_CMA_ORDER,
+                            PHYS_ALLOC_DMA32)) {
+#ifdef DEBUG
+    printf("Not enough memory for the CMA area\r\n");
+#endif // DEBUG
+  }
 }
 
 void phys_reclaim_bootloader_mem(struct limine_memmap_entry *init_mmap,
                                  size_t entry_count) {
+  _phys_allocator.bootloader_reclaimed = true;
   for (size_t mmap_entry_i = 0; mmap_entry_i < entry_count; ++mmap_entry_i) {
     struct limine_memmap_entry *mmap_entry = init_mmap + mmap_entry_i;
     if (mmap_entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE) {
@@ -108,7 +217,7 @@ void phys_reclaim_bootloader_mem(struct limine_memmap_entry *init_mmap,
 }
 
 void *phys_alloc_page(void) {
-  const void *rv = phys_rra_alloc_order(&_phys_allocator, 0);
+  const void *rv = phys_rra_alloc_order(&_phys_allocator, 0, 0);
   if (rv) {
     return VM_TO_HHDM(rv);
   }
@@ -119,23 +228,165 @@ void phys_free_page(const void *pg) {
   phys_rra_free_order(&_phys_allocator, VM_TO_IDM(pg), 0);
 }
 
+void phys_free_page_cold(const void *pg) {
+  const uint64_t irq = op_irq_save();
+  if (!_phys_cma_free(&_phys_allocator, VM_TO_IDM(pg), 1)) {
+    _phys_pcp_free(&_phys_allocator, VM_TO_IDM(pg), true);
+  }
+  op_irq_restore(irq);
+}
+
+size_t phys_alloc_bulk(size_t n, void **out) {
+  n = phys_rra_alloc_bulk(&_phys_allocator, 0, n, out, 0);
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = VM_TO_HHDM(out[i]);
+  }
+  return n;
+}
+
+void phys_free_bulk(size_t n, void *const *pgs) {
+  const uint64_t irq = op_irq_save();
+  for (size_t i = 0; i < n; ++i) {
+    if (!_phys_cma_free(&_phys_allocator, VM_TO_IDM(pgs[i]), 1)) {
+      _phys_buddy_free(&_phys_allocator, VM_TO_IDM(pgs[i]), 0);
+    }
+  }
+  op_irq_restore(irq);
+}
+
+void *phys_alloc_zeroed_page(void) {
+  void *pg;
+  return phys_alloc_zeroed_bulk(1, &pg) ? pg : NULL;
+}
+
+size_t phys_alloc_zeroed_bulk(size_t n, void **out) {
+  n = phys_rra_alloc_zeroed_bulk(&_phys_allocator, n, out);
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = VM_TO_HHDM(out[i]);
+  }
+  return n;
+}
+
+void phys_page_get(const void *pg) {
+  phys_rra_page_get(&_phys_allocator, VM_TO_IDM(pg));
+}
+
+void phys_page_put(const void *pg) {
+  phys_rra_page_put(&_phys_allocator, VM_TO_IDM(pg));
+}
+
+void *phys_alloc_huge(enum phys_huge size) {
+  void *const rv = phys_rra_alloc_huge(&_phys_allocator, size, 0);
+  return rv ? VM_TO_HHDM(rv) : NULL;
+}
+
+void phys_free_huge(const void *pg) {
+  phys_rra_free_huge(&_phys_allocator, VM_TO_IDM(pg));
+}
+
+void *phys_cma_alloc(size_t pg_count) {
+  void *const rv = phys_rra_cma_alloc(&_phys_allocator, pg_count, 0);
+  return rv ? VM_TO_HHDM(rv) : NULL;
+}
+
+void phys_cma_free(const void *pg, size_t pg_count) {
+  phys_rra_cma_free(&_phys_allocator, VM_TO_IDM(pg), pg_count);
+}
+
 struct phys_rra *phys_mem_get_rra(void) {
   return &_phys_allocator;
 }
+/**
+ * Keep the summary bitmaps in sync with the `struct page` array.
+ */
+static void _phys_bm_set_used(struct phys_rra *rra, size_t pfn) {
+  BM_SET(rra->used_bm, pfn);
+  if (!~_BM_WORD(rra->used_bm, pfn)) {
+    BM_SET(rra->full_bm, pfn >> 6);
+  }
+}
+static void _phys_bm_clear_used(struct phys_rra *rra, size_t pfn) {
+  BM_CLEAR(rra->used_bm, pfn);
+  BM_CLEAR(rra->full_bm, pfn >> 6);
+}
+
+/**
+ * Returns the first free page at or after `pfn`, or `total_pg` if there is
+ * none. Uses `full_bm` to skip over fully-used regions.
+ */
+static size_t _phys_bm_next_free(const struct phys_rra *rra, size_t pfn) {
+  const size_t words = BM_WORDS64(rra->total_pg);
+  const size_t summary_words = BM_WORDS64(words);
+
+  size_t w = pfn >> 6;
+  if (w >= words) {
+    return rra->total_pg;
+  }
+  uint64_t bits = ~rra->used_bm[w] & (~0lu << (pfn & 63));
+  while (!bits) {
+    // Find the next word of `used_bm` that isn't full.
+    if (++w >= words) {
+      return rra->total_pg;
+    }
+    size_t w1 = w >> 6;
+    uint64_t summary_bits = ~rra->full_bm[w1] & (~0lu << (w & 63));
+    while (!summary_bits) {
+      if (++w1 >= summary_words) {
+        return rra->total_pg;
+      }
+      summary_bits = ~rra->full_bm[w1];
+    }
+    w = (w1 << 6) + op_bsf(summary_bits);
+    bits = ~rra->used_bm[w];
+  }
+  return (w << 6) + op_bsf(bits);
+}
+
+/**
+ * Returns the first used (allocated or unusable) page at or after `pfn`, or
+ * `total_pg` if there is none.
+ */
+static size_t _phys_bm_next_used(const struct phys_rra *rra, size_t pfn) {
+  const size_t words = BM_WORDS64(rra->total_pg);
+
+  size_t w = pfn >> 6;
+  if (w >= words) {
+    return rra->total_pg;
+  }
+  uint64_t bits = rra->used_bm[w] & (~0lu << (pfn & 63));
+  while (!bits) {
+    if (++w >= words) {
+      return rra->total_pg;
+    }
+    bits = rra->used_bm[w];
+  }
+  const size_t rv = (w << 6) + op_bsf(bits);
+  return rv < rra->total_pg ? rv : rra->total_pg;
+}
+
 /**
  * Allocates a physical page. Errors if the page is unusable (e.g., hole
  * memory). Returns true iff the physical page is free.
+ *
+ * This only performs the per-page bookkeeping; it doesn't touch the buddy free
+ * lists.
  */
 bool _phys_rra_alloc(struct phys_rra *rra, const void *addr) {
   assert(addr);
-  const size_t pg = (size_t)(addr - rra->phys_offset) >> PG_SZ_BITS;
+  const size_t pg = _phys_rra_pfn(rra, addr);
   assert(pg < rra->total_pg);
-  assert(!rra->mem_bitmap[pg].unusable);
-  if (rra->mem_bitmap[pg].present) {
+  struct page *const page = _phys_rra_page(rra, pg);
+  assert(!page->unusable);
+  if (page->present) {
     // Already allocated.
     return false;
   }
-  rra->mem_bitmap[pg].present = true;
+  page->present = true;
+  page->migrate_type = 0;
+  page->huge = false;
+  page->flags = 0;
+  page->refcount = 1;
+  _phys_bm_set_used(rra, pg);
   ++rra->allocated_pg;
   return true;
 }
@@ -143,17 +394,26 @@ bool _phys_rra_alloc(struct phys_rra *rra, const void *addr) {
 /**
  * Frees a physical page. Errors if the page is unusable (e.g., hole memory).
  * Returns true iff the physical page is allocated.
+ *
+ * This only performs the per-page bookkeeping; it doesn't touch the buddy free
+ * lists.
  */
 bool _phys_rra_free(struct phys_rra *rra, const void *addr) {
   assert(addr);
   assert(PG_ALIGNED(addr));
-  const size_t pg = (size_t)(addr - rra->phys_offset) >> PG_SZ_BITS;
-  assert(!rra->mem_bitmap[pg].unusable);
-  if (!rra->mem_bitmap[pg].present) {
+  const size_t pg = _phys_rra_pfn(rra, addr);
+  struct page *const page = _phys_rra_page(rra, pg);
+  assert(!page->unusable);
+  if (!page->present) {
     // Not allocated.
     return false;
   }
-  rra->mem_bitmap[pg].present = false;
+  assert(!page->mapcount);
+  page->present = false;
+  page->migrate_type = 0;
+  page->flags = 0;
+  page->refcount = 0;
+  _phys_bm_clear_used(rra, pg);
   --rra->allocated_pg;
   return true;
 }
@@ -174,8 +434,11 @@ static void _phys_rra_alloc_region(struct phys_rra *rra, void *addr,
   for (size_t i = 0; i < pg_count; ++i, addr += PG_SZ) {
     if (is_unusable) {
       size_t pg = (size_t)addr >> PG_SZ_BITS;
-      assert(!rra->mem_bitmap[pg].present);
-      rra->mem_bitmap[pg].unusable = true;
+      struct page *const page = _phys_rra_page(rra, pg);
+      assert(!page->present);
+      page->unusable = true;
+      _phys_bm_set_used(rra, pg);
+      ++_phys_rra_zone(rra, pg)->unusable_pg;
     } else {
       assert(_phys_rra_alloc(rra, addr));
     }
@@ -187,8 +450,149 @@ static void _phys_rra_alloc_region(struct phys_rra *rra, void *addr,
 }
 
 /**
- * Note that we actually set mem_bitmap to the high-mem-mapped version of addr,
- * because we will not provide the low-mem identity mapping in the new
+ * Add/remove the free block of order `order` starting at page `pfn` to/from the
+ * buddy free lists of its zone.
+ */
+static void _phys_buddy_push(struct phys_rra *rra, size_t pfn, unsigned order) {
+  struct page *const page = _phys_rra_page(rra, pfn);
+  struct phys_zone *const zone = _phys_rra_zone(rra, pfn);
+  assert(!page->buddy);
+  page->buddy = true;
+  page->order = order;
+  list_add(&zone->free_lists[order], &page->context.free_ll);
+  ++zone->free_blocks[order];
+  zone->free_pg += 1lu << order;
+}
+static void _phys_buddy_remove(struct phys_rra *rra, size_t pfn,
+                               unsigned order) {
+  struct page *const page = _phys_rra_page(rra, pfn);
+  struct phys_zone *const zone = _phys_rra_zone(rra, pfn);
+  assert(page->buddy && page->order == order);
+  page->buddy = false;
+  list_del(&page->context.free_ll);
+  --zone->free_blocks[order];
+  zone->free_pg -= 1lu << order;
+}
+
+/**
+ * Return a (bookkeeping-wise already freed) block to the buddy free lists,
+ * merging it with its buddy as many times as possible.
+ */
+static void _phys_buddy_free_block(struct phys_rra *rra, size_t pfn,
+                                   unsigned order) {
+  for (; order < PHYS_MAX_ORDER; ++order) {
+    const size_t buddy_pfn = pfn ^ (1lu << order);
+    if (buddy_pfn >= rra->init_pg ||
+        _phys_pfn_zone(buddy_pfn) != _phys_pfn_zone(pfn) ||
+        !rra->sections[buddy_pfn >> PHYS_SECTION_PG_BITS]) {
+      break;
+    }
+
+    // The buddy must be exactly a free block of the same order. If it is free
+    // but of a smaller order, then part of it is still allocated.
+    const struct page *const buddy = _phys_rra_page(rra, buddy_pfn);
+    if (!buddy->buddy || buddy->order != order) {
+      break;
+    }
+
+    _phys_buddy_remove(rra, buddy_pfn, order);
+    pfn &= ~(1lu << order);
+  }
+  _phys_buddy_push(rra, pfn, order);
+}
+
+/**
+ * Hand the (free, usable) pages [pfn, pfn_end) to the buddy allocator, split
+ * into the largest naturally-aligned blocks possible that don't cross zone
+ * boundaries.
+ */
+static void _phys_rra_free_range(struct phys_rra *rra, size_t pfn,
+                                 size_t pfn_end) {
+  while (pfn < pfn_end) {
+    const size_t zone_end = _phys_rra_zone(rra, pfn)->end_pg;
+    const size_t block_end = pfn_end < zone_end ? pfn_end : zone_end;
+
+    // Largest order allowed by the alignment of pfn and the size of the range.
+    unsigned order = pfn ? op_bsr(pfn & -pfn) : PHYS_MAX_ORDER;
+    const unsigned size_order = op_bsr(block_end - pfn);
+    if (order > size_order) {
+      order = size_order;
+    }
+    if (order > PHYS_MAX_ORDER) {
+      order = PHYS_MAX_ORDER;
+    }
+
+    _phys_buddy_free_block(rra, pfn, order);
+    pfn += 1lu << order;
+  }
+}
+
+/**
+ * Returns true iff a section contains usable (or bootloader-reclaimable)
+ * memory, and thus needs `struct page`s.
+ */
+static bool _phys_section_present(size_t section,
+                                  const struct limine_memmap_entry *init_mmap,
+                                  size_t entry_count) {
+  const size_t start = section << (PHYS_SECTION_PG_BITS + PG_SZ_BITS);
+  const size_t end = start + (PHYS_SECTION_PG << PG_SZ_BITS);
+  for (size_t mmap_entry_i = 0; mmap_entry_i < entry_count; ++mmap_entry_i) {
+    const struct limine_memmap_entry *mmap_entry = init_mmap + mmap_entry_i;
+    const size_t base = (size_t)VM_TO_IDM(mmap_entry->base);
+    if ((mmap_entry->type == LIMINE_MEMMAP_USABLE ||
+         mmap_entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE) &&
+        base < end && base + mmap_entry->length > start) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Lay out the metadata buffer `md`: the section table, then the summary
+ * bitmaps, then the `struct page` arrays of the present sections. Returns the
+ * size of the metadata. If `rra` is non-NULL, its section table and bitmap
+ * pointers are set up.
+ */
+static size_t _phys_rra_layout(struct phys_rra *rra, void *md, size_t mem_limit,
+                               const struct limine_memmap_entry *init_mmap,
+                               size_t entry_count) {
+  const size_t total_pg = mem_limit >> PG_SZ_BITS;
+  const size_t nr_sections =
+      (total_pg + PHYS_SECTION_PG - 1) >> PHYS_SECTION_PG_BITS;
+  const size_t words = BM_WORDS64(total_pg);
+
+  size_t sz = nr_sections * sizeof(struct page *);
+  if (rra) {
+    rra->sections = md;
+    rra->nr_sections = nr_sections;
+    rra->used_bm = md + sz;
+    rra->full_bm = rra->used_bm + words;
+  }
+  sz += (words + BM_WORDS64(words)) * sizeof(uint64_t);
+
+  // `struct page`s are cache-line aligned.
+  sz = (sz + _Alignof(struct page) - 1) & ~(_Alignof(struct page) - 1);
+
+  for (size_t section = 0; section < nr_sections; ++section) {
+    const bool present =
+        _phys_section_present(section, init_mmap, entry_count);
+    if (rra) {
+      rra->sections[section] = present ? md + sz : NULL;
+    }
+    if (present) {
+      const size_t pfn = section << PHYS_SECTION_PG_BITS;
+      const size_t pages = total_pg - pfn < PHYS_SECTION_PG ? total_pg - pfn
+                                                            : PHYS_SECTION_PG;
+      sz += pages * sizeof(struct page);
+    }
+  }
+  return sz;
+}
+
+/**
+ * Note that we actually set the metadata to the high-mem-mapped version of
+ * addr, because we will not provide the low-mem identity mapping in the new
  * pagetable. (See mem/virt.h).
  *
  * TODO(jlam55555): We are making the subtle assumption here that VM_HM_START is
@@ -204,115 +608,1112 @@ void phys_rra_init(struct phys_rra *rra, void *addr, size_t mem_limit,
   rra->total_pg = mem_limit >> PG_SZ_BITS;
   rra->allocated_pg = 0;
   rra->unusable_pg = 0;
-  rra->needle = 0;
   rra->phys_offset = phys_offset;
+  rra->pcp = NULL;
+  list_init(&rra->zeroed_pages);
+  rra->zeroed_count = 0;
+  rra->init_pg = 0;
+  rra->init_mmap = init_mmap;
+  rra->entry_count = entry_count;
+  rra->bootloader_reclaimed = false;
+  rra->init_cycles_deferred = 0;
+  rra->compact_attempts = 0;
+  rra->compact_successes = 0;
+  rra->compact_moved = 0;
+  rra->cma.start_pg = 0;
+  rra->cma.pg_count = 0;
+  const uint64_t start_tsc = op_rdtsc();
+
+  // Zone boundaries, clipped to the end of memory.
+  static const size_t zone_limits[PHYS_NR_ZONES] = {
+      [PHYS_ZONE_DMA] = PHYS_ZONE_DMA_LIMIT >> PG_SZ_BITS,
+      [PHYS_ZONE_DMA32] = PHYS_ZONE_DMA32_LIMIT >> PG_SZ_BITS,
+      [PHYS_ZONE_NORMAL] = SIZE_MAX,
+  };
+  size_t zone_start = 0;
+  for (unsigned z = 0; z < PHYS_NR_ZONES; ++z) {
+    struct phys_zone *const zone = &rra->zones[z];
+    for (unsigned order = 0; order <= PHYS_MAX_ORDER; ++order) {
+      list_init(&zone->free_lists[order]);
+      zone->free_blocks[order] = 0;
+    }
+    zone->start_pg = zone_start;
+    zone->end_pg =
+        zone_limits[z] < rra->total_pg ? zone_limits[z] : rra->total_pg;
+    zone->unusable_pg = 0;
+    zone->free_pg = 0;
+    zone_start = zone->end_pg;
+  }
 
   // Use HM version of address.
-  rra->mem_bitmap = VM_TO_HHDM(addr);
+  assert(!((size_t)addr & (_Alignof(struct page) - 1)));
+  _phys_rra_layout(rra, VM_TO_HHDM(addr), mem_limit, init_mmap, entry_count);
+  const size_t words = BM_WORDS64(rra->total_pg);
+
+  // Initialize the summary bitmaps: all pages start out used (uninitialized),
+  // including the bits past the end of memory, so that they are never
+  // considered free. The `struct page` array is initialized a chunk at a time.
+  memset(rra->used_bm, 0xff, (words + BM_WORDS64(words)) * sizeof(uint64_t));
+
+  // Initialize the first chunk eagerly.
+  _phys_rra_init_next_chunk(rra);
+  rra->init_cycles_eager = op_rdtsc() - start_tsc;
+  // The first chunk doesn't count as deferred.
+  rra->init_cycles_deferred = 0;
+}
 
-  // Initialize bitmap. bm_sz = "bitmap size"
-  const size_t bm_sz = rra->total_pg * sizeof(struct page);
-  memset(rra->mem_bitmap, 0, bm_sz);
+/**
+ * Mark pages [pfn, pfn_end) clipped to [start, end) as unusable or allocated.
+ * See `_phys_rra_alloc_region()`.
+ *
+ * Pages in absent sections are always unusable. They have no `struct page`s
+ * and are already marked used in the summary bitmaps, so they only need to be
+ * counted.
+ */
+static void _phys_rra_init_region(struct phys_rra *rra, size_t pfn,
+                                  size_t pfn_end, size_t start, size_t end,
+                                  bool is_unusable) {
+  pfn = pfn > start ? pfn : start;
+  pfn_end = pfn_end < end ? pfn_end : end;
+  while (pfn < pfn_end) {
+    const size_t section = pfn >> PHYS_SECTION_PG_BITS;
+    const size_t section_end = (section + 1) << PHYS_SECTION_PG_BITS;
+    const size_t run_end = pfn_end < section_end ? pfn_end : section_end;
+    if (rra->sections[section]) {
+      _phys_rra_alloc_region(rra, (void *)(pfn << PG_SZ_BITS), run_end - pfn,
+                             is_unusable);
+    } else {
+      assert(is_unusable);
+      rra->unusable_pg += run_end - pfn;
+      for (unsigned z = 0; z < PHYS_NR_ZONES; ++z) {
+        struct phys_zone *const zone = &rra->zones[z];
+        const size_t lo = pfn > zone->start_pg ? pfn : zone->start_pg;
+        const size_t hi = run_end < zone->end_pg ? run_end : zone->end_pg;
+        if (lo < hi) {
+          zone->unusable_pg += hi - lo;
+        }
+      }
+    }
+    pfn = run_end;
+  }
+}
+
+static bool _phys_rra_init_next_chunk(struct phys_rra *rra) {
+  const size_t start = rra->init_pg;
+  if (start == rra->total_pg) {
+    return false;
+  }
+  const uint64_t start_tsc = op_rdtsc();
+  const size_t end = rra->total_pg - start > PHYS_INIT_CHUNK_PG
+                         ? start + PHYS_INIT_CHUNK_PG
+                         : rra->total_pg;
+
+  // Initialize the `struct page`s of the present sections and clear their bits
+  // in the summary bitmaps. Sections are a multiple of 64 pages, and chunks are
+  // a multiple of sections.
+  for (size_t section = start >> PHYS_SECTION_PG_BITS;
+       section < rra->nr_sections && section << PHYS_SECTION_PG_BITS < end;
+       ++section) {
+    struct page *const pages = rra->sections[section];
+    if (!pages) {
+      continue;
+    }
+    const size_t pfn = section << PHYS_SECTION_PG_BITS;
+    const size_t n = end - pfn < PHYS_SECTION_PG ? end - pfn : PHYS_SECTION_PG;
+    memset(pages, 0, n * sizeof(struct page));
+    for (size_t i = 0; i < n; ++i) {
+      pages[i].section = section;
+    }
+    for (size_t w = pfn >> 6; w < BM_WORDS64(pfn + n); ++w) {
+      rra->used_bm[w] = 0;
+      BM_CLEAR(rra->full_bm, w);
+    }
+  }
+  for (size_t pfn = end; pfn < BM_WORDS64(end) << 6; ++pfn) {
+    _phys_bm_set_used(rra, pfn);
+  }
+  rra->init_pg = end;
 
   // Mark bitmap pages as allocated. This should only be done for the main rra,
   // as other bootstrapped rras (e.g., for testing) will not reference
   // themselves.
   if (rra == &_phys_allocator) {
-    _phys_rra_alloc_region(rra, VM_TO_IDM(rra->mem_bitmap), PG_COUNT(bm_sz),
-                           false);
+    const size_t md_pfn = (size_t)VM_TO_IDM(rra->sections) >> PG_SZ_BITS;
+    const size_t md_pg = PG_COUNT(phys_rra_metadata_sz(
+        rra->total_sz, rra->init_mmap, rra->entry_count));
+    _phys_rra_init_region(rra, md_pfn, md_pfn + md_pg, start, end, false);
   }
 
   // Mark unusable regions in the bitmap.
-  void *prev_end = NULL;
-  for (size_t mmap_entry_i = 0; mmap_entry_i < entry_count; ++mmap_entry_i) {
-    struct limine_memmap_entry *mmap_entry = init_mmap + mmap_entry_i;
+  size_t prev_end = 0;
+  for (size_t mmap_entry_i = 0; mmap_entry_i < rra->entry_count;
+       ++mmap_entry_i) {
+    const struct limine_memmap_entry *mmap_entry =
+        rra->init_mmap + mmap_entry_i;
+    const size_t pfn = (size_t)VM_TO_IDM(mmap_entry->base) >> PG_SZ_BITS;
+    const size_t pfn_end = pfn + PG_COUNT(mmap_entry->length);
 
     // Memory hole detected. Mark it as unusable memory.
-    if ((size_t)prev_end != mmap_entry->base) {
-      _phys_rra_alloc_region(rra, VM_TO_IDM(prev_end),
-                             PG_COUNT((void *)mmap_entry->base - prev_end),
-                             true);
+    if (prev_end != pfn) {
+      _phys_rra_init_region(rra, prev_end, pfn, start, end, true);
     }
-    prev_end = (void *)(mmap_entry->base + mmap_entry->length);
+    prev_end = pfn_end;
 
     // Mark unusable memory regions. (This includes bootloader-reclaimable
-    // memory regions, which will be freed/marked usable later on.)
-    if (mmap_entry->type != LIMINE_MEMMAP_USABLE) {
-      _phys_rra_alloc_region(rra, VM_TO_IDM(mmap_entry->base),
-                             PG_COUNT(mmap_entry->length), true);
+    // memory regions, which will be freed/marked usable later on, unless that
+    // has already happened.)
+    if (mmap_entry->type != LIMINE_MEMMAP_USABLE &&
+        !(mmap_entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE &&
+          rra->bootloader_reclaimed)) {
+      _phys_rra_init_region(rra, pfn, pfn_end, start, end, true);
     }
   }
+
+  // Build the buddy free lists from the remaining free runs of pages. Pages
+  // past `end` are all marked used, so the runs stop at `end`.
+  for (size_t pfn = _phys_bm_next_free(rra, start); pfn < end;) {
+    const size_t run_end = _phys_bm_next_used(rra, pfn);
+    _phys_rra_free_range(rra, pfn, run_end);
+    pfn = _phys_bm_next_free(rra, run_end);
+  }
+
+  // Done with the memmap.
+  if (end == rra->total_pg) {
+    rra->init_mmap = NULL;
+    rra->entry_count = 0;
+  }
+  rra->init_cycles_deferred += op_rdtsc() - start_tsc;
+  return true;
+}
+
+bool phys_rra_init_next_chunk(struct phys_rra *rra) {
+  const uint64_t irq = op_irq_save();
+  const bool initialized = _phys_rra_init_next_chunk(rra);
+  op_irq_restore(irq);
+  return initialized;
+}
+
+size_t phys_rra_metadata_sz(size_t mem_limit,
+                            const struct limine_memmap_entry *init_mmap,
+                            size_t entry_count) {
+  return _phys_rra_layout(NULL, NULL, mem_limit, init_mmap, entry_count);
 }
 
 void phys_mem_print_stats(void) {
+  // Uninitialized pages are not counted as usable yet.
+  const size_t usable_pg =
+      _phys_allocator.init_pg - _phys_allocator.unusable_pg;
   printf("\rPhysical page usage %u%%: %lu/%lu pages (%lu/%lu bytes)\r\n",
-         _phys_allocator.allocated_pg * 100 /
-             (_phys_allocator.total_pg - _phys_allocator.unusable_pg),
-         _phys_allocator.allocated_pg,
-         (_phys_allocator.total_pg - _phys_allocator.unusable_pg),
-         _phys_allocator.allocated_pg << PG_SZ_BITS,
-         _phys_allocator.total_sz -
-             (_phys_allocator.unusable_pg << PG_SZ_BITS));
+         _phys_allocator.allocated_pg * 100 / usable_pg,
+         _phys_allocator.allocated_pg, usable_pg,
+         _phys_allocator.allocated_pg << PG_SZ_BITS, usable_pg << PG_SZ_BITS);
+
+  size_t pcp_pg = 0;
+  for (unsigned cpu = 0; cpu < NR_CPUS; ++cpu) {
+    pcp_pg += _phys_pcps[cpu].count;
+  }
+  printf("Pages in per-CPU caches: %lu\r\n", pcp_pg);
+  printf("Pages in pre-zeroed pool: %lu\r\n", _phys_allocator.zeroed_count);
+  printf("struct page init: %lu cycles eager, %lu cycles deferred, %lu pages "
+         "pending\r\n",
+         _phys_allocator.init_cycles_eager,
+         _phys_allocator.init_cycles_deferred,
+         _phys_allocator.total_pg - _phys_allocator.init_pg);
+  printf("Compaction: %lu/%lu attempts succeeded, %lu pages moved\r\n",
+         _phys_allocator.compact_successes, _phys_allocator.compact_attempts,
+         _phys_allocator.compact_moved);
+  const struct phys_cma *const cma = &_phys_allocator.cma;
+  printf("CMA: pages [%lx, %lx), %lu used (%lu lent), %lu reclaimed from "
+         "borrowers\r\n",
+         cma->start_pg, cma->start_pg + cma->pg_count, cma->used_pg,
+         cma->lent_pg, cma->reclaimed_pg);
+
+  static const char *const zone_names[PHYS_NR_ZONES] = {
+      [PHYS_ZONE_DMA] = "DMA",
+      [PHYS_ZONE_DMA32] = "DMA32",
+      [PHYS_ZONE_NORMAL] = "Normal",
+  };
+  for (unsigned z = 0; z < PHYS_NR_ZONES; ++z) {
+    const struct phys_zone *const zone = &_phys_allocator.zones[z];
+    // Uninitialized pages are not counted as usable yet.
+    size_t init_end = _phys_allocator.init_pg;
+    init_end = init_end < zone->start_pg  ? zone->start_pg
+               : init_end > zone->end_pg ? zone->end_pg
+                                         : init_end;
+    printf("Zone %s: pages [%lx, %lx), %lu usable, %lu free\r\n",
+           zone_names[z], zone->start_pg, zone->end_pg,
+           init_end - zone->start_pg - zone->unusable_pg, zone->free_pg);
+    if (zone->start_pg == zone->end_pg) {
+      continue;
+    }
+    printf("  Free blocks per order:");
+    for (unsigned order = 0; order <= PHYS_MAX_ORDER; ++order) {
+      printf(" %u:%lu", order, zone->free_blocks[order]);
+    }
+    printf("\r\n");
+  }
 }
 
 /**
- * Helper function to check if a continuous region of size 2^order can be
- * allocated at the current needle position in `rra`.
+ * Returns the highest zone that an allocation with `flags` may be served from.
  */
-bool _phys_rra_can_alloc_order_at(const struct phys_rra *rra, size_t order) {
-  const size_t pages = 1u << order;
+static enum phys_zone_type _phys_flags_zone(unsigned flags) {
+  if (flags & PHYS_ALLOC_DMA) {
+    return PHYS_ZONE_DMA;
+  }
+  if (flags & PHYS_ALLOC_DMA32) {
+    return PHYS_ZONE_DMA32;
+  }
+  return PHYS_ZONE_NORMAL;
+}
 
-  // Not enough contiguous pages left after the needle.
-  if (rra->needle + pages > rra->total_pg) {
+/**
+ * Allocate up to `n` blocks of order `order` directly from the buddy free
+ * lists, storing them in `out`. Returns the number of blocks allocated. Zones
+ * are tried from the highest zone allowed by `flags` downwards.
+ *
+ * Each free block that is taken off the free lists is carved into as many
+ * blocks as needed, rather than being split and re-merged once per block.
+ */
+static size_t _phys_buddy_alloc_bulk(struct phys_rra *rra, unsigned order,
+                                     size_t n, void **out, unsigned flags) {
+  struct phys_zone *zone = &rra->zones[_phys_flags_zone(flags)];
+  unsigned block_order = order;
+  size_t allocated = 0;
+  while (allocated < n) {
+    // Find the smallest free block that is large enough in the highest zone
+    // possible.
+    ++_phys_scan_len;
+    if (list_empty(&zone->free_lists[block_order])) {
+      if (++block_order > PHYS_MAX_ORDER) {
+        if (zone == rra->zones) {
+          // OOM (or too fragmented).
+          break;
+        }
+        --zone;
+        block_order = order;
+      }
+      continue;
+    }
+    struct page *const page = list_entry(zone->free_lists[block_order].next,
+                                         struct page, context.free_ll);
+    const size_t pfn = _phys_page_pfn(rra, page);
+    _phys_buddy_remove(rra, pfn, block_order);
+
+    // Take blocks from the bottom of the free block and return the rest to the
+    // free lists. Taking the lowest blocks means that allocations are packed
+    // towards lower addresses when there is no fragmentation.
+    size_t count = 1lu << (block_order - order);
+    if (count > n - allocated) {
+      count = n - allocated;
+    }
+    const size_t taken_pg = count << order;
+    _phys_rra_alloc_region(rra, _phys_rra_addr(rra, pfn), taken_pg, false);
+    _phys_rra_free_range(rra, pfn + taken_pg, pfn + (1lu << block_order));
+    for (size_t i = 0; i < count; ++i) {
+      out[allocated++] = _phys_rra_addr(rra, pfn + (i << order));
+    }
+  }
+  return allocated;
+}
+
+/**
+ * Allocate a block directly from the buddy free lists.
+ */
+static void *_phys_buddy_alloc(struct phys_rra *rra, unsigned order,
+                               unsigned flags) {
+  void *pg;
+  return _phys_buddy_alloc_bulk(rra, order, 1, &pg, flags) ? pg : NULL;
+}
+
+/**
+ * Free a block directly to the buddy free lists.
+ */
+static void _phys_buddy_free(struct phys_rra *rra, const void *pg,
+                             unsigned order) {
+  const size_t pfn = _phys_rra_pfn(rra, pg);
+  assert(order <= PHYS_MAX_ORDER);
+  assert(!(pfn & ((1lu << order) - 1)));
+
+  const size_t pages = 1lu << order;
+  for (size_t i = 0; i < pages; ++i, pg += PG_SZ) {
+    assert(_phys_rra_free(rra, pg));
+  }
+  _phys_buddy_free_block(rra, pfn, order);
+}
+
+void phys_pcp_init(struct phys_pcp *pcp) {
+  list_init(&pcp->pages);
+  pcp->count = 0;
+}
+
+/**
+ * Move pages between a PCP and the buddy allocator, in batches of at most
+ * PHYS_PCP_BATCH pages. Refilling takes pages from the buddy allocator and adds
+ * them to the cold end of the PCP; draining releases the coldest pages.
+ */
+static void _phys_pcp_refill(struct phys_rra *rra, struct phys_pcp *pcp,
+                             size_t n) {
+  void *pgs[PHYS_PCP_BATCH];
+  assert(n <= PHYS_PCP_BATCH);
+  n = _phys_buddy_alloc_bulk(rra, 0, n, pgs, 0);
+  for (size_t i = 0; i < n; ++i) {
+    list_add_tail(&pcp->pages,
+                  &phys_rra_get_page(rra, pgs[i])->context.free_ll);
+  }
+  pcp->count += n;
+}
+static void _phys_pcp_drain(struct phys_rra *rra, struct phys_pcp *pcp,
+                            size_t n) {
+  void *pgs[PHYS_PCP_BATCH];
+  while (n && pcp->count) {
+    size_t batch = 0;
+    for (; batch < PHYS_PCP_BATCH && n && pcp->count; ++batch, --n) {
+      struct page *const page =
+          list_entry(pcp->pages.prev, struct page, context.free_ll);
+      list_del(&page->context.free_ll);
+      --pcp->count;
+      pgs[batch] = _phys_rra_addr(rra, _phys_page_pfn(rra, page));
+    }
+    phys_rra_free_bulk(rra, 0, batch, pgs);
+  }
+}
+
+static void *_phys_pcp_alloc(struct phys_rra *rra) {
+  struct phys_pcp *const pcp = &rra->pcp[cpu_id()];
+  if (!pcp->count) {
+    _phys_pcp_refill(rra, pcp, PHYS_PCP_BATCH);
+    if (!pcp->count) {
+      return NULL;
+    }
+  }
+
+  struct page *const page =
+      list_entry(pcp->pages.next, struct page, context.free_ll);
+  list_del(&page->context.free_ll);
+  --pcp->count;
+  return _phys_rra_addr(rra, _phys_page_pfn(rra, page));
+}
+
+static void _phys_pcp_free(struct phys_rra *rra, const void *pg, bool cold) {
+  struct phys_pcp *const pcp = &rra->pcp[cpu_id()];
+  struct page *const page = phys_rra_get_page(rra, pg);
+  assert(page->present && !page->mapcount);
+  page->migrate_type = 0;
+  page->flags = 0;
+  page->refcount = 1;
+  if (cold) {
+    list_add_tail(&pcp->pages, &page->context.free_ll);
+  } else {
+    list_add(&pcp->pages, &page->context.free_ll);
+  }
+  if (++pcp->count > PHYS_PCP_HIGH) {
+    _phys_pcp_drain(rra, pcp, PHYS_PCP_BATCH);
+  }
+}
+
+void phys_rra_drain_pcp(struct phys_rra *rra) {
+  if (!rra->pcp) {
+    return;
+  }
+  const uint64_t irq = op_irq_save();
+  for (unsigned cpu = 0; cpu < NR_CPUS; ++cpu) {
+    _phys_pcp_drain(rra, &rra->pcp[cpu], rra->pcp[cpu].count);
+  }
+  op_irq_restore(irq);
+}
+
+/**
+ * Return the pages in the pre-zeroed page pool to the buddy allocator.
+ */
+static void _phys_rra_drain_zeroed(struct phys_rra *rra) {
+  while (rra->zeroed_count) {
+    struct page *const page =
+        list_entry(rra->zeroed_pages.next, struct page, context.free_ll);
+    list_del(&page->context.free_ll);
+    --rra->zeroed_count;
+    _phys_buddy_free(rra, _phys_rra_addr(rra, _phys_page_pfn(rra, page)), 0);
+  }
+}
+
+size_t phys_rra_free_pg(struct phys_rra *rra) {
+  size_t free_pg = rra->total_pg - rra->init_pg + rra->zeroed_count;
+  for (unsigned zone = 0; zone < PHYS_NR_ZONES; ++zone) {
+    free_pg += rra->zones[zone].free_pg;
+  }
+  if (rra->pcp) {
+    for (unsigned cpu = 0; cpu < NR_CPUS; ++cpu) {
+      free_pg += rra->pcp[cpu].count;
+    }
+  }
+  return free_pg;
+}
+
+/**
+ * Called when an allocation of order `order` with `flags` fails. Makes more
+ * free pages available to the buddy allocator by initializing deferred pages,
+ * or by returning free pages held in caches. Returns false iff there is nothing
+ * left to try.
+ *
+ * The next deferred chunk is only initialized if it overlaps a zone allowed by
+ * `flags`, and not for huge allocations, which are more likely to fail from
+ * fragmentation than from a lack of free pages. `phys_zero_task()` initializes
+ * the rest in the background.
+ */
+static bool _phys_rra_grow_free(struct phys_rra *rra, unsigned order,
+                                unsigned flags) {
+  if (order < PHYS_HUGE_PMD &&
+      rra->init_pg < rra->zones[_phys_flags_zone(flags)].end_pg &&
+      _phys_rra_init_next_chunk(rra)) {
+    return true;
+  }
+
+  size_t cached_pg = rra->zeroed_count;
+  if (rra->pcp) {
+    for (unsigned cpu = 0; cpu < NR_CPUS; ++cpu) {
+      cached_pg += rra->pcp[cpu].count;
+    }
+  }
+  if (!cached_pg) {
     return false;
   }
+  phys_rra_drain_pcp(rra);
+  _phys_rra_drain_zeroed(rra);
+  return true;
+}
+
+/**
+ * Registered migration callbacks, indexed by migrate type. Type 0 means
+ * unmovable.
+ */
+static const struct phys_migrate_ops *_phys_migrate_ops[PHYS_MIGRATE_TYPES];
+static unsigned _phys_migrate_types = 1;
+
+unsigned phys_register_migrate_ops(const struct phys_migrate_ops *ops) {
+  assert(ops && ops->migrate);
+  assert(_phys_migrate_types < PHYS_MIGRATE_TYPES);
+  _phys_migrate_ops[_phys_migrate_types] = ops;
+  return _phys_migrate_types++;
+}
+
+void phys_rra_set_movable(struct phys_rra *rra, const void *pg,
+                          unsigned migrate_type) {
+  assert(migrate_type < _phys_migrate_types);
+  struct page *const page = phys_rra_get_page(rra, pg);
+  assert(page->present && !page->huge);
+  page->migrate_type = migrate_type;
+}
+
+/**
+ * Migrate the movable page `pfn` to a free page from the buddy allocator (or
+ * let its owner release it). Unless this fails, the caller owns the vacated
+ * page afterwards.
+ */
+static enum phys_migrate_result _phys_migrate_page(struct phys_rra *rra,
+                                                   size_t pfn) {
+  struct page *const page = _phys_rra_page(rra, pfn);
+  void *const new_pg = _phys_buddy_alloc(rra, 0, 0);
+  const enum phys_migrate_result result =
+      _phys_migrate_ops[page->migrate_type]->migrate(
+          rra, page, _phys_rra_addr(rra, pfn), new_pg);
+  assert(new_pg || result != PHYS_MIGRATE_MOVED);
+  if (new_pg && result != PHYS_MIGRATE_MOVED) {
+    _phys_buddy_free(rra, new_pg, 0);
+  }
+  if (result != PHYS_MIGRATE_FAIL) {
+    page->migrate_type = 0;
+    page->flags = 0;
+    page->refcount = 1;
+  }
+  return result;
+}
+
+/**
+ * Returns true iff movable page `page` may be migrated right now.
+ */
+static bool _phys_can_migrate(struct page *page) {
+  const struct phys_migrate_ops *const ops =
+      _phys_migrate_ops[page->migrate_type];
+  return ops && (!ops->can_migrate || ops->can_migrate(page));
+}
+
+/**
+ * Returns the number of (movable) used pages in the block of order `order`
+ * starting at page `pfn`, or SIZE_MAX if the block can't be compacted because
+ * it has unusable, uninitialized, or unmovable pages.
+ */
+static size_t _phys_compact_movable_pg(const struct phys_rra *rra, size_t pfn,
+                                       unsigned order) {
+  const size_t pfn_end = pfn + (1lu << order);
+  if (pfn_end > rra->init_pg) {
+    return SIZE_MAX;
+  }
+  // The CMA area is managed separately.
+  if (rra->cma.pg_count && pfn < rra->cma.start_pg + rra->cma.pg_count &&
+      rra->cma.start_pg < pfn_end) {
+    return SIZE_MAX;
+  }
+  for (size_t section = pfn >> PHYS_SECTION_PG_BITS;
+       section <= (pfn_end - 1) >> PHYS_SECTION_PG_BITS; ++section) {
+    if (!rra->sections[section]) {
+      return SIZE_MAX;
+    }
+  }
+
+  size_t movable = 0;
+  for (pfn = _phys_bm_next_used(rra, pfn); pfn < pfn_end;
+       pfn = _phys_bm_next_used(rra, pfn + 1)) {
+    struct page *const page = _phys_rra_page(rra, pfn);
+    if (page->unusable || !_phys_can_migrate(page)) {
+      return SIZE_MAX;
+    }
+    ++movable;
+  }
+  return movable;
+}
+
+/**
+ * Free up the block of order `order` starting at page `pfn` (which must be
+ * compactable, see `_phys_compact_movable_pg()`) by migrating its movable pages
+ * elsewhere. Returns true on success; on failure, pages that were already
+ * migrated stay migrated.
+ */
+static bool _phys_compact_block(struct phys_rra *rra, size_t pfn,
+                                unsigned order) {
+  const size_t pfn_end = pfn + (1lu << order);
+
+  // Isolate the free blocks inside the block (by allocating them), so that
+  // pages don't get migrated into it. Since buddy blocks are naturally aligned
+  // and the block has used pages, each free block lies entirely inside the
+  // block, and the first free page of each is the one on the free lists.
+  for (size_t i = _phys_bm_next_free(rra, pfn); i < pfn_end;) {
+    const struct page *const page = _phys_rra_page(rra, i);
+    assert(page->buddy);
+    const size_t pages = 1lu << page->order;
+    _phys_buddy_remove(rra, i, page->order);
+    _phys_rra_alloc_region(rra, _phys_rra_addr(rra, i), pages, false);
+    i = _phys_bm_next_free(rra, i + pages);
+  }
 
-  const struct page *entry = rra->mem_bitmap + rra->needle;
-  for (size_t i = 0; i < pages; ++i, ++entry) {
-    if (entry->present || entry->unusable) {
+  // Now, all pages in the block are either isolated or movable.
+  for (size_t i = pfn; i < pfn_end; ++i) {
+    struct page *const page = _phys_rra_page(rra, i);
+    if (!page->migrate_type) {
+      continue;
+    }
+
+    if (_phys_migrate_page(rra, i) == PHYS_MIGRATE_FAIL) {
+      // Give back the isolated and vacated pages: everything before this page,
+      // and the unmovable (isolated) pages after it.
+      for (size_t j = pfn; j < pfn_end; ++j) {
+        if (j != i && (j < i || !_phys_rra_page(rra, j)->migrate_type)) {
+          _phys_buddy_free(rra, _phys_rra_addr(rra, j), 0);
+        }
+      }
       return false;
     }
+    ++rra->compact_moved;
   }
+
+  // The whole block is isolated now.
+  _phys_buddy_free(rra, _phys_rra_addr(rra, pfn), order);
   return true;
 }
 
-void *phys_rra_alloc_order(struct phys_rra *rra, unsigned order) {
-  if (rra->allocated_pg == rra->total_pg) {
-    // OOM
+static bool _phys_rra_compact(struct phys_rra *rra, unsigned order,
+                              unsigned flags) {
+  if (!order || order > PHYS_MAX_ORDER) {
+    return false;
+  }
+  ++rra->compact_attempts;
+
+  // Pick the block with the fewest pages to move in the highest allowed zone.
+  // This is a linear scan, but compaction is only done when an allocation
+  // would fail otherwise, or at idle.
+  const size_t block_pg = 1lu << order;
+  for (unsigned z = _phys_flags_zone(flags) + 1; z-- > 0;) {
+    const struct phys_zone *const zone = &rra->zones[z];
+    size_t best_pfn = 0;
+    size_t best_movable = SIZE_MAX;
+    for (size_t pfn = (zone->start_pg + block_pg - 1) & ~(block_pg - 1);
+         pfn + block_pg <= zone->end_pg && best_movable > 1; pfn += block_pg) {
+      const size_t movable = _phys_compact_movable_pg(rra, pfn, order);
+      if (movable < best_movable) {
+        best_pfn = pfn;
+        best_movable = movable;
+      }
+    }
+
+    // (If nothing needs to be moved, the block is already free.)
+    if (best_movable != SIZE_MAX &&
+        (!best_movable || _phys_compact_block(rra, best_pfn, order))) {
+      ++rra->compact_successes;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool phys_rra_compact(struct phys_rra *rra, unsigned order, unsigned flags) {
+  const uint64_t irq = op_irq_save();
+  const bool compacted = _phys_rra_compact(rra, order, flags);
+  op_irq_restore(irq);
+  return compacted;
+}
+
+/**
+ * Returns true iff page `pfn` is in the CMA area.
+ */
+static inline bool _phys_cma_contains(const struct phys_rra *rra, size_t pfn) {
+  return pfn - rra->cma.start_pg < rra->cma.pg_count;
+}
+
+/**
+ * Returns true iff the CMA area may serve allocations with `flags`.
+ */
+static bool _phys_cma_allowed(const struct phys_rra *rra, unsigned flags) {
+  const struct phys_cma *const cma = &rra->cma;
+  return cma->pg_count &&
+         _phys_pfn_zone(cma->start_pg + cma->pg_count - 1) <=
+             _phys_flags_zone(flags);
+}
+
+bool phys_rra_cma_reserve(struct phys_rra *rra, unsigned order,
+                          unsigned flags) {
+  struct phys_cma *const cma = &rra->cma;
+  assert(order <= PHYS_CMA_MAX_ORDER);
+  assert(!cma->pg_count);
+
+  void *const pg = phys_rra_alloc_order(rra, order, flags);
+  if (!pg) {
+    return false;
+  }
+  cma->start_pg = _phys_rra_pfn(rra, pg);
+  cma->pg_count = 1lu << order;
+  memset(cma->used_bm, 0, sizeof(cma->used_bm));
+  memset(cma->lent_bm, 0, sizeof(cma->lent_bm));
+  cma->used_pg = 0;
+  cma->lent_pg = 0;
+  cma->reclaimed_pg = 0;
+  return true;
+}
+
+/**
+ * Returns true iff page `i` of the CMA area may be used for a CMA allocation:
+ * it is free, or lent out and movable.
+ */
+static bool _phys_cma_available(const struct phys_rra *rra, size_t i) {
+  const struct phys_cma *const cma = &rra->cma;
+  if (!BM_TEST(cma->used_bm, i)) {
+    return true;
+  }
+  return BM_TEST(cma->lent_bm, i) &&
+         _phys_can_migrate(_phys_rra_page(rra, cma->start_pg + i));
+}
+
+static void *_phys_cma_alloc(struct phys_rra *rra, size_t pg_count,
+                             unsigned align_order) {
+  struct phys_cma *const cma = &rra->cma;
+  const size_t align = 1lu << align_order;
+  if (!pg_count || align > cma->pg_count) {
     return NULL;
   }
 
-  const size_t start_needle = rra->needle;
-  const size_t pages = 1u << order;
-  while (!_phys_rra_can_alloc_order_at(rra, order)) {
-    if (++rra->needle >= rra->total_pg) {
-      rra->needle -= rra->total_pg;
+  // First fit. The area is small, so a linear scan is fine.
+  for (size_t start = 0; start + pg_count <= cma->pg_count; start += align) {
+    const size_t end = start + pg_count;
+    size_t i = start;
+    while (i < end && _phys_cma_available(rra, i)) {
+      ++i;
+    }
+    if (i < end) {
+      continue;
     }
 
-    // Could not allocate at this size.
-    if (rra->needle == start_needle) {
-      return NULL;
+    // Take back the lent pages.
+    for (i = start; i < end; ++i) {
+      if (!BM_TEST(cma->lent_bm, i)) {
+        continue;
+      }
+      if (_phys_migrate_page(rra, cma->start_pg + i) == PHYS_MIGRATE_FAIL) {
+        break;
+      }
+      BM_CLEAR(cma->lent_bm, i);
+      BM_CLEAR(cma->used_bm, i);
+      --cma->lent_pg;
+      --cma->used_pg;
+      ++cma->reclaimed_pg;
+    }
+    if (i < end) {
+      continue;
+    }
+
+    for (i = start; i < end; ++i) {
+      BM_SET(cma->used_bm, i);
+    }
+    cma->used_pg += pg_count;
+    return _phys_rra_addr(rra, cma->start_pg + start);
+  }
+  return NULL;
+}
+
+void *phys_rra_cma_alloc(struct phys_rra *rra, size_t pg_count,
+                         unsigned align_order) {
+  const uint64_t irq = op_irq_save();
+  void *const pg = _phys_cma_alloc(rra, pg_count, align_order);
+  op_irq_restore(irq);
+  return pg;
+}
+
+/**
+ * Lend a free page of the CMA area to a movable allocation. Pages are lent from
+ * the top of the area, since CMA allocations are first-fit.
+ */
+static void *_phys_cma_lend(struct phys_rra *rra) {
+  struct phys_cma *const cma = &rra->cma;
+  for (size_t w = BM_WORDS64(cma->pg_count); w-- > 0;) {
+    uint64_t free_bits = ~cma->used_bm[w];
+    if (cma->pg_count - (w << 6) < 64) {
+      free_bits &= (1lu << (cma->pg_count - (w << 6))) - 1;
+    }
+    if (free_bits) {
+      const size_t i = (w << 6) + op_bsr(free_bits);
+      BM_SET(cma->used_bm, i);
+      BM_SET(cma->lent_bm, i);
+      ++cma->used_pg;
+      ++cma->lent_pg;
+      return _phys_rra_addr(rra, cma->start_pg + i);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Return pages to the CMA area. Returns false (and does nothing) if the pages
+ * aren't in the CMA area.
+ */
+static bool _phys_cma_free(struct phys_rra *rra, const void *pg,
+                           size_t pg_count) {
+  struct phys_cma *const cma = &rra->cma;
+  const size_t pfn = _phys_rra_pfn(rra, pg);
+  if (!_phys_cma_contains(rra, pfn)) {
+    return false;
+  }
+  assert(_phys_cma_contains(rra, pfn + pg_count - 1));
+
+  for (size_t i = pfn - cma->start_pg; i < pfn - cma->start_pg + pg_count;
+       ++i) {
+    assert(BM_TEST(cma->used_bm, i));
+    if (BM_TEST(cma->lent_bm, i)) {
+      BM_CLEAR(cma->lent_bm, i);
+      --cma->lent_pg;
     }
+    BM_CLEAR(cma->used_bm, i);
+    struct page *const page = _phys_rra_page(rra, cma->start_pg + i);
+    assert(!page->mapcount);
+    page->migrate_type = 0;
+    page->flags = 0;
+    page->refcount = 1;
   }
+  cma->used_pg -= pg_count;
+  return true;
+}
 
-  // Don't move to the end of the allocated region. Although we could. This
-  // behavior is nicer if we often free a page right after allocating it.
-  void *phys_addr = (void *)((size_t)rra->needle << PG_SZ_BITS);
-  phys_addr += (uint64_t)rra->phys_offset;
-  _phys_rra_alloc_region(rra, phys_addr, pages, false);
-  return phys_addr;
+void phys_rra_cma_free(struct phys_rra *rra, const void *pg, size_t pg_count) {
+  const uint64_t irq = op_irq_save();
+  assert(_phys_cma_free(rra, pg, pg_count));
+  op_irq_restore(irq);
+}
+
+/**
+ * Returns true iff there is a free block of at least order `order` in any zone.
+ */
+static bool _phys_rra_has_free_block(const struct phys_rra *rra,
+                                     unsigned order) {
+  for (unsigned z = 0; z < PHYS_NR_ZONES; ++z) {
+    for (unsigned o = order; o <= PHYS_MAX_ORDER; ++o) {
+      if (rra->zones[z].free_blocks[o]) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/**
+ * Take up to `n` (at most PHYS_ZERO_BATCH) free pages to be zeroed, without
+ * letting the pre-zeroed pool exceed PHYS_ZERO_POOL_HIGH pages, and add them to
+ * the pool once they are zeroed. Zeroing is done by the caller in between, so
+ * that it can be done with interrupts enabled.
+ */
+static size_t _phys_zero_pool_take(struct phys_rra *rra, size_t n,
+                                   void **pgs) {
+  assert(n <= PHYS_ZERO_BATCH);
+  if (n > PHYS_ZERO_POOL_HIGH - rra->zeroed_count) {
+    n = PHYS_ZERO_POOL_HIGH - rra->zeroed_count;
+  }
+  // Don't drain the per-CPU caches for this; it's not worth it.
+  return _phys_buddy_alloc_bulk(rra, 0, n, pgs, 0);
+}
+static void _phys_zero_pool_add(struct phys_rra *rra, size_t n,
+                                void *const *pgs) {
+  for (size_t i = 0; i < n; ++i) {
+    list_add_tail(&rra->zeroed_pages,
+                  &phys_rra_get_page(rra, pgs[i])->context.free_ll);
+  }
+  rra->zeroed_count += n;
+}
+
+size_t phys_rra_zero_pages(struct phys_rra *rra, size_t n) {
+  void *pgs[PHYS_ZERO_BATCH];
+  const uint64_t irq = op_irq_save();
+  size_t zeroed = 0;
+  while (zeroed < n) {
+    const size_t batch =
+        n - zeroed < PHYS_ZERO_BATCH ? n - zeroed : PHYS_ZERO_BATCH;
+    const size_t taken = _phys_zero_pool_take(rra, batch, pgs);
+    for (size_t i = 0; i < taken; ++i) {
+      memset(VM_TO_HHDM(pgs[i]), 0, PG_SZ);
+    }
+    _phys_zero_pool_add(rra, taken, pgs);
+    zeroed += taken;
+    if (taken < batch) {
+      break;
+    }
+  }
+  op_irq_restore(irq);
+  return zeroed;
+}
+
+void phys_zero_task(void) {
+  // See `shell_init()`.
+  op_sti();
+
+  // The allocator isn't reentrant. The `phys_rra_*()` entry points mask
+  // interrupts, so no task is preempted while it is touching the allocator;
+  // this task does the same around the internal helpers below. The zeroing
+  // itself is done with interrupts enabled.
+  void *pgs[PHYS_ZERO_BATCH];
+  unsigned compact_backoff = 0;
+  for (;;) {
+    if (phys_rra_init_next_chunk(&_phys_allocator)) {
+      op_hlt();
+      continue;
+    }
+
+    op_cli();
+    const size_t n = _phys_zero_pool_take(&_phys_allocator, PHYS_ZERO_BATCH,
+                                          pgs);
+    op_sti();
+    for (size_t i = 0; i < n; ++i) {
+      memset(VM_TO_HHDM(pgs[i]), 0, PG_SZ);
+    }
+    op_cli();
+    _phys_zero_pool_add(&_phys_allocator, n, pgs);
+    op_sti();
+
+    // Once the pool is full, spend idle time on compaction if medium-sized
+    // blocks are running out.
+    if (!n && compact_backoff) {
+      --compact_backoff;
+    } else if (!n && !_phys_rra_has_free_block(&_phys_allocator,
+                                               PHYS_COMPACT_IDLE_ORDER)) {
+      if (!phys_rra_compact(&_phys_allocator, PHYS_COMPACT_IDLE_ORDER, 0)) {
+        compact_backoff = PHYS_COMPACT_IDLE_BACKOFF;
+      }
+    }
+
+    op_hlt();
+  }
+}
+
+size_t phys_rra_alloc_zeroed_bulk(struct phys_rra *rra, size_t n,
+                                  void **out) {
+  const uint64_t irq = op_irq_save();
+  size_t allocated = 0;
+  for (; allocated < n && rra->zeroed_count; ++allocated) {
+    struct page *const page =
+        list_entry(rra->zeroed_pages.next, struct page, context.free_ll);
+    list_del(&page->context.free_ll);
+    --rra->zeroed_count;
+    out[allocated] = _phys_rra_addr(rra, _phys_page_pfn(rra, page));
+  }
+  op_irq_restore(irq);
+  if (allocated == n) {
+    return n;
+  }
+
+  // Pool is empty. Zero the rest ourselves.
+  const size_t rest = phys_rra_alloc_bulk(rra, 0, n - allocated,
+                                          out + allocated, 0);
+  for (size_t i = allocated; i < allocated + rest; ++i) {
+    memset(VM_TO_HHDM(out[i]), 0, PG_SZ);
+  }
+  return allocated + rest;
+}
+
+void *phys_rra_alloc_order(struct phys_rra *rra, unsigned order,
+                           unsigned flags) {
+  if (order > PHYS_MAX_ORDER) {
+    return NULL;
+  }
+  const uint64_t irq = op_irq_save();
+  const uint64_t start_tsc = mem_stat_start();
+  const size_t scan_start = _phys_scan_len;
+
+  // Movable pages are borrowed from the CMA area if possible.
+  void *pg = NULL;
+  if (!order && (flags & PHYS_ALLOC_MOVABLE) && _phys_cma_allowed(rra, flags)) {
+    pg = _phys_cma_lend(rra);
+  }
+
+  // The per-CPU caches may hold pages from any zone, so zone-restricted
+  // allocations bypass them.
+  if (!pg) {
+    pg = !order && !flags && rra->pcp ? _phys_pcp_alloc(rra)
+                                      : _phys_buddy_alloc(rra, order, flags);
+  }
+
+  // Free pages may not be initialized yet, or be stuck in the per-CPU caches or
+  // the pre-zeroed pool. (For the per-CPU caches, this can happen if a larger
+  // order or a specific zone is requested, or if the pages are in another
+  // CPU's cache.)
+  while (!pg && _phys_rra_grow_free(rra, order, flags)) {
+    pg = _phys_buddy_alloc(rra, order, flags);
+  }
+
+  // Caches of other allocators (e.g., empty slabs) hold pages from the main
+  // allocator, and may be shrunk. This is done once; the pages can only
+  // coalesce into a free block if at least that many were freed. Shrunk pages
+  // may go to the per-CPU caches.
+  if (!pg && rra == &_phys_allocator && order <= PHYS_RECLAIM_MAX_ORDER &&
+      reclaim_shrink(1lu << order) >= 1lu << order) {
+    phys_rra_drain_pcp(rra);
+    pg = _phys_buddy_alloc(rra, order, flags);
+  }
+
+  // Otherwise, memory may be too fragmented.
+  if (!pg && order <= PHYS_COMPACT_MAX_ORDER &&
+      phys_rra_compact(rra, order, flags)) {
+    pg = _phys_buddy_alloc(rra, order, flags);
+  }
+
+  // As a last resort, high-order allocations may come from the CMA area.
+  if (!pg && order && _phys_cma_allowed(rra, flags)) {
+    pg = phys_rra_cma_alloc(rra, 1lu << order, order);
+  }
+
+  mem_stat_record(MEM_STAT_PHYS, MEM_STAT_ALLOC, order, start_tsc,
+                  _phys_scan_len - scan_start, !pg);
+  op_irq_restore(irq);
+  return pg;
 }
 
 void phys_rra_free_order(struct phys_rra *rra, const void *pg, unsigned order) {
-  const size_t pages = 1u << order;
-  for (unsigned i = 0; i < pages; ++i, pg += PG_SZ) {
-    assert(_phys_rra_free(rra, pg));
+  const uint64_t irq = op_irq_save();
+  const uint64_t start_tsc = mem_stat_start();
+  if (_phys_cma_free(rra, pg, 1lu << order)) {
+    // Returned to the CMA area.
+  } else if (!order && rra->pcp) {
+    _phys_pcp_free(rra, pg, false);
+  } else {
+    _phys_buddy_free(rra, pg, order);
+  }
+  mem_stat_record(MEM_STAT_PHYS, MEM_STAT_FREE, order, start_tsc, 0, false);
+  op_irq_restore(irq);
+}
+
+void *phys_rra_alloc_huge(struct phys_rra *rra, enum phys_huge size,
+                          unsigned flags) {
+  // Buddy blocks are aligned to their size, so this is naturally aligned.
+  const uint64_t irq = op_irq_save();
+  void *const pg = phys_rra_alloc_order(rra, size, flags);
+  if (pg) {
+    assert(!(_phys_rra_pfn(rra, pg) & ((1lu << size) - 1)));
+    struct page *const page = phys_rra_get_page(rra, pg);
+    page->huge = true;
+    page->order = size;
+  }
+  op_irq_restore(irq);
+  return pg;
+}
+
+void phys_rra_free_huge(struct phys_rra *rra, const void *pg) {
+  const uint64_t irq = op_irq_save();
+  struct page *const page = phys_rra_get_page(rra, pg);
+  assert(page->present && page->huge);
+  const unsigned order = page->order;
+  page->huge = false;
+  phys_rra_free_order(rra, pg, order);
+  op_irq_restore(irq);
+}
+
+size_t phys_rra_alloc_bulk(struct phys_rra *rra, unsigned order, size_t n,
+                           void **out, unsigned flags) {
+  if (order > PHYS_MAX_ORDER) {
+    return 0;
+  }
+
+  const uint64_t irq = op_irq_save();
+  size_t allocated = _phys_buddy_alloc_bulk(rra, order, n, out, flags);
+  while (allocated < n && _phys_rra_grow_free(rra, order, flags)) {
+    // See phys_rra_alloc_order().
+    allocated += _phys_buddy_alloc_bulk(rra, order, n - allocated,
+                                        out + allocated, flags);
+  }
+  while (allocated < n && order <= PHYS_COMPACT_MAX_ORDER &&
+         phys_rra_compact(rra, order, flags)) {
+    allocated += _phys_buddy_alloc_bulk(rra, order, n - allocated,
+                                        out + allocated, flags);
+  }
+  while (allocated < n && order && _phys_cma_allowed(rra, flags) &&
+         (out[allocated] = phys_rra_cma_alloc(rra, 1lu << order, order))) {
+    ++allocated;
   }
+  op_irq_restore(irq);
+  return allocated;
+}
+
+void phys_rra_free_bulk(struct phys_rra *rra, unsigned order, size_t n,
+                        void *const *pgs) {
+  const uint64_t irq = op_irq_save();
+  for (size_t i = 0; i < n; ++i) {
+    if (!_phys_cma_free(rra, pgs[i], 1lu << order)) {
+      _phys_buddy_free(rra, pgs[i], order);
+    }
+  }
+  op_irq_restore(irq);
+}
+
+void phys_rra_page_get(struct phys_rra *rra, const void *pg) {
+  const uint64_t irq = op_irq_save();
+  struct page *const page = phys_rra_get_page(rra, pg);
+  assert(page->present && page->refcount > 0);
+  ++page->refcount;
+  op_irq_restore(irq);
+}
+
+void phys_rra_page_put(struct phys_rra *rra, const void *pg) {
+  const uint64_t irq = op_irq_save();
+  struct page *const page = phys_rra_get_page(rra, pg);
+  assert(page->present && page->refcount > 0);
+  if (!--page->refcount) {
+    if (page->huge) {
+      phys_rra_free_huge(rra, pg);
+    } else {
+      phys_rra_free_order(rra, pg, 0);
+    }
+  }
+  op_irq_restore(irq);
 }
 
 struct page *phys_rra_get_page(struct phys_rra *rra, const void *pg) {
   if (pg) {
     pg -= (uint64_t)rra->phys_offset;
   }
-  return &rra->mem_bitmap[(size_t)pg >> PG_SZ_BITS];
+  return _phys_rra_page(rra, (size_t)pg >> PG_SZ_BITS);
+}
+
+void *phys_rra_page_addr(struct phys_rra *rra, const struct page *page) {
+  return _phys_rra_addr(rra, _phys_page_pfn(rra, page));
 }
@@ -1,33 +1,52 @@
 /**
- * Physical memory manager (PMM). Currently, this PMM keeps a struct page array
- * which keeps track of some metadata for all the physical pages of RAM.
- * Allocation simply involves a sequential scan of this array until a free page
- * is found.
+ * Physical memory manager (PMM). This PMM keeps a struct page array which keeps
+ * track of some metadata for all the physical pages of RAM. The array is sparse
+ * (see PHYS_SECTION_PG_BITS): it only covers sections containing usable memory.
  *
- * This is clearly not fast. Augmenting this with a bitmap or buddy allocator
- * will allow for faster allocations. A LIFO allocator similar to the slab
- * allocator may also work, but this requires much more storage (O(log2(N))) per
- * physical page.
+ * Allocation is done using a binary buddy allocator. Free memory is kept as
+ * naturally-aligned blocks of 2^order pages on per-order free lists (the
+ * free-list link lives in the `struct page` of the first page of each free
+ * block). Allocating a block of order N takes the first free block of order
+ * >= N and repeatedly splits it in half, returning the unused upper halves to
+ * the free lists. Freeing a block repeatedly merges it with its buddy (the
+ * other half of the parent block, found by flipping bit N of the page frame
+ * number) for as long as the buddy is also a free block of the same order.
+ * Thus, both allocation and freeing perform O(PHYS_MAX_ORDER) = O(log N)
+ * free-list operations, in addition to touching the `struct page`s of the
+ * pages being allocated/freed.
  *
- * Currently, there is not much metadata associated with each physical page, but
- * this may change in the future. E.g., refcounts/the number of free entries in
- * a PML* table may be helpful for freeing physical pages.
+ * Memory is split into zones (see `enum phys_zone_type`), each with its own
+ * free lists. Buddy blocks never span zones. Allocations are served from the
+ * highest zone allowed by the allocation flags, falling back to lower zones, so
+ * that low memory is kept for allocations that need it.
  *
- * `phys_rra_*()` methods are the lower-level interface for the round-robin page
- * allocator, and are mostly exposed for unit testing. The RRA interface expects
- * its arguments to be physical (identity-mapped) addresses, and will return
- * physical addresses.
+ * Alongside the `struct page` array, a two-level summary bitmap tracks which
+ * pages are in use. This allows scanning for free pages (e.g., when building
+ * the free lists) with `bsf` a word at a time, skipping fully-used regions
+ * 4096 pages at a time, without touching the `struct page`s.
+ *
+ * Each physical page has a 64-byte `struct page` with a refcount, mapcount,
+ * flags, an LRU link, and per-type metadata (e.g., the number of present
+ * entries in a PML* table), for sharing, copy-on-write and reclaim.
+ *
+ * `phys_rra_*()` methods are the lower-level interface for the page allocator,
+ * and are mostly exposed for unit testing. (The "RRA" name is historical: this
+ * used to be a round-robin allocator.) The RRA interface expects its arguments
+ * to be physical (identity-mapped) addresses, and will return physical
+ * addresses.
  *
  * The non-RRA methods form a wrapper around the RRA methods. These interact
  * with the main memory allocator and expect/return HHDM addresses. These should
  * be used for most normal operation.
  *
- * N.B. Assuming `sizeof(struct page) == 64` like it is in Linux, we will start
- * running into problems with this allocator and the stock Linux
- * bootloader/protocol once the size of the `struct page` array exceeds the HHDM
- * size (4GiB). This will happen once we reach 256GiB of RAM, which is not that
- * unreasonable of a number today. The VMM will also have problems with large
- * memory due to the size of the VM space.
+ * There is no lock. Instead, the entry points that modify the allocator mask
+ * interrupts (restoring the previous state on return), so that a task can't be
+ * preempted by another one (e.g., `phys_zero_task()`) in the middle of an
+ * allocation. This is only enough on a single CPU.
+ *
+ * N.B. The metadata (including the `struct page` arrays) is allocated in a
+ * single usable memory region, which must be large enough to hold it. The VMM
+ * may also have problems with large memory due to the size of the VM space.
  */
 #ifndef MEM_PHYS_H
 #define MEM_PHYS_H
@@ -35,6 +54,9 @@
 #include <limine.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include "common/list.h" // for struct list_head
 
 #define PG_SZ 4096lu
 #define PG_SZ_BITS 12u
@@ -50,14 +72,19 @@
 // Check if sz is page-aligned.
 #define PG_ALIGNED(sz) (!((size_t)(sz) & (PG_SZ - 1)))
 
-// Bitmap functions.
-// TODO(jlam55555): Move these into some util library. These were used for the
-// page bitmap when it was a bitmap, but now it is not a bitmap.
-#define _BM_BYTE(bm, bit) ((bm)[(bit) >> 3])
-#define _BM_BIT(bit) (1u << ((bit)&0x7))
-#define BM_TEST(bm, bit) (_BM_BYTE(bm, bit) & _BM_BIT(bit))
-#define BM_SET(bm, bit) (_BM_BYTE(bm, bit) |= _BM_BIT(bit))
-#define BM_CLEAR(bm, bit) (_BM_BYTE(bm, bit) &= ~_BM_BIT(bit))
+// Bitmap functions. These work on arrays of any unsigned integer type; use
+// 64-bit words if the bitmap will be searched with `op_bsf()`.
+// TODO(jlam55555): Move these into some util library.
+#define _BM_WORD_BITS(bm) (sizeof(*(bm)) * 8)
+#define _BM_WORD(bm, bit) ((bm)[(bit) / _BM_WORD_BITS(bm)])
+#define _BM_BIT(bm, bit)                                                       \
+  ((__typeof__(*(bm)))1 << ((bit) % _BM_WORD_BITS(bm)))
+#define BM_TEST(bm, bit) (_BM_WORD(bm, bit) & _BM_BIT(bm, bit))
+#define BM_SET(bm, bit) (_BM_WORD(bm, bit) |= _BM_BIT(bm, bit))
+#define BM_CLEAR(bm, bit) (_BM_WORD(bm, bit) &= ~_BM_BIT(bm, bit))
+
+// Number of 64-bit words needed for a bitmap of `bits` bits.
+#define BM_WORDS64(bits) (((size_t)(bits) + 63) >> 6)
 
 // Useful constants.
 // TODO(jlam55555): Move these into some util library.
@@ -67,17 +94,51 @@
 #define TiB (GiB * KiB)
 #define PiB (TiB * KiB)
 
+// Largest block order managed by the buddy allocator. Order 18 blocks are 1GiB,
+// which is also the largest (PML3) hugepage size.
+#define PHYS_MAX_ORDER 18
+
+// Sparse memory model: physical memory is divided into sections of
+// 2^PHYS_SECTION_PG_BITS pages (128MiB), and `struct page`s only exist for
+// sections that contain usable memory. This is smaller than the largest buddy
+// block, so a buddy block may span multiple (present) sections.
+#define PHYS_SECTION_PG_BITS 15
+#define PHYS_SECTION_PG (1lu << PHYS_SECTION_PG_BITS)
+
 // Forward declarations. Mostly for extra information needed for different
 // context bits.
 struct slab;
+struct slab_cache;
+
+/**
+ * Page flags (`struct page::flags`). These say what the page is used for (and
+ * thus which member of `context` is valid), and hold state for reclaim. They
+ * are cleared when the page is freed.
+ */
+// Backing page of a slab.
+#define PHYS_PG_SLAB (1u << 0)
+// Page table page.
+#define PHYS_PG_PT (1u << 1)
+// Anonymous user memory.
+#define PHYS_PG_ANON (1u << 2)
+// Recently accessed, according to the accessed bits of its mappings.
+#define PHYS_PG_REFERENCED (1u << 3)
+// Modified since it was last written back.
+#define PHYS_PG_DIRTY (1u << 4)
+// Backing page of a SLUB slab (see mem/slab.h).
+#define PHYS_PG_SLUB (1u << 5)
+// Page of a multi-page SLUB slab other than the first. Set along with
+// PHYS_PG_SLUB.
+#define PHYS_PG_SLUB_TAIL (1u << 6)
 
 /**
  * Used to track information about each physical memory page. Linux has a struct
  * of the same name with the same purpose.
  *
- * This struct may grow as amount of tracked data needed grows. In Linux,
- * `sizeof(struct page) == 64`, which means that 64/4096 ~= 1.5% of the total
- * physical memory goes towards the struct page array.
+ * As in Linux, `sizeof(struct page) == 64`, which means that 64/4096 ~= 1.5% of
+ * the total physical memory goes towards the struct page array. It is aligned
+ * to a cache line, so that updates to neighbouring pages' `struct page`s (e.g.,
+ * refcounts) on different CPUs don't false-share.
  *
  * `struct page`s will be zero-initialized by the physical memory allocator.
  */
@@ -89,33 +150,245 @@ struct page {
   // reclaimed.
   bool unusable : 1;
 
+  // Set if this is the first page of a free block on one of the buddy
+  // allocator's free lists. `order` is only meaningful if this or `huge` is
+  // set.
+  bool buddy : 1;
+  uint8_t order : 5;
+
+  // Section that this page belongs to, to find the page frame number of a
+  // `struct page`. (Sections of 128MiB => 128TiB of physical memory.)
+  uint64_t section : 20;
+
+  // Nonzero if this (allocated, order-0) page can be moved by compaction. This
+  // is the index of the page owner's `struct phys_migrate_ops` (see
+  // `phys_register_migrate_ops()`).
+  uint64_t migrate_type : 3;
+
+  // Set if this is the first page of a huge page (see `phys_rra_alloc_huge()`).
+  // The huge page is tracked as a single unit by this `struct page`: its size
+  // is `order`, and its refcount and mapcount are kept here. The `struct page`s
+  // of the other pages aren't touched.
+  uint64_t huge : 1;
+
   // For future use.
-  uint64_t : 62; // 8
+  uint64_t : 32; // 8
+
+  // PHYS_PG_* flags.
+  uint32_t flags; // 4
+
+  // Number of references to the page. Allocated pages start with a single
+  // reference; see `phys_rra_page_get()`/`phys_rra_page_put()`. Pages held by
+  // the allocator's caches (e.g., the per-CPU page caches) have one reference.
+  int32_t refcount; // 4
+
+  // Number of page table entries mapping this page.
+  int32_t mapcount; // 4
+
+  // Number of allocated objects, for the first page of a SLUB slab
+  // (PHYS_PG_SLUB).
+  uint32_t inuse; // 4
+
+  // Link in an LRU list, for reclaim. For the first page of a SLUB slab
+  // (PHYS_PG_SLUB), the link in one of its slab cache's slab lists instead.
+  struct list_head lru; // 16
 
   // Used to store metadata about the page. Depends on the type of page this is.
   // More entries may be added as more page types appear.
   union {
-    // The slab object, if this is a backing page for a slab.
+    // The slab object, if this is a backing page for a slab (PHYS_PG_SLAB).
+    // This is set on all of the slab's pages.
     struct slab *slab; // 8
-  } context;
 
-  // For future use. Pad this to 64 bytes as is done in Linux.
-  /* uint64_t test[6]; // 48 */
-} __attribute__((packed));
+    // First page of a SLUB slab (PHYS_PG_SLUB). The slab cache, and the first
+    // free object. Free objects are linked through their first word.
+    struct {
+      struct slab_cache *cache;
+      void *freelist;
+    } slub; // 16
+
+    // Other pages of a multi-page SLUB slab (PHYS_PG_SLUB_TAIL). The first
+    // page.
+    struct page *head; // 8
+
+    // Free-list link, if this is the first page of a free buddy block, or a
+    // page in a per-CPU page cache or the pre-zeroed page pool.
+    struct list_head free_ll; // 16
+
+    // Page table page (PHYS_PG_PT). The number of present entries, so that
+    // empty tables can be freed.
+    struct {
+      uint16_t present_entries;
+    } pt; // 2
+
+    // Anonymous page (PHYS_PG_ANON). The address space it belongs to and its
+    // virtual page number there, for reverse mapping.
+    struct {
+      void *mapping;
+      size_t index;
+    } anon; // 16
+
+    // Owner-defined data, for other movable pages.
+    void *private; // 8
+  } context; // 16
+
+  uint64_t : 64; // 8
+} __attribute__((aligned(64)));
+
+/**
+ * Physical memory zones. Zones are determined by physical address (relative to
+ * `phys_offset`):
+ * - DMA: [0, 16MiB). Addressable by legacy ISA DMA.
+ * - DMA32: [16MiB, 4GiB). Addressable by 32-bit devices.
+ * - NORMAL: [4GiB, end of memory).
+ */
+enum phys_zone_type {
+  PHYS_ZONE_DMA,
+  PHYS_ZONE_DMA32,
+  PHYS_ZONE_NORMAL,
+  PHYS_NR_ZONES,
+};
+#define PHYS_ZONE_DMA_LIMIT (16 * MiB)
+#define PHYS_ZONE_DMA32_LIMIT (4 * GiB)
+
+/**
+ * Huge page sizes for `phys_rra_alloc_huge()`. The values are the orders.
+ */
+enum phys_huge {
+  // 2MiB, mapped by a page directory (PMD) entry.
+  PHYS_HUGE_PMD = 9,
+  // 1GiB, mapped by a page directory pointer table (PUD) entry.
+  PHYS_HUGE_PUD = 18,
+};
 
 /**
- * Physical memory round-robin (page) allocator (RRA).
+ * Allocation flags for `phys_rra_alloc_order()`. By default (no flags), memory
+ * may come from any zone, in the order NORMAL -> DMA32 -> DMA.
+ */
+// Only allocate from the DMA zone.
+#define PHYS_ALLOC_DMA (1u << 0)
+// Only allocate from the DMA32 zone, falling back to the DMA zone.
+#define PHYS_ALLOC_DMA32 (1u << 1)
+// The (order-0) page will be made movable, so it may be borrowed from the CMA
+// area. See `struct phys_cma`.
+#define PHYS_ALLOC_MOVABLE (1u << 2)
+
+/**
+ * Per-zone buddy allocator state.
+ */
+struct phys_zone {
+  /**
+   * Buddy allocator free lists. `free_lists[order]` links the `struct page`s of
+   * the first pages of all free blocks of size 2^order pages in this zone, and
+   * `free_blocks[order]` is the length of that list.
+   */
+  struct list_head free_lists[PHYS_MAX_ORDER + 1];
+  size_t free_blocks[PHYS_MAX_ORDER + 1];
+
+  /**
+   * Pages [start_pg, end_pg) belong to this zone. The zone is empty if these
+   * are equal.
+   */
+  size_t start_pg;
+  size_t end_pg;
+
+  /**
+   * Zone statistics. free_pg counts the pages on the free lists (so it doesn't
+   * include pages in the per-CPU page caches).
+   */
+  size_t unusable_pg;
+  size_t free_pg;
+};
+
+/**
+ * Per-CPU page-frame cache (PCP) of free order-0 pages, in front of the buddy
+ * allocator. Order-0 allocations/frees hit the current CPU's cache and only
+ * touch the (shared) buddy allocator in batches:
+ * - When the cache is empty (low watermark), it is refilled with
+ *   PHYS_PCP_BATCH pages.
+ * - When the cache exceeds PHYS_PCP_HIGH pages (high watermark),
+ *   PHYS_PCP_BATCH pages are drained back to the buddy allocator.
+ *
+ * Pages in a PCP are allocated as far as the buddy allocator is concerned.
+ *
+ * The list is ordered from hot (recently freed, likely still in cache) at the
+ * head to cold at the tail. Allocations take hot pages and draining releases
+ * cold pages.
+ */
+#define PHYS_PCP_BATCH 16
+#define PHYS_PCP_HIGH 64
+struct phys_pcp {
+  // Linked through `struct page::context.free_ll`.
+  struct list_head pages;
+  size_t count;
+};
+
+/**
+ * Contiguous memory area (CMA). This is a naturally-aligned block of up to
+ * 2^PHYS_CMA_MAX_ORDER pages reserved from the buddy allocator at boot, and
+ * managed by its own bitmap allocator. It serves physically contiguous
+ * allocations that would otherwise fail due to fragmentation (e.g., large
+ * `kmalloc()`s and device buffers). High-order allocations fall back to it
+ * once compaction fails.
+ *
+ * Free pages in the area are lent to PHYS_ALLOC_MOVABLE allocations, top-down.
+ * They are migrated out when the area needs them back, so only pages whose
+ * owners can (nearly) always migrate them should be allocated as movable.
+ *
+ * The whole area counts as allocated as far as the buddy allocator is
+ * concerned.
+ */
+#define PHYS_CMA_MAX_ORDER 10
+#define PHYS_CMA_ORDER 10
+struct phys_cma {
+  // Pages [start_pg, start_pg + pg_count). `pg_count` is 0 if there is no CMA
+  // area.
+  size_t start_pg;
+  size_t pg_count;
+
+  // `used_bm` has a bit set for each page that is allocated from the area or
+  // lent out; `lent_bm` only for the latter.
+  uint64_t used_bm[BM_WORDS64(1lu << PHYS_CMA_MAX_ORDER)];
+  uint64_t lent_bm[BM_WORDS64(1lu << PHYS_CMA_MAX_ORDER)];
+
+  // Statistics. `used_pg` includes lent pages. `reclaimed_pg` counts lent
+  // pages that were migrated out of the area.
+  size_t used_pg;
+  size_t lent_pg;
+  size_t reclaimed_pg;
+};
+
+/**
+ * Physical memory (buddy) page allocator (RRA).
  */
 struct phys_rra {
   /**
-   * Store information about each `struct page`.
+   * Section table. `sections[pfn >> PHYS_SECTION_PG_BITS]` is the `struct page`
+   * array for the section containing page `pfn`, or NULL if the section has no
+   * usable memory. (Pages in absent sections are always unusable.) Thus, memory
+   * holes and reserved regions only cost `struct page`s if they share a section
+   * with usable memory.
+   *
+   * The section table is at the start of the metadata buffer, followed by the
+   * summary bitmaps and the `struct page` arrays of the present sections.
    *
    * Will be a HM address, since the new PT won't include a LM identity map.
+   */
+  struct page **sections;
+  size_t nr_sections;
+
+  /**
+   * Summary bitmaps, so that free pages can be found without pulling in the
+   * (much larger) `struct page`s.
    *
-   * N.B. This was previously a bitmap that only stored whether each physical
-   * page was allocated, but now we want to store more more info per page.
+   * `used_bm` has one bit per page, which is set iff the page is allocated or
+   * unusable. `full_bm` has one bit per word of `used_bm`, which is set iff
+   * all 64 pages of that word are used; fully-used regions can thus be skipped
+   * 4096 pages at a time. Bits past the end of memory and in absent sections
+   * are always set.
    */
-  struct page *mem_bitmap;
+  uint64_t *used_bm;
+  uint64_t *full_bm;
 
   /**
    * Physical memory statistics. total_sz == total_pg * PG_SZ, included for
@@ -135,9 +408,26 @@ struct phys_rra {
   size_t unusable_pg;
 
   /**
-   * Round-robin (first-fit) allocation.
+   * Buddy allocator state, per zone.
+   */
+  struct phys_zone zones[PHYS_NR_ZONES];
+
+  /**
+   * Per-CPU page caches for order-0 allocations (an array of NR_CPUS
+   * elements), or NULL if this allocator doesn't have any. Only the main
+   * allocator has them by default.
    */
-  size_t needle;
+  struct phys_pcp *pcp;
+
+  /**
+   * Pool of pre-zeroed pages, linked through `context.free_ll`. Pages in the
+   * pool are counted as allocated. The pool is filled by
+   * `phys_rra_zero_pages()` (in the background by `phys_zero_task()` for the
+   * main allocator), and is drained back to the buddy allocator if an
+   * allocation fails.
+   */
+  struct list_head zeroed_pages;
+  size_t zeroed_count;
 
   /**
    * Offset of the physical memory backing this allocator. This should be 0 in
@@ -147,8 +437,53 @@ struct phys_rra {
    * address on allocation/frees.
    */
   void *phys_offset;
+
+  /**
+   * Deferred initialization. Only the first PHYS_INIT_CHUNK_PG pages' `struct
+   * page`s are initialized by `phys_rra_init()`; pages [init_pg, total_pg) are
+   * initialized a chunk at a time by `phys_rra_init_next_chunk()`. Until then,
+   * they are marked used in the summary bitmaps and their `struct page`s
+   * must not be touched.
+   *
+   * `init_mmap` is only kept while initialization is incomplete.
+   * `bootloader_reclaimed` is set by `phys_reclaim_bootloader_mem()` so that
+   * bootloader-reclaimable regions initialized afterwards are usable.
+   *
+   * The time spent initializing (in TSC cycles) is recorded for diagnostics.
+   */
+  size_t init_pg;
+  struct limine_memmap_entry *init_mmap;
+  size_t entry_count;
+  bool bootloader_reclaimed;
+  uint64_t init_cycles_eager;
+  uint64_t init_cycles_deferred;
+
+  /**
+   * Compaction statistics. `compact_moved` counts movable pages vacated by
+   * compaction (both migrated and released pages).
+   */
+  size_t compact_attempts;
+  size_t compact_successes;
+  size_t compact_moved;
+
+  /**
+   * Contiguous memory area, if one is reserved with `phys_rra_cma_reserve()`.
+   */
+  struct phys_cma cma;
 };
 
+/**
+ * Granularity of deferred `struct page` initialization. This is the size of the
+ * largest buddy block, so that no buddy block spans multiple chunks.
+ */
+#define PHYS_INIT_CHUNK_PG (1lu << PHYS_MAX_ORDER)
+
+/**
+ * Maximum number of memmap entries. The memmap is copied out of
+ * bootloader-reclaimable memory for deferred initialization.
+ */
+#define PHYS_MMAP_MAX_ENTRIES 256
+
 /**
  * Initialize physical memory map using Limine memmap feature (which is itself
  * based on the BIOS E820 function).
@@ -164,7 +499,7 @@ void phys_reclaim_bootloader_mem(struct limine_memmap_entry *init_mmap,
                                  size_t entry_count);
 
 /**
- * Allocate a single physical page using a round-robin allocator.
+ * Allocate a single physical page from the main allocator.
  *
  * Returns the address of the new page, or NULL if physical pages are exhausted.
  */
@@ -175,9 +510,75 @@ void *phys_alloc_page(void);
  */
 void phys_free_page(const void *pg);
 
+/**
+ * Like `phys_free_page()`, but for pages whose contents are unlikely to be in
+ * the CPU cache. These are placed at the cold end of the per-CPU page cache,
+ * so they will be drained back to the buddy allocator first.
+ */
+void phys_free_page_cold(const void *pg);
+
+/**
+ * Allocate/free `n` single physical pages from/to the main allocator at once.
+ * This is cheaper than allocating the pages one at a time, and is intended for
+ * batch consumers such as page table construction.
+ *
+ * `phys_alloc_bulk()` stores the (HHDM) addresses of the new pages in `out`
+ * and returns the number of pages allocated, which is less than `n` only if
+ * physical pages are exhausted.
+ */
+size_t phys_alloc_bulk(size_t n, void **out);
+void phys_free_bulk(size_t n, void *const *pgs);
+
+/**
+ * Take/drop a reference to a page from the main allocator. See
+ * `phys_rra_page_get()`.
+ */
+void phys_page_get(const void *pg);
+void phys_page_put(const void *pg);
+
+/**
+ * Like `phys_alloc_page()`/`phys_alloc_bulk()`, but the pages are zero-filled.
+ * Pages are taken from the pre-zeroed page pool first, so callers usually don't
+ * pay for zeroing. If the pool runs out, pages are zeroed synchronously.
+ *
+ * These pages are freed as usual with `phys_free_page()`/`phys_free_bulk()`.
+ */
+void *phys_alloc_zeroed_page(void);
+size_t phys_alloc_zeroed_bulk(size_t n, void **out);
+
+/**
+ * Allocate/free a huge page from the main allocator. See
+ * `phys_rra_alloc_huge()`.
+ */
+void *phys_alloc_huge(enum phys_huge size);
+void phys_free_huge(const void *pg);
+
+/**
+ * Allocate/free `pg_count` physically contiguous pages from the main
+ * allocator's CMA area (e.g., for device buffers). Returns NULL if the area
+ * doesn't have enough contiguous pages. The pages are in the DMA32 zone.
+ */
+void *phys_cma_alloc(size_t pg_count);
+void phys_cma_free(const void *pg, size_t pg_count);
+
+/**
+ * Background kernel thread for the main allocator. It first finishes deferred
+ * `struct page` initialization, one chunk each time it is scheduled, and then
+ * zeroes free pages into the pre-zeroed page pool, at most PHYS_ZERO_BATCH
+ * pages each time it is scheduled. Once the pool is full, it compacts memory if
+ * no free blocks of order PHYS_COMPACT_IDLE_ORDER are left, backing off for
+ * PHYS_COMPACT_IDLE_BACKOFF wakeups after a failed attempt. It halts in
+ * between, so it only uses otherwise-idle CPU time.
+ */
+#define PHYS_ZERO_BATCH 8
+#define PHYS_ZERO_POOL_HIGH 256
+#define PHYS_COMPACT_IDLE_ORDER 4
+#define PHYS_COMPACT_IDLE_BACKOFF 64
+void phys_zero_task(void);
+
 /**
  * Print statistics about physical memory (e.g., available, reserved, usable,
- * etc.)
+ * free blocks per order, etc.)
  */
 void phys_mem_print_stats(void);
 
@@ -188,8 +589,21 @@ void phys_mem_print_stats(void);
 struct phys_rra *phys_mem_get_rra(void);
 
 /**
- * Initializes a RRA. Initializes the `struct page` array using the provided
- * `init_mmap`.
+ * Size of the metadata (the section table, summary bitmaps, and `struct page`
+ * arrays of present sections) for a RRA managing `mem_limit` bytes of physical
+ * memory described by `init_mmap`.
+ */
+size_t phys_rra_metadata_sz(size_t mem_limit,
+                            const struct limine_memmap_entry *init_mmap,
+                            size_t entry_count);
+
+/**
+ * Initializes a RRA. Initializes the `struct page` array and summary bitmaps
+ * using the provided `init_mmap`. `addr` must point to a buffer of at least
+ * `phys_rra_metadata_sz(mem_limit, init_mmap, entry_count)` bytes.
+ *
+ * Only the first PHYS_INIT_CHUNK_PG pages are initialized eagerly. If there are
+ * more, `init_mmap` must remain valid until they are all initialized.
  *
  * Addresses in `init_mmap` are allowed to be in the HHDM, for convenience.
  */
@@ -197,19 +611,187 @@ void phys_rra_init(struct phys_rra *, void *addr, size_t mem_limit,
                    struct limine_memmap_entry *init_mmap, size_t entry_count,
                    void *phys_offset);
 
+/**
+ * Initialize the next chunk of deferred `struct page`s and hand its free pages
+ * to the buddy allocator. Returns false if there was nothing left to
+ * initialize. This is also done automatically if an allocation fails, unless
+ * it is a huge allocation or restricted to zones below the next chunk.
+ */
+bool phys_rra_init_next_chunk(struct phys_rra *);
+
 /**
  * Allocates/frees a continuous region of 2^order pages. Returns NULL if no such
- * region is found.
+ * region is found, even after reclaim (for the main allocator; see
+ * mem/reclaim.h) and compaction. The region is aligned to 2^order pages
+ * (relative to `phys_offset`). `flags` is a combination of the PHYS_ALLOC_*
+ * flags.
+ *
+ * Reclaim is a single pass over the shrinkers, and is only done for orders up
+ * to PHYS_RECLAIM_MAX_ORDER (the size of the largest slabs). Compaction is only
+ * done for orders up to PHYS_COMPACT_MAX_ORDER. Larger blocks are unlikely to
+ * form from shrunk or migrated pages, and both run with interrupts masked.
  *
- * Is not designed to be efficient for order > 0, although this can be improved
- * with a buddy allocator system.
+ * Freeing must use the same order as the allocation.
  */
-void *phys_rra_alloc_order(struct phys_rra *, unsigned order);
+#define PHYS_RECLAIM_MAX_ORDER 4
+#define PHYS_COMPACT_MAX_ORDER PHYS_HUGE_PMD
+void *phys_rra_alloc_order(struct phys_rra *, unsigned order, unsigned flags);
 void phys_rra_free_order(struct phys_rra *, const void *pg, unsigned order);
 
 /**
- * Returns the `struct page` associated with a page.
+ * Allocates/frees a huge page: a block of pages that can be mapped with a
+ * single 2MiB (PMD) or 1GiB (PUD) page table entry. Returns NULL if no such
+ * block is free, even after compaction.
+ *
+ * Huge pages are naturally aligned (relative to `phys_offset`, which is 0 for
+ * the main allocator), so they can always be mapped with huge page table
+ * entries. A huge page is tracked as a single unit by the `struct page` of its
+ * first page; `phys_rra_page_get()`/`phys_rra_page_put()` take and drop
+ * references to the whole huge page.
+ */
+void *phys_rra_alloc_huge(struct phys_rra *, enum phys_huge size,
+                          unsigned flags);
+void phys_rra_free_huge(struct phys_rra *, const void *pg);
+
+/**
+ * Allocates/frees `n` blocks of 2^order pages at once. Allocation stores the
+ * blocks in `out` and returns the number of blocks allocated, which is less
+ * than `n` only if no more blocks can be found.
+ *
+ * Large free blocks are carved up directly rather than being split once per
+ * allocated block. These bypass the per-CPU page caches.
+ */
+size_t phys_rra_alloc_bulk(struct phys_rra *, unsigned order, size_t n,
+                           void **out, unsigned flags);
+void phys_rra_free_bulk(struct phys_rra *, unsigned order, size_t n,
+                        void *const *pgs);
+
+/**
+ * Zero up to `n` free pages and move them into the pre-zeroed page pool,
+ * without letting the pool exceed PHYS_ZERO_POOL_HIGH pages. Returns the number
+ * of pages zeroed.
+ *
+ * `phys_rra_alloc_zeroed_bulk()` allocates `n` zero-filled pages, preferring
+ * pages from the pool, and returns the number of pages allocated.
+ */
+size_t phys_rra_zero_pages(struct phys_rra *, size_t n);
+size_t phys_rra_alloc_zeroed_bulk(struct phys_rra *, size_t n, void **out);
+
+/**
+ * Compaction. High-order allocations may fail even when there are enough free
+ * pages, if the free pages are scattered between allocated ones. Compaction
+ * recovers a free block by moving the allocated pages out of it.
+ *
+ * Only movable pages can be moved. The owner of a page makes it movable by
+ * registering a `struct phys_migrate_ops` (once) and tagging the page with
+ * `phys_rra_set_movable()`. Only order-0 pages can be movable, and the tag is
+ * cleared when the page is freed. Currently, the only movable pages are slab
+ * backing pages, which can only be released when their slab is empty.
+ *
+ * Compaction is run automatically when an allocation of order > 0 fails (after
+ * the per-CPU caches and pre-zeroed pool have been drained), and at idle by
+ * `phys_zero_task()`.
+ */
+enum phys_migrate_result {
+  // The page couldn't be moved.
+  PHYS_MIGRATE_FAIL,
+  // The contents were moved to the new page, which the owner now owns.
+  PHYS_MIGRATE_MOVED,
+  // The owner doesn't need the page anymore. The new page is not used.
+  PHYS_MIGRATE_RELEASED,
+};
+struct phys_migrate_ops {
+  /**
+   * Returns true if the page may be movable right now. This is a hint used to
+   * pick which block to compact; it must not have side effects.
+   */
+  bool (*can_migrate)(struct page *page);
+
+  /**
+   * Move the contents of page `old_pg` (described by `page`) to `new_pg` and
+   * update all references, or release it. Either way, the page is freed by
+   * compaction afterwards, so the owner must not free it. This must not free
+   * any other pages either. Addresses are physical addresses. `new_pg` is NULL
+   * if there are no free pages, in which case the page can only be released.
+   */
+  enum phys_migrate_result (*migrate)(struct phys_rra *rra, struct page *page,
+                                      void *old_pg, void *new_pg);
+};
+#define PHYS_MIGRATE_TYPES 8
+
+/**
+ * Register migration callbacks for a type of movable page. Returns the
+ * (nonzero) migrate type to pass to `phys_rra_set_movable()`.
+ */
+unsigned phys_register_migrate_ops(const struct phys_migrate_ops *ops);
+
+/**
+ * Mark an allocated order-0 page as movable with the given migrate type, or as
+ * unmovable if `migrate_type` is 0.
+ */
+void phys_rra_set_movable(struct phys_rra *, const void *pg,
+                          unsigned migrate_type);
+
+/**
+ * Try to make a free block of order `order` available in a zone allowed by
+ * `flags` by migrating movable pages out of the way. Returns true on success.
+ */
+bool phys_rra_compact(struct phys_rra *, unsigned order, unsigned flags);
+
+/**
+ * Reserve a CMA area of 2^order pages (order <= PHYS_CMA_MAX_ORDER) from a zone
+ * allowed by `flags`. Returns false if there isn't a free block large enough.
+ * This should be done early, before memory is fragmented.
+ */
+bool phys_rra_cma_reserve(struct phys_rra *, unsigned order, unsigned flags);
+
+/**
+ * Allocates/frees `pg_count` contiguous pages from the CMA area, aligned to
+ * 2^align_order pages. Lent pages in the way are migrated out. Returns NULL if
+ * there is no such region.
+ *
+ * (Blocks returned by `phys_rra_alloc_order()` may also come from the CMA area.
+ * Those are freed as usual with `phys_rra_free_order()`.)
+ */
+void *phys_rra_cma_alloc(struct phys_rra *, size_t pg_count,
+                         unsigned align_order);
+void phys_rra_cma_free(struct phys_rra *, const void *pg, size_t pg_count);
+
+/**
+ * Initialize a per-CPU page cache, which can then be attached to a RRA by
+ * setting `rra->pcp`.
+ */
+void phys_pcp_init(struct phys_pcp *pcp);
+
+/**
+ * Return all pages in the RRA's per-CPU page caches to the buddy allocator.
+ * This is done automatically if an allocation fails.
+ */
+void phys_rra_drain_pcp(struct phys_rra *rra);
+
+/**
+ * Returns the number of free pages, including pages in the per-CPU page caches
+ * and the pre-zeroed pool, and pages that haven't been initialized yet.
+ */
+size_t phys_rra_free_pg(struct phys_rra *rra);
+
+/**
+ * Take/drop a reference to an allocated order-0 page or huge page. Dropping the
+ * last reference frees the page.
+ */
+void phys_rra_page_get(struct phys_rra *, const void *pg);
+void phys_rra_page_put(struct phys_rra *, const void *pg);
+
+/**
+ * Returns the `struct page` associated with a page. This is O(1) (a section
+ * table lookup). The page must be in a present section.
  */
 struct page *phys_rra_get_page(struct phys_rra *rra, const void *pg);
 
+/**
+ * The inverse of `phys_rra_get_page()`: returns the address of the page that a
+ * `struct page` describes.
+ */
+void *phys_rra_page_addr(struct phys_rra *rra, const struct page *page);
+
 #endif // MEM_PHYS_H
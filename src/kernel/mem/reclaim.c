@@ -0,0 +1,49 @@
+#include "mem/reclaim.h"
+
+#include "common/opcodes.h" // for op_irq_*, op_sti, op_hlt
+#include "mem/phys.h"       // for phys_rra_free_pg, phys_mem_get_rra
+
+#include <assert.h>
+
+static struct list_head _shrinkers = {&_shrinkers, &_shrinkers};
+
+void reclaim_register_shrinker(struct shrinker *shrinker) {
+  assert(shrinker && shrinker->shrink);
+  list_add_tail(&_shrinkers, &shrinker->ll);
+}
+
+void reclaim_unregister_shrinker(struct shrinker *shrinker) {
+  list_del(&shrinker->ll);
+}
+
+size_t reclaim_shrink(size_t nr_pg) {
+  const uint64_t irq = op_irq_save();
+  size_t freed = 0;
+  list_foreach(&_shrinkers, it) {
+    if (freed >= nr_pg) {
+      break;
+    }
+    struct shrinker *const shrinker = list_entry(it, struct shrinker, ll);
+    freed += shrinker->shrink(nr_pg - freed);
+  }
+  op_irq_restore(irq);
+  return freed;
+}
+
+void reclaim_task(void) {
+  // See `shell_init()`.
+  op_sti();
+
+  // `reclaim_shrink()` masks interrupts, as do the allocator entry points, so
+  // neither this task nor the tasks it preempts are interrupted in the middle
+  // of touching the allocators. Free page counts are only a hint here.
+  struct phys_rra *const rra = phys_mem_get_rra();
+  for (;;) {
+    if (phys_rra_free_pg(rra) < RECLAIM_WMARK_LOW) {
+      while (phys_rra_free_pg(rra) < RECLAIM_WMARK_HIGH &&
+             reclaim_shrink(RECLAIM_BATCH)) {
+      }
+    }
+    op_hlt();
+  }
+}
@@ -0,0 +1,69 @@
+/**
+ * Memory reclaim. Other allocators (e.g., the slab allocator) cache physical
+ * pages that they don't strictly need; reclaim asks them to give these pages
+ * back to the main physical allocator when free memory runs low.
+ *
+ * Caches register a `struct shrinker`, similar to Linux's shrinkers. Shrinkers
+ * are called in two situations:
+ * - Background reclaim: `reclaim_task()` (like Linux's kswapd) wakes up
+ *   periodically, and if the main allocator has fewer than RECLAIM_WMARK_LOW
+ *   free pages, it shrinks caches until there are RECLAIM_WMARK_HIGH free pages
+ *   or nothing is left to shrink.
+ * - Direct reclaim: if an allocation from the main allocator would fail, it
+ *   shrinks caches once and retries, so that allocations don't fail while
+ *   reclaimable memory is parked in caches. This is bounded (see
+ *   `phys_rra_alloc_order()`), since it runs with interrupts masked.
+ *
+ * Shrinkers are called with interrupts masked, and must not allocate physical
+ * memory.
+ */
+#ifndef MEM_RECLAIM_H
+#define MEM_RECLAIM_H
+
+#include <stddef.h>
+
+#include "common/list.h" // for struct list_head
+
+struct shrinker {
+  /**
+   * Free up to `nr_pg` cached pages (it's okay to free slightly more), and
+   * return the number of pages freed. Returning 0 means that nothing is left to
+   * free.
+   */
+  size_t (*shrink)(size_t nr_pg);
+
+  // Link in the list of registered shrinkers.
+  struct list_head ll;
+};
+
+/**
+ * Watermarks for background reclaim, in free pages of the main allocator.
+ */
+#define RECLAIM_WMARK_LOW 256
+#define RECLAIM_WMARK_HIGH 512
+
+/**
+ * Number of pages to ask each shrinker for at a time during background
+ * reclaim.
+ */
+#define RECLAIM_BATCH 32
+
+/**
+ * Add/remove a shrinker. Shrinkers are called in the order they were
+ * registered.
+ */
+void reclaim_register_shrinker(struct shrinker *shrinker);
+void reclaim_unregister_shrinker(struct shrinker *shrinker);
+
+/**
+ * Ask the registered shrinkers to free `nr_pg` pages in total. Returns the
+ * number of pages freed, which may be less than `nr_pg` if the caches run dry.
+ */
+size_t reclaim_shrink(size_t nr_pg);
+
+/**
+ * Background reclaim kernel thread. See above.
+ */
+void reclaim_task(void);
+
+#endif // MEM_RECLAIM_H
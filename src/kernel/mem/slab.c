@@ -2,9 +2,14 @@
 
 #include "common/libc.h"
 #include "common/list.h"
-#include "common/util.h" // for static_assert
-#include "mem/phys.h"    // for phys_*
-#include "mem/vm.h"      // for VM_TO_HHDM, VM_TO_IDM
+#include "common/opcodes.h" // for op_irq_*, op_movsq
+#include "common/percpu.h"  // for NR_CPUS, cpu_id
+#include "common/util.h"    // for static_assert
+#include "mem/kfence.h"     // for is_kfence_addr, kfence_*
+#include "mem/phys.h"       // for phys_*
+#include "mem/reclaim.h"    // for reclaim_register_shrinker
+#include "mem/stat.h"       // for mem_stat_*
+#include "mem/vm.h"         // for VM_TO_HHDM, VM_TO_IDM
 
 #include <assert.h>
 
@@ -23,49 +28,192 @@ struct slab {
   struct slab_cache *parent; // 8
   void *data;                // 8
   struct list_head ll;       // 16
-  uint8_t allocated;         // 1
-  uint64_t : 56;             // 7
-
-  // This must come last.
-  struct slab_freelist_item {
-    // freelist[i].stack_item gets the i-th index on the stack. Used for
-    // allocations.
-    uint8_t stack_item;
-    // freelist[i].pos_in_stk gets the index in the stack of the i-th object in
-    // the slab. Used for deallocations.
-    uint8_t pos_in_stk;
-  } freelist[0];
+  uint16_t allocated;        // 2
+  uint64_t : 48;             // 6
+
+  // Stack of the indices of the free objects. Only freelist[allocated] through
+  // freelist[elements - 1] are meaningful; the top of the stack is
+  // freelist[allocated]. This must come last.
+  uint16_t freelist[0];
 };
 
 /**
- * Ensure that slab_freelist_item is at the end of the `struct_slab`, without
+ * Ensure that the freelist is at the end of the `struct_slab`, without
  * requiring `__attribute__((packed))`. This is to prevent gcc from complaining
  * about bad alignment.
  */
 static_assert(sizeof(struct slab) == 40);
 
 /**
- * Main slab caches.
+ * `kmalloc()` size classes. Besides the powers of two, there are intermediate
+ * classes of 3*2^(n-2) bytes between 2^(n-1) and 2^n, which roughly halve the
+ * worst-case internal fragmentation. There are no intermediate classes above
+ * 12KiB, since their slabs would need more than SLAB_MAX_SLAB_PAGES pages to
+ * not waste as much memory as they save.
+ *
+ * `_slab_kmalloc_const_index()` (slab.h) must be kept in sync with these.
+ */
+static const uint32_t _slab_kmalloc_sizes[] = {
+    16,   32,   48,   64,   96,   128,  192,   256,   384,   512,   768,
+    1024, 1536, 2048, 3072, 4096, 6144, 8192, 12288, 16384, 32768, 65536,
+};
+#define SLAB_KMALLOC_CACHES                                                    \
+  (sizeof(_slab_kmalloc_sizes) / sizeof(*_slab_kmalloc_sizes))
+
+/**
+ * Main slab caches (one per `kmalloc()` size class), and their per-CPU
+ * magazines.
+ */
+struct slab_cache _slab_caches[SLAB_KMALLOC_CACHES];
+static struct slab_cpu_cache _slab_cpu_caches[SLAB_KMALLOC_CACHES][NR_CPUS];
+
+/**
+ * Size-to-class lookup tables for `kmalloc()`, with indices into
+ * `_slab_caches`. Sizes up to SLAB_KMALLOC_SMALL bytes are looked up in 8-byte
+ * steps. Larger sizes are looked up by order (ilog2ceil(size)); this gives the
+ * power-of-two class, and the class below it may also fit. These are filled in
+ * by `slab_allocators_init()`.
+ */
+#define SLAB_KMALLOC_SMALL 192
+static uint8_t _slab_kmalloc_small_index[SLAB_KMALLOC_SMALL / 8 + 1];
+static uint8_t _slab_kmalloc_order_index[SLAB_MAX_ORDER + 1];
+
+/**
+ * Slabs for objects that don't evenly divide their slab's pages grow (up to
+ * SLAB_MAX_SLAB_PAGES pages) until at most 1/SLAB_WASTE_FRACTION of each slab
+ * is wasted.
+ */
+#define SLAB_MAX_SLAB_PAGES 16
+#define SLAB_WASTE_FRACTION 8
+
+/**
+ * Pages per small-order slab (SLAB backend). Multi-page slabs amortize the slab
+ * descriptor and the slab list operations over more objects, at the cost of
+ * not being movable (see `_slab_can_migrate()`).
+ */
+#define SLAB_SMALL_SLAB_PAGES 4
+static_assert(SLAB_SMALL_SLAB_PAGES <= SLAB_MAX_SLAB_PAGES);
+
+/**
+ * Slab cache for magazines. It doesn't have magazines itself.
+ */
+static struct slab_cache _slab_magazine_cache;
+static_assert(sizeof(struct slab_magazine) == 256);
+
+/**
+ * Named slab caches (see `kmem_cache_create()`), linked by `struct
+ * slab_cache::ll`. Each is allocated together with its per-CPU magazines.
+ */
+struct _slab_named_cache {
+  struct slab_cache cache;
+  struct slab_cpu_cache cpu_caches[NR_CPUS];
+};
+static struct list_head _slab_named_caches = {&_slab_named_caches,
+                                              &_slab_named_caches};
+
+static void _slab_free_desc(struct slab *slab);
+
+static bool _slab_cache_is_small(const struct slab_cache *slab_cache) {
+  return slab_cache->order <= SLAB_SMALL_MAX_ORDER;
+}
+
+static bool _slab_cache_is_slub(const struct slab_cache *slab_cache) {
+  return slab_cache->backend == SLAB_BACKEND_SLUB;
+}
+
+/**
+ * Compaction callbacks for slab backing pages. Only single-page slabs are
+ * marked movable. Objects can't be moved since their users hold pointers to
+ * them, so a slab page can only be released, and only if the slab is empty.
  */
-struct slab_cache _slab_caches[SLAB_MAX_ORDER - SLAB_MIN_ORDER + 1];
+static bool _slab_can_migrate(struct page *page) {
+  if (page->flags & PHYS_PG_SLUB) {
+    return !page->inuse;
+  }
+  return !page->context.slab->allocated;
+}
+static enum phys_migrate_result
+_slab_migrate(__attribute__((unused)) struct phys_rra *rra, struct page *page,
+              __attribute__((unused)) void *old_pg,
+              __attribute__((unused)) void *new_pg) {
+  if (page->flags & PHYS_PG_SLUB) {
+    if (page->inuse) {
+      return PHYS_MIGRATE_FAIL;
+    }
+    list_del(&page->lru);
+    return PHYS_MIGRATE_RELEASED;
+  }
 
-static bool _slab_cache_is_small(unsigned order) {
-  return order <= SLAB_SMALL_MAX_ORDER;
+  struct slab *const slab = page->context.slab;
+  if (slab->allocated) {
+    return PHYS_MIGRATE_FAIL;
+  }
+  list_del(&slab->ll);
+  if (!_slab_cache_is_small(slab->parent)) {
+    _slab_free_desc(slab);
+  }
+  return PHYS_MIGRATE_RELEASED;
 }
+static const struct phys_migrate_ops _slab_migrate_ops = {
+    .can_migrate = _slab_can_migrate,
+    .migrate = _slab_migrate,
+};
+static unsigned _slab_migrate_type;
 
 /**
- * Helper function to get the main slab cache of the given order.
+ * Helper function to get the main slab cache of the smallest size class that
+ * fits `sz` bytes.
  */
-static struct slab_cache *_slab_allocator_get_cache(unsigned order) {
-  if (order < SLAB_MIN_ORDER || order > SLAB_MAX_ORDER) {
+static struct slab_cache *_slab_allocator_get_cache(size_t sz) {
+  if (sz <= SLAB_KMALLOC_SMALL) {
+    return &_slab_caches[_slab_kmalloc_small_index[(sz + 7) / 8]];
+  }
+  if (sz > (1u << SLAB_MAX_ORDER)) {
     return NULL;
   }
-  return &_slab_caches[order - SLAB_MIN_ORDER];
+  unsigned i = _slab_kmalloc_order_index[ilog2ceil(sz)];
+  if (sz <= _slab_kmalloc_sizes[i - 1]) {
+    --i;
+  }
+  return &_slab_caches[i];
 }
 
-void slab_cache_init(struct slab_cache *slab_cache, struct phys_rra *rra,
-                     unsigned order) {
-  slab_cache->order = order;
+/**
+ * Distance between the colours of a slab cache. This is a multiple of the
+ * objects' alignment, since `size` is.
+ */
+static size_t _slab_colour_off(const struct slab_cache *slab_cache) {
+  const size_t size_align = slab_cache->size & -slab_cache->size;
+  return size_align > SLAB_COLOUR_ALIGN ? size_align : SLAB_COLOUR_ALIGN;
+}
+
+/**
+ * Size of the descriptor of a SLAB-backend slab with `elements` objects.
+ */
+static size_t _slab_desc_size(size_t elements) {
+  return sizeof(struct slab) + elements * sizeof(uint16_t);
+}
+
+/**
+ * Whether slabs of `pages` pages would waste too much memory (see
+ * SLAB_WASTE_FRACTION) on objects of `size` bytes.
+ */
+static bool _slab_is_wasteful(size_t pages, size_t size) {
+  const size_t slab_sz = pages << PG_SZ_BITS;
+  return slab_sz % size * SLAB_WASTE_FRACTION > slab_sz;
+}
+
+/**
+ * Initialize a slab cache for objects of `size` bytes, which must be a multiple
+ * of `align` (a power of two). See `slab_cache_init()`.
+ */
+static void _slab_cache_init(struct slab_cache *slab_cache,
+                             struct phys_rra *rra, size_t size, size_t align,
+                             enum slab_backend backend) {
+  assert(!(size & (align - 1)));
+  slab_cache->order = ilog2ceil(size);
+  slab_cache->size = size;
+  slab_cache->backend = backend;
 
   list_init(&slab_cache->empty_slabs);
   list_init(&slab_cache->partial_slabs);
@@ -73,43 +221,95 @@ void slab_cache_init(struct slab_cache *slab_cache, struct phys_rra *rra,
 
   slab_cache->allocator = rra;
 
-  const size_t element_size = 1u << order;
+  slab_cache->cpu_caches = NULL;
+  list_init(&slab_cache->depot_full);
+  list_init(&slab_cache->depot_empty);
+
+  slab_cache->name = NULL;
+  slab_cache->ctor = NULL;
+  list_init(&slab_cache->ll);
+
+  if (!_slab_migrate_type) {
+    _slab_migrate_type = phys_register_migrate_ops(&_slab_migrate_ops);
+  }
+
   size_t desc_size;
   __attribute__((unused)) size_t wasted;
-  if (_slab_cache_is_small(order)) {
-    slab_cache->pages = 1;
-    slab_cache->elements = (PG_SZ - sizeof(struct slab)) /
-                           (element_size + sizeof(struct slab_freelist_item));
-
-    desc_size = sizeof(struct slab) +
-                slab_cache->elements * sizeof(struct slab_freelist_item);
-    wasted = PG_SZ - (desc_size + slab_cache->elements * element_size);
-  } else {
-    slab_cache->pages = order >= PG_SZ_BITS ? PG_COUNT(1u << order) : 1;
-    slab_cache->elements = (slab_cache->pages << PG_SZ_BITS) >> order;
+  slab_cache->offset = 0;
+  slab_cache->colours = 1;
+  slab_cache->colour_next = 0;
+  if (_slab_cache_is_slub(slab_cache) || !_slab_cache_is_small(slab_cache)) {
+    slab_cache->pages = size > PG_SZ ? 1u << ilog2ceil(PG_COUNT(size)) : 1;
+    while (slab_cache->pages < SLAB_MAX_SLAB_PAGES &&
+           _slab_is_wasteful(slab_cache->pages, size)) {
+      slab_cache->pages <<= 1;
+    }
+    slab_cache->elements = (slab_cache->pages << PG_SZ_BITS) / size;
+  }
+  if (_slab_cache_is_slub(slab_cache)) {
+    // No descriptor or freelist array.
+    desc_size = 0;
+    wasted = (slab_cache->pages << PG_SZ_BITS) - slab_cache->elements * size;
+  } else if (_slab_cache_is_small(slab_cache)) {
+    const size_t slab_sz = SLAB_SMALL_SLAB_PAGES << PG_SZ_BITS;
+    slab_cache->pages = SLAB_SMALL_SLAB_PAGES;
+    slab_cache->elements =
+        (slab_sz - sizeof(struct slab)) / (size + sizeof(uint16_t));
 
+    // The objects start at the first aligned offset after the descriptor, plus
+    // the slab's colour. Leave room for at least SLAB_MIN_COLOURS colours.
+    const size_t colour_off = _slab_colour_off(slab_cache);
+    size_t offset;
+    for (;;) {
+      desc_size = _slab_desc_size(slab_cache->elements);
+      offset = (desc_size + align - 1) & ~(align - 1);
+      if (offset + slab_cache->elements * size +
+              (SLAB_MIN_COLOURS - 1) * colour_off <=
+          slab_sz) {
+        break;
+      }
+      --slab_cache->elements;
+    }
+    slab_cache->offset = offset;
+    const size_t colours =
+        (slab_sz - offset - slab_cache->elements * size) / colour_off + 1;
+    slab_cache->colours = colours < UINT8_MAX ? colours : UINT8_MAX;
+    wasted = slab_sz - (desc_size + slab_cache->elements * size);
+  } else {
     // Descriptor + freelist must fit in the descriptor of a lower-level
     // freelist.
-    desc_size = sizeof(struct slab) +
-                slab_cache->elements * sizeof(struct slab_freelist_item);
-    assert(desc_size <= (1u << (order - 1)));
+    desc_size = _slab_desc_size(slab_cache->elements);
+    assert(desc_size <= (1u << (slab_cache->order - 1)));
 
     wasted = (1u << ilog2ceil(desc_size)) - desc_size;
   }
 
 #ifdef DEBUG
-  printf("slaballoc: order=%u pages=%u elements=%u small=%u desc_size=%lu "
-         "wasted=%lu\r\n",
-         slab_cache->order, slab_cache->pages, slab_cache->elements,
-         _slab_cache_is_small(order), desc_size, wasted);
+  printf("slaballoc: order=%u size=%u pages=%u elements=%u small=%u slub=%u "
+         "desc_size=%lu wasted=%lu colours=%u\r\n",
+         slab_cache->order, slab_cache->size, slab_cache->pages,
+         slab_cache->elements, _slab_cache_is_small(slab_cache),
+         _slab_cache_is_slub(slab_cache), desc_size, wasted,
+         slab_cache->colours);
 #endif // DEBUG
 }
 
+void slab_cache_init(struct slab_cache *slab_cache, struct phys_rra *rra,
+                     unsigned order) {
+  slab_cache_init_backend(slab_cache, rra, order, SLAB_BACKEND_SLAB);
+}
+
+void slab_cache_init_backend(struct slab_cache *slab_cache,
+                             struct phys_rra *rra, unsigned order,
+                             enum slab_backend backend) {
+  _slab_cache_init(slab_cache, rra, 1u << order, 1u << order, backend);
+}
+
 void _slab_destroy(struct slab *slab) {
   // Deallocate the backing pages. For small-order slabs, this includes the
   // descriptor -- so be careful! For large-order slabs, the descriptor is
   // kmalloc-ed separately and still needs to be freed.
-  void *bp = _slab_cache_is_small(slab->parent->order) ? slab : slab->data;
+  void *bp = _slab_cache_is_small(slab->parent) ? slab : slab->data;
   phys_rra_free_order(slab->parent->allocator, VM_TO_IDM(bp),
                       ilog2(slab->parent->pages));
 
@@ -117,48 +317,184 @@ void _slab_destroy(struct slab *slab) {
   list_del(&slab->ll);
 }
 
+/**
+ * Destroy the slab linked by `ll` in one of the slab lists of `slab_cache`.
+ */
+static void _slab_cache_destroy_slab(struct slab_cache *slab_cache,
+                                     struct list_head *ll) {
+  if (_slab_cache_is_slub(slab_cache)) {
+    struct page *const page = list_entry(ll, struct page, lru);
+    list_del(ll);
+    phys_rra_free_order(slab_cache->allocator,
+                        phys_rra_page_addr(slab_cache->allocator, page),
+                        ilog2(slab_cache->pages));
+    return;
+  }
+
+  struct slab *const slab = list_entry(ll, struct slab, ll);
+  _slab_destroy(slab);
+  if (!_slab_cache_is_small(slab_cache)) {
+    _slab_free_desc(slab);
+  }
+}
+
 void slab_cache_destroy(struct slab_cache *slab_cache) {
+  const uint64_t irq = op_irq_save();
+  slab_cache_drain(slab_cache);
+
 #define CLEAR_LIST(field)                                                      \
   while (!list_empty(&slab_cache->field)) {                                    \
-    struct slab *slab = list_entry(slab_cache->field.next, struct slab, ll);   \
-    _slab_destroy(slab);                                                       \
-    if (!_slab_cache_is_small(slab_cache->order)) {                            \
-      kfree(slab);                                                             \
-    }                                                                          \
+    _slab_cache_destroy_slab(slab_cache, slab_cache->field.next);              \
   }
 
   CLEAR_LIST(empty_slabs);
   CLEAR_LIST(partial_slabs);
   CLEAR_LIST(full_slabs);
 #undef CLEAR_LIST
+  op_irq_restore(irq);
+}
+
+size_t slab_cache_purge(struct slab_cache *slab_cache, size_t nr_pg) {
+  const uint64_t irq = op_irq_save();
+  size_t freed = 0;
+  while (freed < nr_pg && !list_empty(&slab_cache->empty_slabs)) {
+    _slab_cache_destroy_slab(slab_cache, slab_cache->empty_slabs.next);
+    freed += slab_cache->pages;
+  }
+  op_irq_restore(irq);
+  return freed;
 }
 
+/**
+ * Purge the main and named slab caches. Purge the named caches and the largest
+ * size classes first, since their descriptors live in the smaller caches and
+ * may leave behind more empty slabs there. The magazine cache is purged last,
+ * since draining frees magazines.
+ */
+static size_t _slab_purge_all(size_t nr_pg) {
+  size_t freed = 0;
+  list_foreach(&_slab_named_caches, it) {
+    if (freed >= nr_pg) {
+      break;
+    }
+    freed += slab_cache_purge(list_entry(it, struct slab_cache, ll),
+                              nr_pg - freed);
+  }
+  for (size_t i = SLAB_KMALLOC_CACHES; i-- && freed < nr_pg;) {
+    freed += slab_cache_purge(&_slab_caches[i], nr_pg - freed);
+  }
+  if (freed < nr_pg) {
+    freed += slab_cache_purge(&_slab_magazine_cache, nr_pg - freed);
+  }
+  return freed;
+}
+
+/**
+ * Shrinker for the main and named slab caches. Objects in magazines keep their
+ * slabs from becoming empty, so the magazines are drained if purging alone
+ * doesn't free enough.
+ */
+static size_t _slab_shrink(size_t nr_pg) {
+  size_t freed = _slab_purge_all(nr_pg);
+  if (freed < nr_pg) {
+    list_foreach(&_slab_named_caches, it) {
+      slab_cache_drain(list_entry(it, struct slab_cache, ll));
+    }
+    for (size_t i = 0; i < SLAB_KMALLOC_CACHES; ++i) {
+      slab_cache_drain(&_slab_caches[i]);
+    }
+    freed += _slab_purge_all(nr_pg - freed);
+  }
+  return freed;
+}
+static struct shrinker _slab_shrinker = {.shrink = _slab_shrink};
+
 void slab_allocators_init(void) {
-  for (unsigned order = SLAB_MIN_ORDER; order <= SLAB_MAX_ORDER; ++order) {
-    slab_cache_init(_slab_allocator_get_cache(order), phys_mem_get_rra(),
-                    order);
+  slab_cache_init_backend(&_slab_magazine_cache, phys_mem_get_rra(),
+                          ilog2ceil(sizeof(struct slab_magazine)),
+                          SLAB_KMALLOC_BACKEND);
+  for (size_t i = 0; i < SLAB_KMALLOC_CACHES; ++i) {
+    // Objects are aligned to the largest power of two dividing their size.
+    const uint32_t size = _slab_kmalloc_sizes[i];
+    _slab_cache_init(&_slab_caches[i], phys_mem_get_rra(), size, size & -size,
+                     SLAB_KMALLOC_BACKEND);
+    slab_cache_init_magazines(&_slab_caches[i], _slab_cpu_caches[i]);
+
+    if (!(size & (size - 1))) {
+      _slab_kmalloc_order_index[ilog2(size)] = i;
+    }
+
+    // The compile-time lookup must agree with the size classes.
+    assert(_slab_kmalloc_const_index(size) == (int)i);
+    assert(!i || _slab_kmalloc_const_index(_slab_kmalloc_sizes[i - 1] + 1) ==
+                     (int)i);
   }
+  assert(_slab_kmalloc_const_index((1u << SLAB_MAX_ORDER) + 1) == -1);
+  for (size_t sz = 0, i = 0; sz <= SLAB_KMALLOC_SMALL; sz += 8) {
+    while (_slab_kmalloc_sizes[i] < sz) {
+      ++i;
+    }
+    _slab_kmalloc_small_index[sz / 8] = i;
+  }
+  reclaim_register_shrinker(&_slab_shrinker);
 }
 
-void slab_cache_alloc_slab(struct slab_cache *slab_cache) {
-  void *const page =
-      phys_rra_alloc_order(slab_cache->allocator, ilog2(slab_cache->pages));
+/**
+ * `_slab_cache_alloc_slab()` for SLUB caches. The new slab's freelist links all
+ * objects in address order.
+ */
+static void _slub_cache_alloc_slab(struct slab_cache *slab_cache,
+                                   void *page) {
+  struct page *const pg_desc = phys_rra_get_page(slab_cache->allocator, page);
+  assert(pg_desc);
+  pg_desc->flags |= PHYS_PG_SLUB;
+  pg_desc->context.slub.cache = slab_cache;
+  pg_desc->inuse = 0;
+  for (size_t i = 1; i < slab_cache->pages; ++i) {
+    struct page *const tail =
+        phys_rra_get_page(slab_cache->allocator, page + (i << PG_SZ_BITS));
+    tail->flags |= PHYS_PG_SLUB | PHYS_PG_SLUB_TAIL;
+    tail->context.head = pg_desc;
+  }
+
+  void *const page_hm = VM_TO_HHDM(page);
+  const size_t element_sz = slab_cache->size;
+  void **next = &pg_desc->context.slub.freelist;
+  for (size_t i = 0; i < slab_cache->elements; ++i) {
+    *next = page_hm + i * element_sz;
+    next = (void **)*next;
+  }
+  *next = NULL;
+
+  if (slab_cache->pages == 1) {
+    phys_rra_set_movable(slab_cache->allocator, page, _slab_migrate_type);
+  }
+  list_add(&slab_cache->empty_slabs, &pg_desc->lru);
+}
+
+static void _slab_cache_alloc_slab(struct slab_cache *slab_cache) {
+  void *const page = phys_rra_alloc_order(slab_cache->allocator,
+                                          ilog2(slab_cache->pages), 0);
   if (!page) {
     return;
   }
+  if (_slab_cache_is_slub(slab_cache)) {
+    _slub_cache_alloc_slab(slab_cache, page);
+    return;
+  }
   void *const page_hm = VM_TO_HHDM(page);
 
-  const size_t desc_sz =
-      sizeof(struct slab) +
-      slab_cache->elements * sizeof(struct slab_freelist_item);
-  const size_t element_sz = 1u << slab_cache->order;
+  const size_t desc_sz = _slab_desc_size(slab_cache->elements);
   struct slab *slab;
   void *objects_start;
-  if (_slab_cache_is_small(slab_cache->order)) {
-    // Initialize desc in backing page.
+  if (_slab_cache_is_small(slab_cache)) {
+    // Initialize desc in backing page, and colour the slab.
     slab = (struct slab *)page_hm;
-    objects_start =
-        page_hm + (desc_sz + element_sz - 1) / element_sz * element_sz;
+    objects_start = page_hm + slab_cache->offset +
+                    slab_cache->colour_next * _slab_colour_off(slab_cache);
+    if (++slab_cache->colour_next == slab_cache->colours) {
+      slab_cache->colour_next = 0;
+    }
   } else {
     // Allocate descriptor. Note that this will always allocate from the global
     // slab_cache, not the local one if slab_cache->allocator is set to
@@ -168,7 +504,8 @@ void slab_cache_alloc_slab(struct slab_cache *slab_cache) {
   }
 
   if (!slab) {
-    phys_rra_free_order(slab_cache->allocator, page, slab_cache->order);
+    phys_rra_free_order(slab_cache->allocator, page,
+                        ilog2(slab_cache->pages));
     return;
   }
 
@@ -180,83 +517,174 @@ void slab_cache_alloc_slab(struct slab_cache *slab_cache) {
   slab->allocated = 0;
 
   // Initialize freelist.
-  for (uint8_t i = 0; i < slab_cache->elements; ++i) {
-    slab->freelist[i].stack_item = i;
-    slab->freelist[i].pos_in_stk = i;
+  for (uint16_t i = 0; i < slab_cache->elements; ++i) {
+    slab->freelist[i] = i;
   }
 
-  // Set reference to slab_cache in struct page.
-  struct page *const pg_desc = phys_rra_get_page(slab_cache->allocator, page);
-  assert(pg_desc);
-  pg_desc->context.slab = slab;
+  // Construct the objects. They stay constructed while free.
+  if (slab_cache->ctor) {
+    for (size_t i = 0; i < slab_cache->elements; ++i) {
+      slab_cache->ctor(slab->data + i * slab_cache->size);
+    }
+  }
+
+  // Set reference to slab in the struct pages.
+  for (size_t i = 0; i < slab_cache->pages; ++i) {
+    struct page *const pg_desc =
+        phys_rra_get_page(slab_cache->allocator, page + (i << PG_SZ_BITS));
+    assert(pg_desc);
+    pg_desc->flags |= PHYS_PG_SLAB;
+    pg_desc->context.slab = slab;
+  }
+  if (slab_cache->pages == 1) {
+    phys_rra_set_movable(slab_cache->allocator, page, _slab_migrate_type);
+  }
 
   list_add(&slab_cache->empty_slabs, &slab->ll);
 }
 
+void slab_cache_alloc_slab(struct slab_cache *slab_cache) {
+  const uint64_t irq = op_irq_save();
+  _slab_cache_alloc_slab(slab_cache);
+  op_irq_restore(irq);
+}
+
 /**
- * Find a non-full slab in a slab cache. First check the empty list, then the
- * partially-full list. If no slabs exist, then allocate a new slab.
+ * Find a non-full slab in a slab cache. First check the partially-full list,
+ * then the empty list. If no slabs exist, then allocate a new slab. `*scan` is
+ * set to the number of steps this took (for statistics).
+ *
+ * Returns the slab's link in the slab lists (`struct slab::ll`, or `struct
+ * page::lru` for SLUB caches).
  */
-struct slab *_slab_cache_find_nonfull_slab(struct slab_cache *slab_cache) {
+struct list_head *_slab_cache_find_nonfull_slab(struct slab_cache *slab_cache,
+                                                size_t *scan) {
   // Look for partially-full slabs first.
+  *scan = 1;
   if (!list_empty(&slab_cache->partial_slabs)) {
-    return list_entry(slab_cache->partial_slabs.next, struct slab, ll);
+    return slab_cache->partial_slabs.next;
   }
 
   // Look for empty slabs next.
+  *scan = 2;
   if (!list_empty(&slab_cache->empty_slabs)) {
-    return list_entry(slab_cache->empty_slabs.next, struct slab, ll);
+    return slab_cache->empty_slabs.next;
   }
 
   // Need to allocate a new slab.
-  slab_cache_alloc_slab(slab_cache);
-  return list_empty(&slab_cache->empty_slabs)
-             ? NULL
-             : list_entry(slab_cache->empty_slabs.next, struct slab, ll);
+  *scan = 3;
+  _slab_cache_alloc_slab(slab_cache);
+  return list_empty(&slab_cache->empty_slabs) ? NULL
+                                              : slab_cache->empty_slabs.next;
+}
+
+/**
+ * Number of allocated objects in the slab linked by `ll`.
+ */
+static size_t _slab_cache_slab_inuse(const struct slab_cache *slab_cache,
+                                     struct list_head *ll) {
+  return _slab_cache_is_slub(slab_cache)
+             ? list_entry(ll, struct page, lru)->inuse
+             : list_entry(ll, struct slab, ll)->allocated;
+}
+
+/**
+ * Slab list for slabs with `inuse` allocated objects.
+ */
+static struct list_head *_slab_cache_list(struct slab_cache *slab_cache,
+                                          size_t inuse) {
+  if (!inuse) {
+    return &slab_cache->empty_slabs;
+  }
+  return inuse == slab_cache->elements ? &slab_cache->full_slabs
+                                       : &slab_cache->partial_slabs;
+}
+
+/**
+ * Move the slab linked by `ll` to the right slab list, after its number of
+ * allocated objects changed from `orig_inuse`.
+ */
+static void _slab_cache_relink(struct slab_cache *slab_cache,
+                               struct list_head *ll, size_t orig_inuse) {
+  struct list_head *const list =
+      _slab_cache_list(slab_cache, _slab_cache_slab_inuse(slab_cache, ll));
+  if (list != _slab_cache_list(slab_cache, orig_inuse)) {
+    list_del(ll);
+    list_add(list, ll);
+  }
 }
 
 void *_slab_alloc(struct slab *slab) {
   assert(slab);
   assert(slab->allocated < slab->parent->elements);
 
-  const size_t order_sz = 1u << slab->parent->order;
   void *const obj =
-      slab->data + slab->freelist[slab->allocated].stack_item * order_sz;
+      slab->data + slab->freelist[slab->allocated] * slab->parent->size;
   ++slab->allocated;
   return obj;
 }
 
-void *slab_cache_alloc(struct slab_cache *slab_cache) {
-  struct slab *const slab = _slab_cache_find_nonfull_slab(slab_cache);
-  if (!slab) {
-    return NULL;
-  }
+void *_slub_alloc(struct page *page) {
+  assert(page->inuse < page->context.slub.cache->elements);
 
-  bool is_slab_orig_empty = !slab->allocated;
+  void **const obj = page->context.slub.freelist;
+  assert(obj);
+  page->context.slub.freelist = *obj;
+  ++page->inuse;
+  return obj;
+}
 
-  // Perform allocation.
-  void *obj = _slab_alloc(slab);
+/**
+ * Allocate up to `n` objects from the slab lists into `objs`, bypassing the
+ * magazine layer. The objects of each slab are taken in one pass, and each slab
+ * moves between the slab lists at most once. `*scan` is set as in
+ * `_slab_cache_find_nonfull_slab()`, for the first slab.
+ *
+ * Returns the number of objects allocated, which is less than `n` only if no
+ * more slabs could be allocated.
+ */
+static size_t _slab_cache_alloc_bulk(struct slab_cache *slab_cache, size_t n,
+                                     void **objs, size_t *scan) {
+  size_t i = 0;
+  while (i < n) {
+    size_t slab_scan;
+    struct list_head *const ll =
+        _slab_cache_find_nonfull_slab(slab_cache, &slab_scan);
+    if (!i) {
+      *scan = slab_scan;
+    }
+    if (!ll) {
+      break;
+    }
 
-  if (slab->allocated == slab->parent->elements) {
-    // Move to full list.
-    list_del(&slab->ll);
-    list_add(&slab_cache->full_slabs, &slab->ll);
-  } else if (is_slab_orig_empty) {
-    // Move to partially-full list.
-    list_del(&slab->ll);
-    list_add(&slab_cache->partial_slabs, &slab->ll);
+    const size_t orig_inuse = _slab_cache_slab_inuse(slab_cache, ll);
+    if (_slab_cache_is_slub(slab_cache)) {
+      struct page *const page = list_entry(ll, struct page, lru);
+      while (i < n && page->inuse < slab_cache->elements) {
+        objs[i++] = _slub_alloc(page);
+      }
+    } else {
+      struct slab *const slab = list_entry(ll, struct slab, ll);
+      while (i < n && slab->allocated < slab_cache->elements) {
+        objs[i++] = _slab_alloc(slab);
+      }
+    }
+    _slab_cache_relink(slab_cache, ll, orig_inuse);
   }
-
-  return obj;
+  return i;
 }
 
-void *kmalloc(size_t sz) {
-  int order = ilog2ceil(sz);
+/**
+ * Allocate an object from the slab lists, bypassing the magazine layer. `*scan`
+ * is set as in `_slab_cache_find_nonfull_slab()`.
+ */
+static void *_slab_cache_alloc(struct slab_cache *slab_cache, size_t *scan) {
+  void *obj;
+  return _slab_cache_alloc_bulk(slab_cache, 1, &obj, scan) ? obj : NULL;
+}
 
-  if (order < SLAB_MIN_ORDER) {
-    order = SLAB_MIN_ORDER;
-  }
-  struct slab_cache *const slab_cache = _slab_allocator_get_cache(order);
+void *_kmalloc(size_t sz) {
+  struct slab_cache *const slab_cache = _slab_allocator_get_cache(sz);
   if (!slab_cache) {
     return NULL;
   }
@@ -264,74 +692,424 @@ void *kmalloc(size_t sz) {
 }
 
 void _slab_free(struct slab *slab, const void *obj) {
-  // Find the position of the object in the freelist.
+  // Find the index of the object in the slab.
   // - off: offset in bytes
   // - index: offset in (# of elements)
-  // - i: position in stack
   const size_t off = obj - slab->data;
-  const unsigned order = slab->parent->order;
+  const struct slab_cache *const slab_cache = slab->parent;
+
+  // Avoid the division for power-of-two sizes (e.g., the `kmalloc()` caches).
+  const uint16_t index = slab_cache->size == 1u << slab_cache->order
+                             ? off >> slab_cache->order
+                             : off / slab_cache->size;
 
   // Assert that the offset is aligned to the size of the object.
-  assert(!(off & ((1u << order) - 1)));
-
-  // Find index of the allocated element in the freelist.
-  const uint8_t index = off >> order;
-  assert(index < slab->parent->elements);
-  const uint8_t i = slab->freelist[index].pos_in_stk;
-
-  // Free the element at index 0. Beforehand:
-  //
-  //          used   |  free
-  //     | 0 | 2 | 3 | 4 | 1 | stack_item
-  //     | 0 | 4 | 1 | 2 | 3 | pos_in_stk
-  //
-  //       used  |   free
-  //     | 3 | 2 | 0 | 4 | 1 | stack_item
-  //     | 2 | 4 | 1 | 0 | 3 | pos_in_stk
-  //
-  // Afterwards. Note that 0 (the element to be freed) and 3 (the last used
-  // element) swap places.
-  --slab->allocated;
-  slab->freelist[i].stack_item = slab->freelist[slab->allocated].stack_item;
-  slab->freelist[slab->allocated].stack_item = index;
-
-  slab->freelist[index].pos_in_stk = slab->allocated;
-  slab->freelist[slab->freelist[i].stack_item].pos_in_stk = i;
+  assert(off == (size_t)index * slab_cache->size);
+  assert(index < slab_cache->elements);
+  assert(slab->allocated);
+
+  // Push the index onto the free stack, so that it's the next to be allocated.
+  slab->freelist[--slab->allocated] = index;
+}
+
+void _slub_free(struct page *page, const void *obj) {
+  const struct slab_cache *const slab_cache = page->context.slub.cache;
+
+  // Assert that the object is in this slab and aligned to the size of the
+  // object.
+  const size_t off =
+      obj - VM_TO_HHDM(phys_rra_page_addr(slab_cache->allocator, page));
+  assert(off < (size_t)slab_cache->pages << PG_SZ_BITS);
+  assert(!(off % slab_cache->size));
+  assert(page->inuse);
+
+  *(void **)obj = page->context.slub.freelist;
+  page->context.slub.freelist = (void *)obj;
+  --page->inuse;
+}
+
+/**
+ * Get the `struct page` of an object allocated from a slab cache. For SLUB
+ * slabs, this is the first page of the slab, which holds the slab state.
+ */
+static struct page *_slab_obj_get_page(struct phys_rra *rra, const void *obj) {
+  struct page *const pg = phys_rra_get_page(rra, VM_TO_IDM(obj));
+  assert(pg);
+  return pg->flags & PHYS_PG_SLUB_TAIL ? pg->context.head : pg;
+}
+
+/**
+ * Free an object to its slab, bypassing the magazine layer.
+ */
+static void _slab_cache_free(struct slab_cache *slab_cache, struct slab *slab,
+                             const void *obj) {
+  struct list_head *ll;
+  size_t orig_inuse;
+  if (_slab_cache_is_slub(slab_cache)) {
+    assert(!slab);
+    struct page *const pg = _slab_obj_get_page(slab_cache->allocator, obj);
+    assert(pg->flags & PHYS_PG_SLUB);
+    assert(pg->context.slub.cache == slab_cache);
+
+    orig_inuse = pg->inuse;
+    _slub_free(pg, obj);
+    ll = &pg->lru;
+  } else {
+    if (!slab) {
+      struct page *const pg = _slab_obj_get_page(slab_cache->allocator, obj);
+      slab = pg->context.slab;
+      assert(slab);
+      assert(slab->parent == slab_cache);
+    }
+
+    orig_inuse = slab->allocated;
+    _slab_free(slab, obj);
+    ll = &slab->ll;
+  }
+  _slab_cache_relink(slab_cache, ll, orig_inuse);
+}
+
+/**
+ * Free `n` objects to their slabs, bypassing the magazine layer. Runs of
+ * objects from the same slab are freed in one pass, and the slab moves between
+ * the slab lists at most once per run.
+ */
+static void _slab_cache_free_bulk(struct slab_cache *slab_cache, size_t n,
+                                  void *const objs[]) {
+  const size_t slab_sz = (size_t)slab_cache->pages << PG_SZ_BITS;
+  for (size_t i = 0; i < n;) {
+    struct list_head *ll;
+    size_t orig_inuse;
+    if (_slab_cache_is_slub(slab_cache)) {
+      struct page *const pg =
+          _slab_obj_get_page(slab_cache->allocator, objs[i]);
+      assert(pg->flags & PHYS_PG_SLUB);
+      assert(pg->context.slub.cache == slab_cache);
+
+      const void *const start =
+          VM_TO_HHDM(phys_rra_page_addr(slab_cache->allocator, pg));
+      orig_inuse = pg->inuse;
+      do {
+        _slub_free(pg, objs[i++]);
+      } while (i < n && (size_t)(objs[i] - start) < slab_sz);
+      ll = &pg->lru;
+    } else {
+      struct slab *const slab =
+          _slab_obj_get_page(slab_cache->allocator, objs[i])->context.slab;
+      assert(slab);
+      assert(slab->parent == slab_cache);
+
+      const size_t data_sz = (size_t)slab_cache->elements * slab_cache->size;
+      orig_inuse = slab->allocated;
+      do {
+        _slab_free(slab, objs[i++]);
+      } while (i < n && (size_t)(objs[i] - slab->data) < data_sz);
+      ll = &slab->ll;
+    }
+    _slab_cache_relink(slab_cache, ll, orig_inuse);
+  }
+}
+
+static bool _slab_magazine_has_rounds(const struct slab_magazine *mag) {
+  return mag && mag->rounds;
+}
+static bool _slab_magazine_has_space(const struct slab_magazine *mag) {
+  return mag && mag->rounds < SLAB_MAGAZINE_ROUNDS;
+}
+
+/**
+ * Allocate an object from the current CPU's magazines, exchanging an empty
+ * magazine for a full one from the depot if necessary. Returns NULL if there
+ * are no full magazines.
+ */
+static void *_slab_magazine_alloc(struct slab_cache *slab_cache) {
+  struct slab_cpu_cache *const cc = &slab_cache->cpu_caches[cpu_id()];
+  if (!_slab_magazine_has_rounds(cc->loaded)) {
+    if (_slab_magazine_has_rounds(cc->previous)) {
+      struct slab_magazine *const mag = cc->loaded;
+      cc->loaded = cc->previous;
+      cc->previous = mag;
+    } else if (!list_empty(&slab_cache->depot_full)) {
+      // Both magazines are empty (or missing).
+      if (cc->previous) {
+        list_add(&slab_cache->depot_empty, &cc->previous->ll);
+      }
+      cc->previous = cc->loaded;
+      cc->loaded = list_entry(slab_cache->depot_full.next,
+                              struct slab_magazine, ll);
+      list_del(&cc->loaded->ll);
+    } else {
+      return NULL;
+    }
+  }
+  return cc->loaded->objs[--cc->loaded->rounds];
+}
+
+/**
+ * Free an object to the current CPU's magazines, exchanging a full magazine for
+ * an empty one from the depot (or a new one) if necessary. Returns false if no
+ * empty magazine could be allocated.
+ */
+static bool _slab_magazine_free(struct slab_cache *slab_cache,
+                                const void *obj) {
+  struct slab_cpu_cache *const cc = &slab_cache->cpu_caches[cpu_id()];
+  if (!_slab_magazine_has_space(cc->loaded)) {
+    if (_slab_magazine_has_space(cc->previous)) {
+      struct slab_magazine *const mag = cc->loaded;
+      cc->loaded = cc->previous;
+      cc->previous = mag;
+    } else {
+      // Both magazines are full (or missing).
+      struct slab_magazine *mag;
+      if (!list_empty(&slab_cache->depot_empty)) {
+        mag = list_entry(slab_cache->depot_empty.next, struct slab_magazine,
+                         ll);
+        list_del(&mag->ll);
+      } else if ((mag = slab_cache_alloc(&_slab_magazine_cache))) {
+        // N.B. This may have reclaimed (drained) this CPU's magazines.
+        mag->rounds = 0;
+      } else {
+        return false;
+      }
+      if (cc->previous) {
+        list_add(&slab_cache->depot_full, &cc->previous->ll);
+      }
+      cc->previous = cc->loaded;
+      cc->loaded = mag;
+    }
+  }
+  cc->loaded->objs[cc->loaded->rounds++] = (void *)obj;
+  return true;
+}
+
+void *slab_cache_alloc(struct slab_cache *slab_cache) {
+  const uint64_t irq = op_irq_save();
+  const uint64_t start_tsc = mem_stat_start();
+  size_t scan = 0;
+  void *obj =
+      slab_cache->cpu_caches ? _slab_magazine_alloc(slab_cache) : NULL;
+  if (!obj) {
+    obj = _slab_cache_alloc(slab_cache, &scan);
+  }
+  mem_stat_record(MEM_STAT_SLAB, MEM_STAT_ALLOC, slab_cache->order, start_tsc,
+                  scan, !obj);
+  op_irq_restore(irq);
+  return obj;
 }
 
 void slab_cache_free(struct slab_cache *slab_cache, struct slab *slab,
                      const void *obj) {
-  if (!slab) {
-    struct page *pg = phys_rra_get_page(slab_cache->allocator, VM_TO_IDM(obj));
-    assert(pg);
+  const uint64_t irq = op_irq_save();
+  const uint64_t start_tsc = mem_stat_start();
+  if (!slab_cache->cpu_caches || !_slab_magazine_free(slab_cache, obj)) {
+    _slab_cache_free(slab_cache, slab, obj);
+  }
+  mem_stat_record(MEM_STAT_SLAB, MEM_STAT_FREE, slab_cache->order, start_tsc, 0,
+                  false);
+  op_irq_restore(irq);
+}
+
+bool slab_cache_alloc_bulk(struct slab_cache *slab_cache, size_t n,
+                           void **objs) {
+  const uint64_t irq = op_irq_save();
+  const uint64_t start_tsc = mem_stat_start();
+  size_t scan = 0;
+  const size_t allocated =
+      _slab_cache_alloc_bulk(slab_cache, n, objs, &scan);
+  if (allocated < n) {
+    _slab_cache_free_bulk(slab_cache, allocated, objs);
+  }
+  mem_stat_record(MEM_STAT_SLAB, MEM_STAT_ALLOC, slab_cache->order, start_tsc,
+                  scan, allocated < n);
+  op_irq_restore(irq);
+  return allocated == n;
+}
+
+void slab_cache_free_bulk(struct slab_cache *slab_cache, size_t n,
+                          void *const objs[]) {
+  const uint64_t irq = op_irq_save();
+  const uint64_t start_tsc = mem_stat_start();
+  _slab_cache_free_bulk(slab_cache, n, objs);
+  mem_stat_record(MEM_STAT_SLAB, MEM_STAT_FREE, slab_cache->order, start_tsc, 0,
+                  false);
+  op_irq_restore(irq);
+}
+
+void slab_cache_init_magazines(struct slab_cache *slab_cache,
+                               struct slab_cpu_cache *cpu_caches) {
+  for (unsigned cpu = 0; cpu < NR_CPUS; ++cpu) {
+    cpu_caches[cpu].loaded = NULL;
+    cpu_caches[cpu].previous = NULL;
+  }
+  slab_cache->cpu_caches = cpu_caches;
+}
+
+/**
+ * Return the objects in a magazine to their slabs, and free the magazine.
+ * Returns the number of objects returned.
+ */
+static size_t _slab_magazine_flush(struct slab_cache *slab_cache,
+                                   struct slab_magazine *mag) {
+  if (!mag) {
+    return 0;
+  }
+  const size_t rounds = mag->rounds;
+  while (mag->rounds) {
+    _slab_cache_free(slab_cache, NULL, mag->objs[--mag->rounds]);
+  }
+  slab_cache_free(&_slab_magazine_cache, NULL, mag);
+  return rounds;
+}
 
-    slab = pg->context.slab;
-    assert(slab);
-    assert(slab->parent == slab_cache);
+size_t slab_cache_drain(struct slab_cache *slab_cache) {
+  if (!slab_cache->cpu_caches) {
+    return 0;
   }
+  const uint64_t irq = op_irq_save();
+  size_t drained = 0;
+  for (unsigned cpu = 0; cpu < NR_CPUS; ++cpu) {
+    struct slab_cpu_cache *const cc = &slab_cache->cpu_caches[cpu];
+    drained += _slab_magazine_flush(slab_cache, cc->loaded);
+    drained += _slab_magazine_flush(slab_cache, cc->previous);
+    cc->loaded = cc->previous = NULL;
+  }
+#define FLUSH_DEPOT(field)                                                     \
+  while (!list_empty(&slab_cache->field)) {                                    \
+    struct slab_magazine *const mag =                                          \
+        list_entry(slab_cache->field.next, struct slab_magazine, ll);          \
+    list_del(&mag->ll);                                                        \
+    drained += _slab_magazine_flush(slab_cache, mag);                          \
+  }
+
+  FLUSH_DEPOT(depot_full);
+  FLUSH_DEPOT(depot_empty);
+#undef FLUSH_DEPOT
+  op_irq_restore(irq);
+  return drained;
+}
 
-  bool is_slab_orig_full = slab->allocated == slab_cache->elements;
+struct slab_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, void (*ctor)(void *obj)) {
+  if (!align) {
+    align = sizeof(void *);
+  }
+  assert(!(align & (align - 1)) && align <= PG_SZ);
 
-  // Perform freeing.
-  _slab_free(slab, obj);
+  // Objects must be large enough for the SLUB freelist and for the SLAB
+  // freelist indices, and consecutive objects must be aligned.
+  if (size < (1u << SLAB_MIN_ORDER)) {
+    size = 1u << SLAB_MIN_ORDER;
+  }
+  size = (size + align - 1) & ~(align - 1);
+  if (size > (1u << SLAB_MAX_ORDER)) {
+    return NULL;
+  }
 
-  if (!slab->allocated) {
-    // Move to empty list.
-    list_del(&slab->ll);
-    list_add(&slab_cache->empty_slabs, &slab->ll);
-  } else if (is_slab_orig_full) {
-    // Move to partially-full list.
-    list_del(&slab->ll);
-    list_add(&slab_cache->partial_slabs, &slab->ll);
+  struct _slab_named_cache *const named_cache =
+      kmalloc(sizeof(struct _slab_named_cache));
+  if (!named_cache) {
+    return NULL;
   }
+  struct slab_cache *const slab_cache = &named_cache->cache;
+  _slab_cache_init(slab_cache, phys_mem_get_rra(), size, align,
+                   ctor ? SLAB_BACKEND_SLAB : SLAB_KMALLOC_BACKEND);
+  slab_cache->name = name;
+  slab_cache->ctor = ctor;
+  slab_cache_init_magazines(slab_cache, named_cache->cpu_caches);
+  const uint64_t irq = op_irq_save();
+  list_add_tail(&_slab_named_caches, &slab_cache->ll);
+  op_irq_restore(irq);
+  return slab_cache;
+}
+
+void kmem_cache_destroy(struct slab_cache *slab_cache) {
+  const uint64_t irq = op_irq_save();
+  list_del(&slab_cache->ll);
+
+  // Objects in magazines are free, but the rest must have been freed.
+  slab_cache_drain(slab_cache);
+  assert(list_empty(&slab_cache->partial_slabs));
+  assert(list_empty(&slab_cache->full_slabs));
+
+  slab_cache_destroy(slab_cache);
+  op_irq_restore(irq);
+  kfree(list_entry(slab_cache, struct _slab_named_cache, cache));
+}
+
+/**
+ * Find the slab cache of an object allocated from a slab cache, and its slab
+ * (NULL for SLUB caches).
+ */
+static struct slab_cache *_slab_obj_get_cache(const void *obj,
+                                              struct slab **slab) {
+  struct page *const pg = _slab_obj_get_page(phys_mem_get_rra(), obj);
+  if (pg->flags & PHYS_PG_SLUB) {
+    *slab = NULL;
+    return pg->context.slub.cache;
+  }
+  assert(pg->flags & PHYS_PG_SLAB);
+
+  *slab = pg->context.slab;
+  assert(*slab);
+  return (*slab)->parent;
+}
+
+/**
+ * Free a large-order slab's descriptor, bypassing the magazine layer. This is
+ * used when destroying slabs during reclaim or compaction, where `kfree()` must
+ * not allocate a new magazine (which may recurse into them).
+ */
+static void _slab_free_desc(struct slab *slab) {
+  if (is_kfence_addr(slab)) {
+    kfence_free(slab, __builtin_return_address(0));
+    return;
+  }
+  struct slab *desc_slab;
+  struct slab_cache *const slab_cache = _slab_obj_get_cache(slab, &desc_slab);
+  _slab_cache_free(slab_cache, desc_slab, slab);
 }
 
 void kfree(const void *obj) {
-  struct page *const pg = phys_rra_get_page(phys_mem_get_rra(), VM_TO_IDM(obj));
-  assert(pg);
+  if (is_kfence_addr(obj)) {
+    kfence_free(obj, __builtin_return_address(0));
+    return;
+  }
+  struct slab *slab;
+  struct slab_cache *const slab_cache = _slab_obj_get_cache(obj, &slab);
+  slab_cache_free(slab_cache, slab, obj);
+}
 
-  struct slab *const slab = pg->context.slab;
-  assert(slab);
+size_t ksize(const void *obj) {
+  if (is_kfence_addr(obj)) {
+    return kfence_ksize(obj);
+  }
+  struct slab *slab;
+  return _slab_obj_get_cache(obj, &slab)->size;
+}
 
-  slab_cache_free(slab->parent, slab, obj);
+void *krealloc(const void *obj, size_t sz) {
+  if (!obj) {
+    return kmalloc(sz);
+  }
+  if (!sz) {
+    kfree(obj);
+    return NULL;
+  }
+
+  const size_t old_sz = ksize(obj);
+  if (sz <= old_sz) {
+    return (void *)obj;
+  }
+
+  void *const new_obj = kmalloc(sz);
+  if (!new_obj) {
+    return NULL;
+  }
+  // The `kmalloc()` size classes are multiples of 16 bytes, but KFENCE objects
+  // have their requested size.
+  const size_t tail = old_sz & (sizeof(uint64_t) - 1);
+  op_movsq(new_obj, obj, old_sz / sizeof(uint64_t));
+  memcpy(new_obj + old_sz - tail, obj + old_sz - tail, tail);
+  kfree(obj);
+  return new_obj;
 }
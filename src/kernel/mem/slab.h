@@ -6,15 +6,21 @@
  * requires an overhead of 2 bytes per object, plus the slab descriptor.
  * Compared to the SLUB allocator (described below), this has a relatively high
  * memory overhead; the benefit is that it does allow for caching initialized
- * objects.
+ * objects (see `kmem_cache_create()`).
  *
  * An alternate (and possibly better overall) design is that of the Linux SLUB
  * allocator, which instead stores slab metadata in the `struct page`, requires
  * no overhead per element, and maintains O(1) allocations/frees. Free elements
  * form a linked list (the freelist). However, this requires overwriting the
  * objects themselves, which makes this method unsuitable for caching
- * initialized objects. If implemented, much of the logic for the SLUB allocator
- * can be shared with this slab allocator.
+ * initialized objects.
+ *
+ * Both designs are implemented as backends (`enum slab_backend`), which can be
+ * chosen per slab cache. The SLUB backend shares the slab lists and most of the
+ * logic below; its slabs are the backing pages themselves, linked through
+ * `struct page::lru`, with the freelist head and allocation count also in the
+ * `struct page` (PHYS_PG_SLUB). The `kmalloc()` caches use the SLAB backend,
+ * unless built with `make SLUB=1`.
  *
  * A slab allocator allows for allocations of a power-of-2 order, from
  * 2^SLAB_MIN_ORDER to 2^SLAB_MAX_ORDER. A slab allocator (`struct slab_cache`)
@@ -25,30 +31,52 @@
  * - The LIFO freelist.
  * - The physical backing page(s) for the slab elements.
  *
- * The freelist is an array of 8-byte indices. If a slab of N total objects has
- * A allocated objects, then the first A elements of the freelist contain the
- * indices of the A allocated objects, and the remaining N-A elements of the
- * freelist contain the indices of the remaining N-A free elements. Allocations
- * within a slab simply mean allocating the next free element within a slab and
- * incrementing A (if there are none, then allocate another slab); deallocations
- * mean swapping the freed element with the last-allocated element in the
- * freelist and decrementing A.
+ * The freelist is an array of 16-bit object indices. If a slab of N total
+ * objects has A allocated objects, then the last N-A elements of the freelist
+ * are a stack of the indices of the free objects, with its top at index A.
+ * Allocations within a slab simply mean allocating the object on top of the
+ * stack and incrementing A (if there are none, then allocate another slab);
+ * deallocations mean decrementing A and pushing the freed object's index.
  *
  * The layout in memory is somewhat different for "small" orders (SLAB_MIN_ORDER
  * <= order <= SLAB_SMALL_MAX_ORDER) and "large" orders (SLAB_LARGE_MIN_ORDER <=
  * order <= SLAB_MAX_ORDER). Small-order slabs store their slab descriptor and
- * LIFO freelist on the physical backing page for the slab elements. Large order
+ * LIFO freelist on the physical backing pages for the slab elements, and span
+ * several pages so that the descriptor is shared by many objects. Large order
  * slabs store their slab descriptor and LIFO freelist in memory chunks
  * allocated using the lower-order slab allocators. The latter works well
  * because it causes less wasted space on the physical backing pages, and the
  * freelists are small because there are few elements per slab.
  *
  * The slab allocators underlie the familiar `kmalloc()` interface, which
- * delegates the work to the appropriate slab allocator.
+ * delegates the work to the slab allocator of the smallest size class that fits
+ * the request. The size classes are the powers of two, plus intermediate
+ * classes (48, 96, 192, ...) between them; see slab.c.
+ *
+ * Objects of a frequently-allocated type should instead come from a named slab
+ * cache (`kmem_cache_create()`), which holds objects of exactly that size (and
+ * alignment) rather than of the next power of two. A named cache may have a
+ * constructor, which initializes each object once when its slab is allocated;
+ * users must return objects to their constructed state before freeing them, so
+ * that allocations skip the initialization. Named caches with a constructor
+ * always use the SLAB backend, since SLUB overwrites free objects.
+ *
+ * Small-order slabs are coloured, as in Bonwick, "The Slab Allocator" (USENIX
+ * 1994). Slabs are aligned to their size, so without colouring, the i-th object
+ * of every slab would map to the same cache sets. Instead, the objects of each
+ * new slab are shifted by the next multiple of a cache line (the slab's colour)
+ * that fits in the slack at the end of the slab, cycling through the colours.
  *
  * When freeing an object, the slab that the object belongs to is noted by the
  * `struct page` for the physical page of the object memory.
  *
+ * Single-page slabs are movable (see `phys_rra_compact()`): physical memory
+ * compaction may release their backing pages while they are empty.
+ *
+ * As in the page allocator, there is no lock: the `slab_cache_*()` entry points
+ * mask interrupts, so that background tasks (e.g., `reclaim_task()`) can't
+ * shrink a slab cache in the middle of an allocation.
+ *
  * Design-wise, there are three levels of abstraction (most to least abstract):
  *
  * 1. `kmalloc()`/`kfree()`
@@ -60,17 +88,34 @@
  * `_slab_*()` methods. `kmalloc()`/`kfree()` should be sufficient for most use
  * cases unless a custom slab allocator is needed.
  *
- * TODO(jlam55555): Introduce a `slab_cache_purge()` method that purges unused
- * slabs in the slablists. This will only be needed for low-memory situations so
- * it's not something we need to worry about in usual operation.
+ * Empty slabs are kept around for future allocations. When memory runs low,
+ * reclaim (see mem/reclaim.h) returns the empty slabs of the main slab caches
+ * to the physical allocator with `slab_cache_purge()`.
+ *
+ * A slab cache may have a per-CPU magazine layer in front of it, as described
+ * in Bonwick and Adams, "Magazines and Vmem" (USENIX 2001). A magazine is a
+ * stack of up to SLAB_MAGAZINE_ROUNDS free objects. Each CPU has a loaded and a
+ * previous magazine; allocations pop from (and frees push to) the loaded
+ * magazine, swapping it with the previous one if it is empty (full). Only if
+ * both are empty (full) does the CPU exchange a magazine with the slab cache's
+ * depot of full and empty magazines, and only if the depot has no full
+ * magazines does an allocation reach the slab lists. Thus, most allocations
+ * and frees only touch the current CPU's magazines. The `kmalloc()` caches have
+ * magazines.
+ *
+ * Objects in magazines are still allocated as far as the slabs are concerned.
+ * Reclaim flushes them back to their slabs with `slab_cache_drain()` before
+ * purging.
  */
 #ifndef MEM_SLAB_H
 #define MEM_SLAB_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #include "common/list.h" // for struct list_head
+#include "mem/kfence.h"  // for kfence_sample
 #include "mem/phys.h"    // for struct phys_rra
 
 #define SLAB_MIN_ORDER 4
@@ -78,25 +123,82 @@
 #define SLAB_SMALL_MAX_ORDER 7
 #define SLAB_LARGE_MIN_ORDER (SLAB_SMALL_MAX_ORDER + 1)
 
+/**
+ * Cache colouring of small-order slabs (see above). Colours are at least
+ * SLAB_COLOUR_ALIGN bytes (a cache line) apart.
+ */
+#define SLAB_COLOUR_ALIGN 64
+#define SLAB_MIN_COLOURS 4
+
+/**
+ * Slab cache implementations. See above.
+ */
+enum slab_backend {
+  // Slab descriptor with a LIFO freelist array.
+  SLAB_BACKEND_SLAB,
+  // SLUB: in-object freelist, and slab state in `struct page`.
+  SLAB_BACKEND_SLUB,
+};
+
+/**
+ * Backend of the `kmalloc()` caches.
+ */
+#ifdef SLUB
+#define SLAB_KMALLOC_BACKEND SLAB_BACKEND_SLUB
+#else
+#define SLAB_KMALLOC_BACKEND SLAB_BACKEND_SLAB
+#endif // SLUB
+
 /**
  * See comment in slab.c.
  */
 struct slab;
 
 /**
- * Slab allocator for a particular order. Maintains a cache of `struct slab`s
- * for this order.
+ * Magazine of free objects. See above. Magazines are allocated from their own
+ * (magazine-less) slab cache, and are linked into the depot by `ll`.
+ */
+#define SLAB_MAGAZINE_ROUNDS 29
+struct slab_magazine {
+  struct list_head ll;
+  size_t rounds;
+  void *objs[SLAB_MAGAZINE_ROUNDS];
+};
+
+/**
+ * Per-CPU magazines of a slab cache. Either may be NULL.
+ */
+struct slab_cpu_cache {
+  struct slab_magazine *loaded;
+  struct slab_magazine *previous;
+};
+
+/**
+ * Slab allocator for a particular object size. Maintains a cache of `struct
+ * slab`s for this size.
  */
 struct slab_cache {
+  // Size class: ilog2ceil(size). Objects are "small" if their size class is at
+  // most SLAB_SMALL_MAX_ORDER.
   unsigned order; // 4
 
-  uint8_t pages;    // 1
-  uint8_t elements; // 1
+  uint8_t pages;     // 1
+  uint8_t backend;   // 1 (enum slab_backend)
+  uint16_t elements; // 2
 
   // Precomputed offset from page start. Only useful for data in small-order
   // slabs. (Always 0 for large-order slabs.)
   uint16_t offset; // 2
 
+  // Cache colouring: number of colours, and the colour of the next new slab.
+  // Only small-order SLAB-backend slabs have more than one colour.
+  uint8_t colours;     // 1
+  uint8_t colour_next; // 1
+
+  // Object size, including any padding for alignment. This is 2^order for
+  // `slab_cache_init()` caches.
+  uint32_t size; // 4
+
   // Physical page allocator.
   struct phys_rra *allocator; // 8
 
@@ -105,6 +207,22 @@ struct slab_cache {
   struct list_head empty_slabs;
   struct list_head partial_slabs;
   struct list_head full_slabs;
+
+  // Per-CPU magazines (an array of NR_CPUS elements), or NULL if this slab
+  // cache doesn't have a magazine layer. See `slab_cache_init_magazines()`.
+  struct slab_cpu_cache *cpu_caches;
+
+  // Magazine depot: full and empty magazines not loaded by any CPU.
+  //
+  // TODO(jlam55555): The depot needs a lock once there is SMP support.
+  struct list_head depot_full;
+  struct list_head depot_empty;
+
+  // Named caches only (see `kmem_cache_create()`); otherwise NULL. `ll` links
+  // the named caches together.
+  const char *name;
+  void (*ctor)(void *obj);
+  struct list_head ll;
 };
 
 /**
@@ -114,15 +232,22 @@ struct slab_cache {
 void slab_allocators_init(void);
 
 /**
- * Allocate memory region up to 128KiB.
+ * Allocate memory region up to 64KiB. The region is aligned to the largest
+ * power of two that divides its size class (at least 16 bytes).
  *
- * Note that allocations >4KiB (PG_SZ) are not guaranteed to be fast or even to
- * succeed. This uses a very naive implementation for contiguous multi-physical
- * page allocations.
+ * Allocations >4KiB (PG_SZ) need physically contiguous pages. If the buddy
+ * allocator is too fragmented to provide them even after compaction, they come
+ * from the CMA area, so they are slower but don't fail unless memory (or the
+ * CMA area) is exhausted.
  *
  * Returns NULL if the memory size is too large or no memory can be allocated.
+ *
+ * If `sz` is a compile-time constant, the size class is resolved at compile
+ * time, and this is a direct call to `slab_cache_alloc()`. Otherwise, this
+ * calls `_kmalloc()`, which looks up the size class at run time.
  */
-void *kmalloc(size_t sz);
+static inline void *kmalloc(size_t sz);
+void *_kmalloc(size_t sz);
 
 /**
  * Free a memory region allocated with `kmalloc()` or directly from a slab
@@ -130,34 +255,106 @@ void *kmalloc(size_t sz);
  */
 void kfree(const void *obj);
 
+/**
+ * Usable size of a memory region allocated with `kmalloc()` or directly from a
+ * slab allocator, i.e., its object size. This is at least the requested size.
+ */
+size_t ksize(const void *obj);
+
+/**
+ * Resize a memory region allocated with `kmalloc()` to `sz` bytes. If the new
+ * size still fits the region's size class (see `ksize()`), the region is
+ * resized in place and `obj` is returned. Otherwise, the data is moved to a new
+ * region, and `obj` is freed.
+ *
+ * If `obj` is NULL, this is `kmalloc(sz)`. If `sz` is 0, this is `kfree(obj)`
+ * and returns NULL. Returns NULL (and leaves `obj` as is) if the new size is
+ * too large or no memory can be allocated. See `vrealloc()` for `vmalloc()`
+ * allocations.
+ */
+void *krealloc(const void *obj, size_t sz);
+
 /**
  * Initialize a `struct slab_cache`, including dynamically determining how many
  * elements should be in this slab_cache.
  *
- * Requirements for number of elements per slab of size S (usually S == PG_SZ,
- * but S must be larger if 2^M > PG_SZ):
+ * Requirements for number of elements per slab of size S (usually S == PG_SZ
+ * for large object slabs, but S must be larger if 2^M > PG_SZ; a few pages for
+ * small object slabs):
  * - For small object slabs of order M:
- *   - sizeof(struct slab) + N + N*2^M <= S.
+ *   - sizeof(struct slab) + 2*N + N*2^M <= S.
  *   - Note that the objects need to be 2^M aligned as well.
+ *   - The slack must leave room for at least SLAB_MIN_COLOURS colours.
  * - For large object slabs of order M:
  *   - N*2^M <= S
- *   - sizeof(struct slab) + N <= 2^(M-1). (This means that the descriptor size
+ *   - sizeof(struct slab) + 2*N <= 2^(M-1). (This means that the descriptor size
  *     can use a lower-order slab allocator.)
  *
  * In general, the goal is to minimize wasted space overhead. The number of
  * wasted bytes is computed by _slab_allocator_init. (Perhaps a better measure
  * of "wasted bytes" might be the ratio of allocatable bytes to the total
  * backing store size for one slab.)
+ *
+ * SLUB slabs have no descriptor, so N*2^M <= S for all orders. Named caches
+ * (`kmem_cache_create()`) are the same, with the object size in place of 2^M.
+ * If such objects don't evenly divide S, then S may be larger to waste less
+ * of each slab.
+ *
+ * `slab_cache_init()` uses the SLAB backend.
  */
 void slab_cache_init(struct slab_cache *slab_cache, struct phys_rra *rra,
                      unsigned order);
+void slab_cache_init_backend(struct slab_cache *slab_cache,
+                             struct phys_rra *rra, unsigned order,
+                             enum slab_backend backend);
+
+/**
+ * Create a named slab cache for objects of `size` bytes, aligned to `align`
+ * bytes (a power of two, or 0 for pointer alignment). If `ctor` is not NULL, it
+ * is called on every object when its slab is allocated. The cache has
+ * magazines, and is reclaimed along with the `kmalloc()` caches.
+ *
+ * Allocate objects with `slab_cache_alloc()`, and free them with
+ * `slab_cache_free()` or `kfree()`.
+ *
+ * Returns NULL if the object size is larger than 2^SLAB_MAX_ORDER, or if no
+ * memory could be allocated.
+ */
+struct slab_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, void (*ctor)(void *obj));
+
+/**
+ * Destroy a slab cache created with `kmem_cache_create()`. All of its objects
+ * must have been freed.
+ */
+void kmem_cache_destroy(struct slab_cache *slab_cache);
+
+/**
+ * Put a per-CPU magazine layer in front of a slab cache. `cpu_caches` is an
+ * array of NR_CPUS elements, which must outlive the slab cache.
+ */
+void slab_cache_init_magazines(struct slab_cache *slab_cache,
+                               struct slab_cpu_cache *cpu_caches);
+
+/**
+ * Return all objects in the magazines of a slab cache (both the per-CPU and
+ * depot magazines) to their slabs, and free the magazines. Returns the number
+ * of objects returned.
+ */
+size_t slab_cache_drain(struct slab_cache *slab_cache);
 
 /**
  * Clean up a slab cache. This means cleaning up all slabs associated with this
- * slab cache.
+ * slab cache (and its magazines).
  */
 void slab_cache_destroy(struct slab_cache *slab_cache);
 
+/**
+ * Free up to `nr_pg` pages worth of empty slabs of a slab cache (it may free
+ * slightly more for multi-page slabs). Returns the number of pages freed.
+ */
+size_t slab_cache_purge(struct slab_cache *slab_cache, size_t nr_pg);
+
 /**
  * Allocate a new slab for the provided slab cache, and add the new slab to the
  * slab cache's empty list.
@@ -169,6 +366,25 @@ void slab_cache_alloc_slab(struct slab_cache *slab_cache);
  */
 void *slab_cache_alloc(struct slab_cache *slab_cache);
 
+/**
+ * Allocate `n` objects from a slab cache into `objs`. This bypasses the
+ * magazine layer: the objects of each slab are taken in one pass, and each slab
+ * moves between the slab lists once rather than once per object.
+ *
+ * Returns false (and allocates nothing) if not all `n` objects could be
+ * allocated.
+ */
+bool slab_cache_alloc_bulk(struct slab_cache *slab_cache, size_t n,
+                           void **objs);
+
+/**
+ * Free `n` objects to a slab cache, bypassing the magazine layer. Objects from
+ * the same slab (e.g., from the same `slab_cache_alloc_bulk()`) should be
+ * adjacent in `objs`, so that each slab moves between the slab lists once.
+ */
+void slab_cache_free_bulk(struct slab_cache *slab_cache, size_t n,
+                          void *const objs[]);
+
 /**
  * Frees the object from the parent slab cache.
  *
@@ -176,8 +392,58 @@ void *slab_cache_alloc(struct slab_cache *slab_cache);
  * `slab_cache` and `slab` is that we may know the slab in the process of
  * finding the slab_cache when freeing an object. If the slab is provided (not
  * NULL), it'll be used; otherwise, it'll be looked up from the `struct page`.
+ * (SLUB caches don't have `struct slab`s, so it must be NULL for them.)
  */
 void slab_cache_free(struct slab_cache *slab_cache, struct slab *slab,
                      const void *obj);
 
+/**
+ * Main slab caches, one per `kmalloc()` size class. See slab.c.
+ */
+extern struct slab_cache _slab_caches[];
+
+/**
+ * Index into `_slab_caches` of the smallest `kmalloc()` size class that fits
+ * `sz` bytes, or -1 if there is none. This is meant to be constant-folded, and
+ * must match the size classes in slab.c.
+ */
+static inline int _slab_kmalloc_const_index(size_t sz) {
+  return sz <= 16      ? 0
+         : sz <= 32    ? 1
+         : sz <= 48    ? 2
+         : sz <= 64    ? 3
+         : sz <= 96    ? 4
+         : sz <= 128   ? 5
+         : sz <= 192   ? 6
+         : sz <= 256   ? 7
+         : sz <= 384   ? 8
+         : sz <= 512   ? 9
+         : sz <= 768   ? 10
+         : sz <= 1024  ? 11
+         : sz <= 1536  ? 12
+         : sz <= 2048  ? 13
+         : sz <= 3072  ? 14
+         : sz <= 4096  ? 15
+         : sz <= 6144  ? 16
+         : sz <= 8192  ? 17
+         : sz <= 12288 ? 18
+         : sz <= 16384 ? 19
+         : sz <= 32768 ? 20
+         : sz <= 65536 ? 21
+                       : -1;
+}
+
+static inline __attribute__((always_inline)) void *kmalloc(size_t sz) {
+#ifdef KFENCE
+  if (kfence_sample()) {
+    return _kfence_kmalloc(sz);
+  }
+#endif // KFENCE
+  if (__builtin_constant_p(sz)) {
+    const int i = _slab_kmalloc_const_index(sz);
+    return i < 0 ? NULL : slab_cache_alloc(&_slab_caches[i]);
+  }
+  return _kmalloc(sz);
+}
+
 #endif // MEM_SLAB_H
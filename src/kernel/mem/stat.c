@@ -0,0 +1,143 @@
+#include "mem/stat.h"
+
+#include "common/libc.h"
+#include "common/opcodes.h" // for op_bsr
+
+unsigned mem_stat_bucket(uint64_t cycles) {
+  if (!cycles) {
+    return 0;
+  }
+  const unsigned bucket = op_bsr(cycles);
+  return bucket < MEM_STAT_BUCKETS ? bucket : MEM_STAT_BUCKETS - 1;
+}
+
+#ifdef MEMSTAT
+
+static const char *const _mem_stat_allocator_names[MEM_STAT_NR_ALLOCATORS] = {
+    [MEM_STAT_PHYS] = "phys",
+    [MEM_STAT_SLAB] = "slab",
+};
+static const char *const _mem_stat_op_names[MEM_STAT_NR_OPS] = {
+    [MEM_STAT_ALLOC] = "alloc",
+    [MEM_STAT_FREE] = "free",
+};
+
+static struct mem_stat_order _mem_stats[MEM_STAT_NR_ALLOCATORS]
+                                       [MEM_STAT_MAX_ORDER + 1];
+
+void mem_stat_record(enum mem_stat_allocator allocator, enum mem_stat_op op,
+                     unsigned order, uint64_t start_tsc, size_t scan,
+                     bool failed) {
+  const uint64_t cycles = op_rdtsc() - start_tsc;
+  if (order > MEM_STAT_MAX_ORDER) {
+    return;
+  }
+  struct mem_stat_order *const stat = &_mem_stats[allocator][order];
+  struct mem_stat_hist *const hist = &stat->hist[op];
+  ++hist->count;
+  hist->cycles += cycles;
+  ++hist->buckets[mem_stat_bucket(cycles)];
+
+  if (op == MEM_STAT_ALLOC) {
+    stat->failures += failed;
+    stat->scan += scan;
+    if (scan > stat->scan_max) {
+      stat->scan_max = scan;
+    }
+  }
+}
+
+const struct mem_stat_order *mem_stat_get(enum mem_stat_allocator allocator,
+                                          unsigned order) {
+  return order <= MEM_STAT_MAX_ORDER ? &_mem_stats[allocator][order] : NULL;
+}
+
+void mem_stat_reset(void) { memset(_mem_stats, 0, sizeof(_mem_stats)); }
+
+/**
+ * Returns the upper bound (in cycles) of the bucket containing the q-th
+ * percentile of the histogram.
+ */
+static uint64_t _mem_stat_percentile(const struct mem_stat_hist *hist,
+                                     unsigned q) {
+  const uint64_t target = (hist->count * q + 99) / 100;
+  uint64_t seen = 0;
+  for (unsigned bucket = 0; bucket < MEM_STAT_BUCKETS; ++bucket) {
+    if ((seen += hist->buckets[bucket]) >= target) {
+      return 2lu << bucket;
+    }
+  }
+  return 2lu << (MEM_STAT_BUCKETS - 1);
+}
+
+void mem_stat_print(void) {
+  printf("\rAllocator statistics (latencies in cycles):\r\n");
+  for (unsigned allocator = 0; allocator < MEM_STAT_NR_ALLOCATORS;
+       ++allocator) {
+    for (unsigned order = 0; order <= MEM_STAT_MAX_ORDER; ++order) {
+      const struct mem_stat_order *const stat = &_mem_stats[allocator][order];
+      for (unsigned op = 0; op < MEM_STAT_NR_OPS; ++op) {
+        const struct mem_stat_hist *const hist = &stat->hist[op];
+        if (!hist->count) {
+          continue;
+        }
+        printf("%s %s order %u: %lu ops, mean %lu, p50 < %lu, p99 < %lu",
+               _mem_stat_allocator_names[allocator], _mem_stat_op_names[op],
+               order, hist->count, hist->cycles / hist->count,
+               _mem_stat_percentile(hist, 50), _mem_stat_percentile(hist, 99));
+        if (op == MEM_STAT_ALLOC) {
+          printf(", %lu failed, mean scan %lu, max scan %lu", stat->failures,
+                 stat->scan / hist->count, stat->scan_max);
+        }
+        printf("\r\n");
+      }
+    }
+  }
+}
+
+void mem_stat_dump(void) {
+  printf("\rMEMSTAT begin\r\n");
+  for (unsigned allocator = 0; allocator < MEM_STAT_NR_ALLOCATORS;
+       ++allocator) {
+    for (unsigned order = 0; order <= MEM_STAT_MAX_ORDER; ++order) {
+      const struct mem_stat_order *const stat = &_mem_stats[allocator][order];
+      for (unsigned op = 0; op < MEM_STAT_NR_OPS; ++op) {
+        const struct mem_stat_hist *const hist = &stat->hist[op];
+        if (!hist->count) {
+          continue;
+        }
+        printf("MEMSTAT %s %s order=%u count=%lu cycles=%lu",
+               _mem_stat_allocator_names[allocator], _mem_stat_op_names[op],
+               order, hist->count, hist->cycles);
+        if (op == MEM_STAT_ALLOC) {
+          printf(" fail=%lu scan=%lu scan_max=%lu", stat->failures, stat->scan,
+                 stat->scan_max);
+        }
+        printf(" hist=");
+        for (unsigned bucket = 0; bucket < MEM_STAT_BUCKETS; ++bucket) {
+          printf(bucket ? ",%lu" : "%lu", hist->buckets[bucket]);
+        }
+        printf("\r\n");
+      }
+    }
+  }
+  printf("MEMSTAT end\r\n");
+}
+
+#else
+
+const struct mem_stat_order *
+mem_stat_get(__attribute__((unused)) enum mem_stat_allocator allocator,
+             __attribute__((unused)) unsigned order) {
+  return NULL;
+}
+
+void mem_stat_reset(void) {}
+
+void mem_stat_print(void) {
+  printf("\rAllocator statistics are not built in (use MEMSTAT=1).\r\n");
+}
+
+void mem_stat_dump(void) { printf("\rMEMSTAT disabled\r\n"); }
+
+#endif // MEMSTAT
@@ -0,0 +1,123 @@
+/**
+ * Allocator instrumentation. This is only built in with `make MEMSTAT=1` (which
+ * defines MEMSTAT), since reading the TSC around every allocation isn't free;
+ * otherwise, the recording functions compile to nothing.
+ *
+ * For each allocator (the physical page allocator and the slab allocator) and
+ * each order, this records:
+ * - Histograms of the latency of allocations and frees, in TSC cycles. Bucket
+ *   `b` counts the operations that took [2^b, 2^(b+1)) cycles.
+ * - The number of failed allocations.
+ * - Scan lengths of allocations: the number of buddy free lists (physical
+ *   allocator) or slab lists (slab allocator) looked at.
+ *
+ * For the physical allocator, only `phys_rra_alloc_order()` and
+ * `phys_rra_free_order()` are recorded. All allocators (including the ones in
+ * unit tests) are recorded together.
+ *
+ * The statistics are shown by the `memstat` shell command. `memstat raw`
+ * prints them in a machine-parsable format (which is also printed at the end of
+ * a test run), one record per line:
+ *
+ *     MEMSTAT begin
+ *     MEMSTAT <allocator> <op> order=<order> count=<n> cycles=<total> \
+ *         [fail=<n> scan=<total> scan_max=<max>] hist=<b0>,<b1>,...
+ *     MEMSTAT end
+ *
+ * Records are only printed for orders that have been used.
+ */
+#ifndef MEM_STAT_H
+#define MEM_STAT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mem/phys.h" // for PHYS_MAX_ORDER
+
+#ifdef MEMSTAT
+#include "common/opcodes.h" // for op_rdtsc
+#endif                      // MEMSTAT
+
+enum mem_stat_allocator {
+  MEM_STAT_PHYS,
+  MEM_STAT_SLAB,
+  MEM_STAT_NR_ALLOCATORS,
+};
+
+enum mem_stat_op {
+  MEM_STAT_ALLOC,
+  MEM_STAT_FREE,
+  MEM_STAT_NR_OPS,
+};
+
+// Large enough for both the physical and slab allocators.
+#define MEM_STAT_MAX_ORDER PHYS_MAX_ORDER
+#define MEM_STAT_BUCKETS 32
+
+struct mem_stat_hist {
+  uint64_t count;
+  uint64_t cycles;
+  uint64_t buckets[MEM_STAT_BUCKETS];
+};
+
+struct mem_stat_order {
+  struct mem_stat_hist hist[MEM_STAT_NR_OPS];
+  uint64_t failures;
+  uint64_t scan;
+  uint64_t scan_max;
+};
+
+/**
+ * Returns the histogram bucket for an operation that took `cycles` cycles.
+ */
+unsigned mem_stat_bucket(uint64_t cycles);
+
+#ifdef MEMSTAT
+
+/**
+ * Start timing an operation. Pass the result to `mem_stat_record()`.
+ */
+static inline uint64_t mem_stat_start(void) { return op_rdtsc(); }
+
+/**
+ * Record an operation that started at `start_tsc`. `scan` and `failed` are
+ * only meaningful for allocations.
+ */
+void mem_stat_record(enum mem_stat_allocator allocator, enum mem_stat_op op,
+                     unsigned order, uint64_t start_tsc, size_t scan,
+                     bool failed);
+
+#else
+
+static inline uint64_t mem_stat_start(void) { return 0; }
+static inline void
+mem_stat_record(__attribute__((unused)) enum mem_stat_allocator allocator,
+                __attribute__((unused)) enum mem_stat_op op,
+                __attribute__((unused)) unsigned order,
+                __attribute__((unused)) uint64_t start_tsc,
+                __attribute__((unused)) size_t scan,
+                __attribute__((unused)) bool failed) {}
+
+#endif // MEMSTAT
+
+/**
+ * Returns the statistics of an allocator for the given order, or NULL if
+ * statistics aren't built in.
+ */
+const struct mem_stat_order *mem_stat_get(enum mem_stat_allocator allocator,
+                                          unsigned order);
+
+/**
+ * Clear all statistics.
+ */
+void mem_stat_reset(void);
+
+/**
+ * Print the statistics in a human-readable table (`mem_stat_print()`), or in
+ * the machine-parsable format described above (`mem_stat_dump()`).
+ */
+void mem_stat_print(void);
+void mem_stat_dump(void);
+
+#endif // MEM_STAT_H
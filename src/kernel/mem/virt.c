@@ -5,9 +5,11 @@
 #include "arch/x86_64/pt.h"    // for arch_pt_init
 #include "arch/x86_64/sched.h" // for arch_stack_jmp
 #include "drivers/console.h"   // for get_default_console_driver
+#include "mem/kfence.h"        // for kfence_init
 #include "mem/phys.h"          // for phys_alloc_page
 #include "mem/slab.h"          // for slab_allocators_init
 #include "mem/vm.h"            // for VM_TO_IDM, VM_TO_HHDM
+#include "mem/vmalloc.h"       // for vmalloc_init
 
 void virt_mem_init(struct limine_memmap_entry *init_mmap, size_t entry_count,
                    void (*cb)(void)) {
@@ -21,6 +23,10 @@ void virt_mem_init(struct limine_memmap_entry *init_mmap, size_t entry_count,
   // Set up architecture-specific page table.
   arch_pt_init(init_mmap, entry_count);
 
+  // The vmalloc area and the KFENCE pool are set up by `arch_pt_init()`.
+  vmalloc_init();
+  kfence_init();
+
   // Video memory is now mapped in.
   struct console_driver *console_driver = get_default_console_driver();
   console_driver->enable(console_driver->dev);
@@ -20,6 +20,10 @@
  *   high memory.) A similar mapping is set in the Limine spec, although it
  *   exactly 4GiB. High memory is limited to 2^47=128TiB, but realistically
  *   we're dealing with much smaller RAM sizes.
+ * - vmalloc area: virt 0xffffc90000000000, with size 512GiB. This is mapped on
+ *   demand by `vmalloc()` (see vmalloc.h), like in Linux.
+ * - KFENCE pool: virt 0xffffc98000000000, right after the vmalloc area. Only
+ *   built in with `make KFENCE=1` (see kfence.h).
  *
  * An identity map is not provided; use of the HHDM is preferred. The identity
  * map is only really useful before the initial page table is set up.
@@ -0,0 +1,246 @@
+#include "mem/vmalloc.h"
+
+#include <assert.h>
+
+#include "arch/x86_64/pt.h" // for arch_pt_*
+#include "common/list.h"
+#include "common/opcodes.h" // for op_irq_*, op_movsq
+#include "mem/phys.h"       // for phys_alloc_page, phys_free_page
+#include "mem/slab.h"       // for kmem_cache_create, slab_cache_*
+
+/**
+ * A vmalloc allocation. `nr_pg` doesn't include the guard page.
+ */
+struct vmalloc_area {
+  void *addr;
+  size_t nr_pg;
+
+  // Freed, but waiting for a TLB flush before the address range can be reused.
+  bool lazy;
+
+  // Link in `_vmalloc_areas`.
+  struct list_head ll;
+};
+
+static struct slab_cache *_vmalloc_area_cache;
+
+/**
+ * All areas (including lazily-freed ones), sorted by address.
+ */
+static struct list_head _vmalloc_areas = {&_vmalloc_areas, &_vmalloc_areas};
+
+/**
+ * Number of pages in lazily-freed areas.
+ */
+static size_t _vmalloc_lazy_pg;
+
+void vmalloc_init(void) {
+  _vmalloc_area_cache = kmem_cache_create(
+      "vmalloc_area", sizeof(struct vmalloc_area), 0, NULL);
+  assert(_vmalloc_area_cache);
+}
+
+/**
+ * Find space for `area` (first-fit) and insert it into the area list. Returns
+ * false if there's no gap large enough.
+ */
+static bool _vmalloc_insert_area(struct vmalloc_area *area) {
+  const size_t len = (area->nr_pg + 1) << PG_SZ_BITS;
+  void *addr = (void *)VM_VMALLOC_START;
+  struct list_head *next_ll = &_vmalloc_areas;
+  list_foreach(&_vmalloc_areas, it) {
+    struct vmalloc_area *const next = list_entry(it, struct vmalloc_area, ll);
+    if ((size_t)(next->addr - addr) >= len) {
+      next_ll = it;
+      break;
+    }
+    addr = next->addr + ((next->nr_pg + 1) << PG_SZ_BITS);
+  }
+  if (VM_VMALLOC_START + VM_VMALLOC_SZ - (uint64_t)addr < len) {
+    return false;
+  }
+
+  area->addr = addr;
+  list_add_tail(next_ll, &area->ll);
+  return true;
+}
+
+/**
+ * Unmap and free pages [start_pg, end_pg) of an area.
+ */
+static void _vmalloc_unmap(struct vmalloc_area *area, size_t start_pg,
+                           size_t end_pg) {
+  for (size_t i = start_pg; i < end_pg; ++i) {
+    void *const pg = arch_pt_unmap_page(area->addr + (i << PG_SZ_BITS));
+    assert(pg);
+    phys_free_page(pg);
+  }
+}
+
+/**
+ * Allocate and map pages [start_pg, end_pg) of an area. On failure, the pages
+ * mapped so far are unmapped and freed again, and this returns false.
+ */
+static bool _vmalloc_map(struct vmalloc_area *area, size_t start_pg,
+                         size_t end_pg) {
+  for (size_t i = start_pg; i < end_pg; ++i) {
+    void *const pg = phys_alloc_page();
+    if (!pg || !arch_pt_map_page(area->addr + (i << PG_SZ_BITS), pg)) {
+      if (pg) {
+        phys_free_page(pg);
+      }
+      // The pages were never accessed, so their mappings aren't in the TLB and
+      // the range can be reused without a flush.
+      _vmalloc_unmap(area, start_pg, i);
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Find the (live) area starting at `addr`.
+ */
+static struct vmalloc_area *_vmalloc_find_area(const void *addr) {
+  assert(is_vmalloc_addr(addr));
+
+  struct vmalloc_area *area = NULL;
+  list_foreach(&_vmalloc_areas, it) {
+    struct vmalloc_area *const cur = list_entry(it, struct vmalloc_area, ll);
+    if (cur->addr == addr) {
+      area = cur;
+      break;
+    }
+  }
+  assert(area && !area->lazy);
+  return area;
+}
+
+/**
+ * `vmalloc_purge()` without masking interrupts.
+ */
+static void _vmalloc_purge(void) {
+  arch_pt_flush_tlb();
+  list_foreach(&_vmalloc_areas, it) {
+    struct vmalloc_area *const area = list_entry(it, struct vmalloc_area, ll);
+    if (area->lazy) {
+      list_del(&area->ll);
+      slab_cache_free(_vmalloc_area_cache, NULL, area);
+    }
+  }
+  _vmalloc_lazy_pg = 0;
+}
+
+/**
+ * `vmalloc()` of `nr_pg` pages without masking interrupts.
+ */
+static void *_vmalloc(size_t nr_pg) {
+  struct vmalloc_area *const area = slab_cache_alloc(_vmalloc_area_cache);
+  if (!area) {
+    return NULL;
+  }
+  area->nr_pg = nr_pg;
+  area->lazy = false;
+  if (!_vmalloc_insert_area(area)) {
+    // Freed areas may be in the way.
+    _vmalloc_purge();
+    if (!_vmalloc_insert_area(area)) {
+      slab_cache_free(_vmalloc_area_cache, NULL, area);
+      return NULL;
+    }
+  }
+
+  if (!_vmalloc_map(area, 0, area->nr_pg)) {
+    list_del(&area->ll);
+    slab_cache_free(_vmalloc_area_cache, NULL, area);
+    return NULL;
+  }
+  return area->addr;
+}
+
+void *vmalloc(size_t sz) {
+  if (!sz || sz >= VM_VMALLOC_SZ) {
+    return NULL;
+  }
+  const uint64_t irq = op_irq_save();
+  void *const addr = _vmalloc(PG_COUNT(sz));
+  op_irq_restore(irq);
+  return addr;
+}
+
+/**
+ * Grow an area in place to `nr_pg` pages. Returns false if the address range
+ * after the area (including the new guard page) isn't free, or if memory is
+ * exhausted.
+ *
+ * The old guard page and the free range after it were never mapped (or were
+ * flushed from the TLB by `vmalloc_purge()`), so no flush is needed.
+ */
+static bool _vmalloc_extend_area(struct vmalloc_area *area, size_t nr_pg) {
+  const uint64_t end =
+      area->ll.next == &_vmalloc_areas
+          ? VM_VMALLOC_START + VM_VMALLOC_SZ
+          : (uint64_t)list_entry(area->ll.next, struct vmalloc_area, ll)->addr;
+  if (end - (uint64_t)area->addr < (nr_pg + 1) << PG_SZ_BITS ||
+      !_vmalloc_map(area, area->nr_pg, nr_pg)) {
+    return false;
+  }
+  area->nr_pg = nr_pg;
+  return true;
+}
+
+void *vrealloc(const void *addr, size_t sz) {
+  if (!addr) {
+    return vmalloc(sz);
+  }
+  if (!sz) {
+    vfree(addr);
+    return NULL;
+  }
+  if (sz >= VM_VMALLOC_SZ) {
+    return NULL;
+  }
+
+  const uint64_t irq = op_irq_save();
+  struct vmalloc_area *const area = _vmalloc_find_area(addr);
+  const size_t old_pg = area->nr_pg;
+  const size_t nr_pg = PG_COUNT(sz);
+  // Resize in place if possible. When shrinking, the extra pages stay mapped:
+  // unmapping them would release their address range before the TLB is flushed.
+  const bool in_place = nr_pg <= old_pg || _vmalloc_extend_area(area, nr_pg);
+  op_irq_restore(irq);
+  if (in_place) {
+    return (void *)addr;
+  }
+
+  // Only the caller uses either area, so the copy is done with interrupts
+  // enabled.
+  void *const new_addr = vmalloc(sz);
+  if (!new_addr) {
+    return NULL;
+  }
+  op_movsq(new_addr, addr, (old_pg << PG_SZ_BITS) / sizeof(uint64_t));
+  vfree(addr);
+  return new_addr;
+}
+
+void vfree(const void *addr) {
+  if (!addr) {
+    return;
+  }
+  const uint64_t irq = op_irq_save();
+  struct vmalloc_area *const area = _vmalloc_find_area(addr);
+  _vmalloc_unmap(area, 0, area->nr_pg);
+  area->lazy = true;
+  _vmalloc_lazy_pg += area->nr_pg;
+  if (_vmalloc_lazy_pg >= VMALLOC_LAZY_MAX_PG) {
+    _vmalloc_purge();
+  }
+  op_irq_restore(irq);
+}
+
+void vmalloc_purge(void) {
+  const uint64_t irq = op_irq_save();
+  _vmalloc_purge();
+  op_irq_restore(irq);
+}
@@ -0,0 +1,86 @@
+/**
+ * Virtually-contiguous kernel allocations, like Linux's vmalloc.
+ *
+ * `kmalloc()` is limited to 2^SLAB_MAX_ORDER bytes, and its larger allocations
+ * need physically contiguous pages. `vmalloc()` instead maps order-0 pages one
+ * at a time into a dedicated region of the kernel address space (the vmalloc
+ * area, VM_VMALLOC_START), so it succeeds regardless of physical memory
+ * fragmentation. The tradeoffs are that allocations are page-granular, that
+ * they are slower (each page is mapped individually), and that the memory is
+ * not physically contiguous (so it is unsuitable for DMA).
+ *
+ * Allocations ("areas") are kept in a list sorted by address, and new areas
+ * are placed in the first gap that fits (first-fit). Each area is followed by
+ * an unmapped guard page, so that overruns fault.
+ *
+ * TLB flushes are lazy, as in Linux. `vfree()` unmaps and frees the pages of an
+ * area without flushing the TLB, but the area's address range isn't reused
+ * until the next flush, so no stale TLB entries can refer to a live area.
+ * Flushes are batched in `vmalloc_purge()`, which runs once VMALLOC_LAZY_MAX_PG
+ * pages are waiting to be flushed, or when the vmalloc area runs out of space.
+ * (Stale TLB entries may still refer to the freed pages until then, which only
+ * matters for use-after-free bugs.)
+ *
+ * As in the page and slab allocators, there is no lock: the functions below
+ * mask interrupts while they touch the area list and the kernel page table, so
+ * that a background task can't preempt them. This is only enough on a single
+ * CPU (where the flush also doesn't need to be a TLB shootdown).
+ */
+#ifndef MEM_VMALLOC_H
+#define MEM_VMALLOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mem/vm.h" // for VM_VMALLOC_START, VM_VMALLOC_SZ
+
+/**
+ * Number of lazily-freed pages (32MiB) after which the TLB is flushed.
+ */
+#define VMALLOC_LAZY_MAX_PG 8192
+
+/**
+ * Initialize the vmalloc allocator. Must be called after
+ * `slab_allocators_init()` and `arch_pt_init()`.
+ */
+void vmalloc_init(void);
+
+/**
+ * Allocate `sz` bytes (rounded up to whole pages) of virtually-contiguous
+ * memory. The memory is not zeroed.
+ *
+ * Returns NULL if `sz` is 0, or if memory or address space is exhausted.
+ */
+void *vmalloc(size_t sz);
+
+/**
+ * Resize memory allocated with `vmalloc()` to `sz` bytes, like `krealloc()`.
+ * Shrinking, or growing when the address range after the allocation is free,
+ * happens in place by extending the mapping. Otherwise, the data is moved to a
+ * new allocation.
+ *
+ * If `addr` is NULL, this is `vmalloc(sz)`. If `sz` is 0, this is `vfree(addr)`
+ * and returns NULL. Returns NULL (and leaves `addr` as is) if memory or address
+ * space is exhausted.
+ */
+void *vrealloc(const void *addr, size_t sz);
+
+/**
+ * Free memory allocated with `vmalloc()`. `addr` may be NULL.
+ */
+void vfree(const void *addr);
+
+/**
+ * Flush the TLB, and make the address ranges of freed areas available again.
+ */
+void vmalloc_purge(void);
+
+/**
+ * Check if an address is in the vmalloc area.
+ */
+static inline bool is_vmalloc_addr(const void *addr) {
+  return (uint64_t)addr - VM_VMALLOC_START < VM_VMALLOC_SZ;
+}
+
+#endif // MEM_VMALLOC_H
@@ -7,12 +7,21 @@
 #include "common/list.h"
 #include "common/opcodes.h" // for op_cli, op_sti
 #include "mem/phys.h"       // for phys_alloc_page
-#include "mem/slab.h"       // for kmalloc
+#include "mem/slab.h"       // for kmem_cache_create, slab_cache_*
 
 // Main global scheduler.
 struct scheduler _scheduler;
 
+// Slab cache for `struct sched_task`s, shared by all schedulers.
+static struct slab_cache *_sched_task_cache;
+
 void sched_init(struct scheduler *scheduler) {
+  if (!_sched_task_cache) {
+    _sched_task_cache = kmem_cache_create(
+        "sched_task", sizeof(struct sched_task), 0, NULL);
+    assert(_sched_task_cache);
+  }
+
   list_init(&scheduler->runnable);
   list_init(&scheduler->blocked);
 
@@ -22,7 +31,7 @@ void sched_init(struct scheduler *scheduler) {
 
 struct sched_task *sched_create_task(struct scheduler *scheduler,
                                      void (*cb)(struct sched_task *)) {
-  struct sched_task *task = kmalloc(sizeof(struct sched_task));
+  struct sched_task *task = slab_cache_alloc(_sched_task_cache);
   if (!task) {
     return task;
   }
@@ -93,7 +102,7 @@ void sched_task_destroy_nostack(struct sched_task *task) {
   assert(PG_FLOOR(task->stk));
   phys_free_page(PG_FLOOR(task->stk));
 #endif // RUNTEST
-  kfree(task);
+  slab_cache_free(_sched_task_cache, NULL, task);
 }
 
 void sched_task_destroy(struct sched_task *task) {
@@ -0,0 +1,78 @@
+#include "mem/kfence.h"
+
+#include "mem/slab.h"
+#include "test/test.h"
+
+#ifdef KFENCE
+
+/**
+ * Sampled `kmalloc()`s come from the KFENCE pool. They keep the `kmalloc()`
+ * alignment, and end as close to the next guard page as it allows.
+ */
+DEFINE_TEST(kfence, sample) {
+  kfence_set_sample_interval(1);
+  uint8_t *obj = kmalloc(20);
+  kfence_set_sample_interval(KFENCE_SAMPLE_INTERVAL);
+  TEST_ASSERT(obj);
+  TEST_ASSERT(is_kfence_addr(obj));
+  TEST_ASSERT(ksize(obj) == 20);
+  TEST_ASSERT(!((size_t)obj & 31));
+  TEST_ASSERT(PG_ALIGNED(obj + 32));
+  for (size_t i = 0; i < 20; ++i) {
+    obj[i] = i;
+  }
+
+  // Moving to a larger size class keeps the contents.
+  const size_t nr_errors = kfence_nr_errors();
+  uint8_t *obj2;
+  TEST_ASSERT(obj2 = krealloc(obj, 100));
+  TEST_ASSERT(!is_kfence_addr(obj2));
+  for (size_t i = 0; i < 20; ++i) {
+    TEST_ASSERT(obj2[i] == i);
+  }
+  kfree(obj2);
+  TEST_ASSERT(kfence_nr_errors() == nr_errors);
+
+  // Unsampled allocations don't come from the pool.
+  TEST_ASSERT(obj = kmalloc(20));
+  TEST_ASSERT(!is_kfence_addr(obj));
+  kfree(obj);
+}
+
+/**
+ * `kfree()` reports writes past the object that don't reach the guard page, and
+ * double frees.
+ */
+DEFINE_TEST(kfence, free_errors) {
+  kfence_set_sample_interval(1);
+  uint8_t *obj = kmalloc(20);
+  kfence_set_sample_interval(KFENCE_SAMPLE_INTERVAL);
+  TEST_ASSERT(obj);
+  TEST_ASSERT(is_kfence_addr(obj));
+
+  const size_t nr_errors = kfence_nr_errors();
+  obj[20] = 0;
+  kfree(obj);
+  TEST_ASSERT(kfence_nr_errors() == nr_errors + 1);
+  kfree(obj);
+  TEST_ASSERT(kfence_nr_errors() == nr_errors + 2);
+}
+
+/**
+ * Freed objects are reused oldest-first, so that they stay unmapped for as
+ * long as possible.
+ */
+DEFINE_TEST(kfence, fifo_reuse) {
+  kfence_set_sample_interval(1);
+  void *obj1 = kmalloc(64);
+  void *obj2 = kmalloc(64);
+  kfree(obj1);
+  kfree(obj2);
+  void *obj3 = kmalloc(64);
+  kfence_set_sample_interval(KFENCE_SAMPLE_INTERVAL);
+  TEST_ASSERT(obj1 && obj2 && obj3);
+  TEST_ASSERT(obj3 != obj1 && obj3 != obj2);
+  kfree(obj3);
+}
+
+#endif // KFENCE
@@ -7,20 +7,21 @@
 #include <assert.h> // for assert
 
 struct phys_rra *phys_fixture_create_rra(void) {
-  // Allocate a backing buffer for the page array.
-  void *page_array_bb = kmalloc(16 * sizeof(struct page));
-  assert(page_array_bb);
-
-  // Allocate a backing buffer for the actual page data.
-  void *bb = phys_rra_alloc_order(phys_mem_get_rra(), 4);
-  assert(bb);
-
   const size_t length = 16 * PG_SZ;
   struct limine_memmap_entry mmap_entries[] = {
       {.base = 0x0, .length = length, .type = LIMINE_MEMMAP_USABLE},
   };
   const size_t entry_count = sizeof(mmap_entries) / sizeof(mmap_entries[0]);
 
+  // Allocate a backing buffer for the page array and bitmaps.
+  void *page_array_bb =
+      kmalloc(phys_rra_metadata_sz(length, mmap_entries, entry_count));
+  assert(page_array_bb);
+
+  // Allocate a backing buffer for the actual page data.
+  void *bb = phys_rra_alloc_order(phys_mem_get_rra(), 4, 0);
+  assert(bb);
+
   struct phys_rra *rra = kmalloc(sizeof(struct phys_rra));
   phys_rra_init(rra, VM_TO_IDM(page_array_bb), length, mmap_entries,
                 entry_count, bb);
@@ -31,8 +32,9 @@ struct phys_rra *phys_fixture_create_rra(void) {
 void phys_fixture_destroy_rra(struct phys_rra *rra) {
   assert(rra);
 
-  // Deallocate page array backing buffer.
-  kfree(rra->mem_bitmap);
+  // Deallocate page array backing buffer. (The section table is at the start of
+  // the buffer.)
+  kfree(rra->sections);
 
   // Deallocate backing buffer.
   phys_rra_free_order(phys_mem_get_rra(), rra->phys_offset, 4);
@@ -42,11 +44,17 @@ void phys_fixture_destroy_rra(struct phys_rra *rra) {
 }
 
 struct slab_cache *slab_fixture_create_slab_cache(unsigned order) {
+  return slab_fixture_create_slab_cache_backend(order, SLAB_BACKEND_SLAB);
+}
+
+struct slab_cache *
+slab_fixture_create_slab_cache_backend(unsigned order,
+                                       enum slab_backend backend) {
   struct phys_rra *rra;
   assert(rra = phys_fixture_create_rra());
 
   struct slab_cache *slab_cache = kmalloc(sizeof(struct slab_cache));
-  slab_cache_init(slab_cache, rra, order);
+  slab_cache_init_backend(slab_cache, rra, order, backend);
 
   return slab_cache;
 }
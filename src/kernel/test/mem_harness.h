@@ -14,6 +14,8 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#include "mem/slab.h" // for enum slab_backend
+
 /**
  * Returns a new RR allocator of size 16 pages. The allocator will only allocate
  * pages within the backing buffer.
@@ -25,9 +27,25 @@ struct phys_rra *phys_fixture_create_rra(void);
  */
 void phys_fixture_destroy_rra(struct phys_rra *rra);
 
+/**
+ * Returns a new slab cache on top of a new RR allocator (see
+ * `phys_fixture_create_rra()`). `slab_fixture_create_slab_cache()` uses the
+ * SLAB backend.
+ */
 struct slab_cache *slab_fixture_create_slab_cache(unsigned order);
+struct slab_cache *
+slab_fixture_create_slab_cache_backend(unsigned order,
+                                       enum slab_backend backend);
 void slab_fixture_destroy_slab_cache(struct slab_cache *slab_cache);
 
+/**
+ * Background tasks (`phys_zero_task()` and `reclaim_task()`) may preempt a test
+ * and change the main allocator's page counts or per-CPU caches. Tests that
+ * check exact counts on the main allocator retry their measurement up to this
+ * many times, and pass if any attempt is undisturbed.
+ */
+#define MEM_TEST_RETRIES 8
+
 /**
  * Check if two regions overlap. This does not consider intervals (1, 2) and (2,
  * 3) to be overlapping, so use strict comparisons (<) rather than non-strict
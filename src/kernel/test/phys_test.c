@@ -2,6 +2,10 @@
 
 #include <limine.h>
 
+#include "common/libc.h"    // for memset
+#include "common/opcodes.h" // for op_irq_*
+#include "common/percpu.h"  // for NR_CPUS, cpu_id
+#include "common/util.h"    // for ilog2ceil
 #include "mem/slab.h"
 #include "mem/vm.h" // VM_TO_HHDM
 #include "test/mem_harness.h"
@@ -33,11 +37,25 @@ DEFINE_TEST(phys, alloc_free_page_multiple) {
   phys_free_page(pg3);
 }
 
+/**
+ * The allocator entry points mask interrupts, and must not re-enable them if
+ * the caller had them masked.
+ */
+DEFINE_TEST(phys, irq_restore) {
+  const uint64_t irq = op_irq_save();
+  void *pg = phys_alloc_page();
+  TEST_ASSERT(pg);
+  phys_free_page(pg);
+  const uint64_t flags = op_irq_save();
+  op_irq_restore(irq);
+  TEST_ASSERT(!(flags & (1lu << 9)));
+}
+
 DEFINE_TEST(phys, rra_alloc) {
   struct phys_rra *rra = phys_fixture_create_rra();
   TEST_ASSERT(rra);
 
-  void *pg = phys_rra_alloc_order(rra, 0);
+  void *pg = phys_rra_alloc_order(rra, 0, 0);
   TEST_ASSERT(pg);
   phys_rra_free_order(rra, pg, 0);
 
@@ -48,17 +66,17 @@ DEFINE_TEST(phys, rra_alloc_multiple) {
   struct phys_rra *rra = phys_fixture_create_rra();
   TEST_ASSERT(rra);
 
-  void *pg1 = phys_rra_alloc_order(rra, 0);
+  void *pg1 = phys_rra_alloc_order(rra, 0, 0);
   TEST_ASSERT(pg1);
 
-  void *pg2 = phys_rra_alloc_order(rra, 0);
+  void *pg2 = phys_rra_alloc_order(rra, 0, 0);
   TEST_ASSERT(pg2);
 
   TEST_ASSERT_NOVERLAP2(pg1, PG_SZ, pg2, PG_SZ);
 
   phys_rra_free_order(rra, pg1, 0);
 
-  void *pg3 = phys_rra_alloc_order(rra, 0);
+  void *pg3 = phys_rra_alloc_order(rra, 0, 0);
   TEST_ASSERT(pg3);
 
   TEST_ASSERT_NOVERLAP2(pg2, PG_SZ, pg3, PG_SZ);
@@ -73,16 +91,16 @@ DEFINE_TEST(phys, rra_alloc_nonzero_order) {
   struct phys_rra *rra = phys_fixture_create_rra();
   TEST_ASSERT(rra);
 
-  void *pg1 = phys_rra_alloc_order(rra, 1);
+  void *pg1 = phys_rra_alloc_order(rra, 1, 0);
   TEST_ASSERT(pg1);
 
-  void *pg2 = phys_rra_alloc_order(rra, 2);
+  void *pg2 = phys_rra_alloc_order(rra, 2, 0);
   TEST_ASSERT(pg2);
 
-  void *pg3 = phys_rra_alloc_order(rra, 3);
+  void *pg3 = phys_rra_alloc_order(rra, 3, 0);
   TEST_ASSERT(pg3);
 
-  void *pg4 = phys_rra_alloc_order(rra, 0);
+  void *pg4 = phys_rra_alloc_order(rra, 0, 0);
   TEST_ASSERT(pg4);
 
   phys_rra_free_order(rra, pg1, 1);
@@ -102,17 +120,17 @@ DEFINE_TEST(phys, rra_alloc_oom_order0) {
 
   void *pg;
   for (size_t i = 0; i < 16; ++i) {
-    pg = phys_rra_alloc_order(rra, 0);
+    pg = phys_rra_alloc_order(rra, 0, 0);
     TEST_ASSERT(pg);
   }
 
   // Try to allocate past full. This should fail.
-  TEST_ASSERT(!phys_rra_alloc_order(rra, 0));
+  TEST_ASSERT(!phys_rra_alloc_order(rra, 0, 0));
 
   // Free one element, see that we can allocate one more element.
   phys_rra_free_order(rra, pg, 0);
-  TEST_ASSERT(phys_rra_alloc_order(rra, 0));
-  TEST_ASSERT(!phys_rra_alloc_order(rra, 0));
+  TEST_ASSERT(phys_rra_alloc_order(rra, 0, 0));
+  TEST_ASSERT(!phys_rra_alloc_order(rra, 0, 0));
 
   // Ok not to clean up here, since the rra will be destroyed.
   phys_fixture_destroy_rra(rra);
@@ -126,17 +144,17 @@ DEFINE_TEST(phys, rra_alloc_oom_order1) {
 
   void *pg;
   for (size_t i = 0; i < 8; ++i) {
-    pg = phys_rra_alloc_order(rra, order);
+    pg = phys_rra_alloc_order(rra, order, 0);
     TEST_ASSERT(pg);
   }
 
   // Try to allocate past full. This should fail.
-  TEST_ASSERT(!phys_rra_alloc_order(rra, order));
+  TEST_ASSERT(!phys_rra_alloc_order(rra, order, 0));
 
   // Free one element, see that we can allocate one more element.
   phys_rra_free_order(rra, pg, order);
-  TEST_ASSERT(phys_rra_alloc_order(rra, order));
-  TEST_ASSERT(!phys_rra_alloc_order(rra, order));
+  TEST_ASSERT(phys_rra_alloc_order(rra, order, 0));
+  TEST_ASSERT(!phys_rra_alloc_order(rra, order, 0));
 
   // Ok not to clean up here, since the rra will be destroyed.
   phys_fixture_destroy_rra(rra);
@@ -150,17 +168,17 @@ DEFINE_TEST(phys, rra_alloc_oom_order4) {
 
   void *pg;
   for (size_t i = 0; i < 1; ++i) {
-    pg = phys_rra_alloc_order(rra, order);
+    pg = phys_rra_alloc_order(rra, order, 0);
     TEST_ASSERT(pg);
   }
 
   // Try to allocate past full. This should fail.
-  TEST_ASSERT(!phys_rra_alloc_order(rra, order));
+  TEST_ASSERT(!phys_rra_alloc_order(rra, order, 0));
 
   // Free one element, see that we can allocate one more element.
   phys_rra_free_order(rra, pg, order);
-  TEST_ASSERT(phys_rra_alloc_order(rra, order));
-  TEST_ASSERT(!phys_rra_alloc_order(rra, order));
+  TEST_ASSERT(phys_rra_alloc_order(rra, order, 0));
+  TEST_ASSERT(!phys_rra_alloc_order(rra, order, 0));
 
   // Ok not to clean up here, since the rra will be destroyed.
   phys_fixture_destroy_rra(rra);
@@ -175,38 +193,38 @@ DEFINE_TEST(phys, rra_alloc_oom_no_contiguous) {
   TEST_ASSERT(rra);
 
   void *pg1, *pg2, *pg3;
-  TEST_ASSERT(phys_rra_alloc_order(rra, 1));       // 2
-  TEST_ASSERT(phys_rra_alloc_order(rra, 1));       // 2
-  TEST_ASSERT(phys_rra_alloc_order(rra, 1));       // 2
-  TEST_ASSERT(pg1 = phys_rra_alloc_order(rra, 0)); // 1
-  TEST_ASSERT(pg2 = phys_rra_alloc_order(rra, 0)); // 1
-  TEST_ASSERT(phys_rra_alloc_order(rra, 1));       // 2
-  TEST_ASSERT(phys_rra_alloc_order(rra, 1));       // 2
-  TEST_ASSERT(phys_rra_alloc_order(rra, 1));       // 2
-  TEST_ASSERT(phys_rra_alloc_order(rra, 0));       // 1
-  TEST_ASSERT(pg3 = phys_rra_alloc_order(rra, 0)); // 1
+  TEST_ASSERT(phys_rra_alloc_order(rra, 1, 0));       // 2
+  TEST_ASSERT(phys_rra_alloc_order(rra, 1, 0));       // 2
+  TEST_ASSERT(phys_rra_alloc_order(rra, 1, 0));       // 2
+  TEST_ASSERT(pg1 = phys_rra_alloc_order(rra, 0, 0)); // 1
+  TEST_ASSERT(pg2 = phys_rra_alloc_order(rra, 0, 0)); // 1
+  TEST_ASSERT(phys_rra_alloc_order(rra, 1, 0));       // 2
+  TEST_ASSERT(phys_rra_alloc_order(rra, 1, 0));       // 2
+  TEST_ASSERT(phys_rra_alloc_order(rra, 1, 0));       // 2
+  TEST_ASSERT(phys_rra_alloc_order(rra, 0, 0));       // 1
+  TEST_ASSERT(pg3 = phys_rra_alloc_order(rra, 0, 0)); // 1
 
   // Try to allocate order 0 or 1. Should fail, there's no space left.
-  TEST_ASSERT(!phys_rra_alloc_order(rra, 0));
-  TEST_ASSERT(!phys_rra_alloc_order(rra, 1));
+  TEST_ASSERT(!phys_rra_alloc_order(rra, 0, 0));
+  TEST_ASSERT(!phys_rra_alloc_order(rra, 1, 0));
 
   // Free one page. Try again.
   phys_rra_free_order(rra, pg2, 0);
-  TEST_ASSERT(pg2 = phys_rra_alloc_order(rra, 0));
+  TEST_ASSERT(pg2 = phys_rra_alloc_order(rra, 0, 0));
   phys_rra_free_order(rra, pg2, 0);
-  TEST_ASSERT(!phys_rra_alloc_order(rra, 1));
+  TEST_ASSERT(!phys_rra_alloc_order(rra, 1, 0));
 
   // Free another page (not contiguous). Try again.
   phys_rra_free_order(rra, pg3, 0);
-  TEST_ASSERT(pg3 = phys_rra_alloc_order(rra, 0));
+  TEST_ASSERT(pg3 = phys_rra_alloc_order(rra, 0, 0));
   phys_rra_free_order(rra, pg3, 0);
-  TEST_ASSERT(!phys_rra_alloc_order(rra, 1));
+  TEST_ASSERT(!phys_rra_alloc_order(rra, 1, 0));
 
   // Now leave a gap of order 1, so the second allocation should succeed.
   phys_rra_free_order(rra, pg1, 0);
-  TEST_ASSERT(pg1 = phys_rra_alloc_order(rra, 0));
+  TEST_ASSERT(pg1 = phys_rra_alloc_order(rra, 0, 0));
   phys_rra_free_order(rra, pg1, 0);
-  TEST_ASSERT(phys_rra_alloc_order(rra, 1));
+  TEST_ASSERT(phys_rra_alloc_order(rra, 1, 0));
 
   // Ok not to clean up here, since the rra will be destroyed.
   phys_fixture_destroy_rra(rra);
@@ -217,7 +235,7 @@ DEFINE_TEST(phys, struct_page_props) {
   TEST_ASSERT(rra);
 
   void *pg;
-  TEST_ASSERT(pg = phys_rra_alloc_order(rra, 1));
+  TEST_ASSERT(pg = phys_rra_alloc_order(rra, 1, 0));
 
   // Check that the struct page indicates that the page is usable and allocated.
   struct page *struct_pg = phys_rra_get_page(rra, pg);
@@ -242,7 +260,7 @@ DEFINE_TEST(phys, page_rw) {
   TEST_ASSERT(rra);
 
   void *pg;
-  TEST_ASSERT(pg = phys_rra_alloc_order(rra, 1));
+  TEST_ASSERT(pg = phys_rra_alloc_order(rra, 1, 0));
 
   uint8_t *arr = VM_TO_HHDM(pg);
   for (size_t i = 0; i < 4096; ++i) {
@@ -256,3 +274,584 @@ DEFINE_TEST(phys, page_rw) {
   // Ok not to clean up here, since the rra will be destroyed.
   phys_fixture_destroy_rra(rra);
 }
+
+/**
+ * Blocks are naturally aligned to their size (relative to the start of the
+ * allocator's memory).
+ */
+DEFINE_TEST(phys, rra_alloc_aligned) {
+  struct phys_rra *rra = phys_fixture_create_rra();
+  TEST_ASSERT(rra);
+
+  void *pg1, *pg2, *pg3;
+  TEST_ASSERT(pg1 = phys_rra_alloc_order(rra, 0, 0));
+  TEST_ASSERT(pg2 = phys_rra_alloc_order(rra, 2, 0));
+  TEST_ASSERT(pg3 = phys_rra_alloc_order(rra, 3, 0));
+
+  TEST_ASSERT(!((pg2 - rra->phys_offset) & (4 * PG_SZ - 1)));
+  TEST_ASSERT(!((pg3 - rra->phys_offset) & (8 * PG_SZ - 1)));
+
+  // Ok not to clean up here, since the rra will be destroyed.
+  phys_fixture_destroy_rra(rra);
+}
+
+/**
+ * Freed buddies are merged back into larger blocks, regardless of the order in
+ * which they are freed.
+ */
+DEFINE_TEST(phys, rra_buddy_coalesce) {
+  struct phys_rra *rra = phys_fixture_create_rra();
+  TEST_ASSERT(rra);
+
+  // Initially, the whole allocator is a single free block. (The fixture lies
+  // entirely in the DMA zone.)
+  const struct phys_zone *const zone = &rra->zones[PHYS_ZONE_DMA];
+  TEST_ASSERT(zone->free_blocks[4] == 1);
+
+  void *pgs[16];
+  for (size_t i = 0; i < 16; ++i) {
+    TEST_ASSERT(pgs[i] = phys_rra_alloc_order(rra, 0, 0));
+  }
+  TEST_ASSERT(!zone->free_blocks[4]);
+
+  // Free in a scrambled order. (7 is coprime with 16.)
+  for (size_t i = 0; i < 16; ++i) {
+    phys_rra_free_order(rra, pgs[(i * 7) % 16], 0);
+  }
+  TEST_ASSERT(zone->free_blocks[4] == 1);
+  for (unsigned order = 0; order < 4; ++order) {
+    TEST_ASSERT(!zone->free_blocks[order]);
+  }
+
+  // The whole region can be allocated at once again.
+  TEST_ASSERT(phys_rra_alloc_order(rra, 4, 0));
+
+  phys_fixture_destroy_rra(rra);
+}
+
+/**
+ * The summary bitmaps are kept in sync with allocations and frees.
+ */
+DEFINE_TEST(phys, rra_summary_bitmap) {
+  struct phys_rra *rra = phys_fixture_create_rra();
+  TEST_ASSERT(rra);
+
+  // Bits past the end of memory are always used.
+  TEST_ASSERT(BM_TEST(rra->used_bm, 16));
+  TEST_ASSERT(!BM_TEST(rra->full_bm, 0));
+
+  void *pgs[16];
+  for (size_t i = 0; i < 16; ++i) {
+    TEST_ASSERT(pgs[i] = phys_rra_alloc_order(rra, 0, 0));
+    const size_t pfn = (pgs[i] - rra->phys_offset) >> PG_SZ_BITS;
+    TEST_ASSERT(BM_TEST(rra->used_bm, pfn));
+  }
+
+  // All pages are used, so the single word of `used_bm` is full.
+  TEST_ASSERT(BM_TEST(rra->full_bm, 0));
+
+  phys_rra_free_order(rra, pgs[5], 0);
+  const size_t pfn = (pgs[5] - rra->phys_offset) >> PG_SZ_BITS;
+  TEST_ASSERT(!BM_TEST(rra->used_bm, pfn));
+  TEST_ASSERT(!BM_TEST(rra->full_bm, 0));
+
+  phys_fixture_destroy_rra(rra);
+}
+
+/**
+ * The most recently freed page is the next one allocated from the per-CPU page
+ * cache of the main allocator.
+ */
+DEFINE_TEST(phys, pcp_hot_reuse) {
+  bool reused = false;
+  for (unsigned i = 0; i < MEM_TEST_RETRIES && !reused; ++i) {
+    void *pg1, *pg2;
+    TEST_ASSERT(pg1 = phys_alloc_page());
+    phys_free_page(pg1);
+    TEST_ASSERT(pg2 = phys_alloc_page());
+    reused = pg1 == pg2;
+    phys_free_page(pg2);
+  }
+  TEST_ASSERT(reused);
+}
+
+/**
+ * A per-CPU page cache refills from the buddy allocator in batches, and is
+ * drained when a higher-order allocation can't otherwise be satisfied.
+ */
+DEFINE_TEST(phys, pcp_refill_drain) {
+  struct phys_rra *rra = phys_fixture_create_rra();
+  TEST_ASSERT(rra);
+
+  struct phys_pcp pcps[NR_CPUS];
+  for (unsigned cpu = 0; cpu < NR_CPUS; ++cpu) {
+    phys_pcp_init(&pcps[cpu]);
+  }
+  rra->pcp = pcps;
+
+  // The first allocation pulls a whole batch (which is the whole allocator).
+  void *pg;
+  TEST_ASSERT(pg = phys_rra_alloc_order(rra, 0, 0));
+  TEST_ASSERT(pcps[cpu_id()].count == PHYS_PCP_BATCH - 1);
+  TEST_ASSERT(rra->allocated_pg == 16);
+
+  phys_rra_free_order(rra, pg, 0);
+  TEST_ASSERT(pcps[cpu_id()].count == PHYS_PCP_BATCH);
+
+  // The buddy allocator is empty, so this drains the cache.
+  TEST_ASSERT(pg = phys_rra_alloc_order(rra, 4, 0));
+  TEST_ASSERT(!pcps[cpu_id()].count);
+
+  phys_fixture_destroy_rra(rra);
+}
+
+/**
+ * Allocations prefer the highest allowed zone and fall back to lower zones, and
+ * free blocks are never merged across zone boundaries.
+ *
+ * This builds an allocator spanning the DMA/DMA32 boundary with 32 usable pages
+ * on either side. Only the page metadata is allocated; the pages themselves are
+ * never touched, so `phys_offset` can be NULL.
+ */
+DEFINE_TEST(phys, rra_zones) {
+  const size_t boundary_pg = PHYS_ZONE_DMA_LIMIT >> PG_SZ_BITS;
+  const size_t length = PHYS_ZONE_DMA_LIMIT + 32 * PG_SZ;
+  struct limine_memmap_entry mmap_entries[] = {
+      {.base = 0x0,
+       .length = PHYS_ZONE_DMA_LIMIT - 32 * PG_SZ,
+       .type = LIMINE_MEMMAP_RESERVED},
+      {.base = PHYS_ZONE_DMA_LIMIT - 32 * PG_SZ,
+       .length = 64 * PG_SZ,
+       .type = LIMINE_MEMMAP_USABLE},
+  };
+  const unsigned md_order =
+      ilog2ceil(PG_COUNT(phys_rra_metadata_sz(length, mmap_entries, 2)));
+  void *md = phys_rra_alloc_order(phys_mem_get_rra(), md_order, 0);
+  TEST_ASSERT(md);
+
+  struct phys_rra rra;
+  phys_rra_init(&rra, md, length, mmap_entries, 2, NULL);
+
+  const struct phys_zone *const dma = &rra.zones[PHYS_ZONE_DMA];
+  const struct phys_zone *const dma32 = &rra.zones[PHYS_ZONE_DMA32];
+  TEST_ASSERT(dma->end_pg == boundary_pg && dma32->start_pg == boundary_pg);
+  TEST_ASSERT(rra.zones[PHYS_ZONE_NORMAL].start_pg ==
+              rra.zones[PHYS_ZONE_NORMAL].end_pg);
+
+  // The two 32-page runs are buddies, but lie in different zones.
+  TEST_ASSERT(dma->free_blocks[5] == 1 && dma32->free_blocks[5] == 1);
+  TEST_ASSERT(!dma->free_blocks[6] && !dma32->free_blocks[6]);
+
+  // Default allocations come from the highest zone with free memory.
+  void *pg1, *pg2;
+  TEST_ASSERT(pg1 = phys_rra_alloc_order(&rra, 0, 0));
+  TEST_ASSERT((size_t)pg1 >= PHYS_ZONE_DMA_LIMIT);
+  TEST_ASSERT(pg2 = phys_rra_alloc_order(&rra, 0, PHYS_ALLOC_DMA));
+  TEST_ASSERT((size_t)pg2 < PHYS_ZONE_DMA_LIMIT);
+  TEST_ASSERT(dma->free_pg == 31 && dma32->free_pg == 31);
+  phys_rra_free_order(&rra, pg1, 0);
+  phys_rra_free_order(&rra, pg2, 0);
+  TEST_ASSERT(dma->free_blocks[5] == 1 && dma32->free_blocks[5] == 1);
+
+  // Falls back from DMA32 to DMA, but never the other way around.
+  TEST_ASSERT(pg1 = phys_rra_alloc_order(&rra, 5, PHYS_ALLOC_DMA32));
+  TEST_ASSERT((size_t)pg1 == PHYS_ZONE_DMA_LIMIT);
+  TEST_ASSERT(pg2 = phys_rra_alloc_order(&rra, 5, PHYS_ALLOC_DMA32));
+  TEST_ASSERT((size_t)pg2 == PHYS_ZONE_DMA_LIMIT - 32 * PG_SZ);
+  TEST_ASSERT(!phys_rra_alloc_order(&rra, 0, 0));
+  phys_rra_free_order(&rra, pg1, 5);
+  TEST_ASSERT(!phys_rra_alloc_order(&rra, 0, PHYS_ALLOC_DMA));
+  phys_rra_free_order(&rra, pg2, 5);
+
+  phys_rra_free_order(phys_mem_get_rra(), md, md_order);
+}
+
+/**
+ * Bulk allocation carves consecutive blocks out of larger free blocks, and
+ * returns fewer blocks than requested when memory runs out.
+ */
+DEFINE_TEST(phys, rra_alloc_bulk) {
+  struct phys_rra *rra = phys_fixture_create_rra();
+  TEST_ASSERT(rra);
+
+  void *pgs[8];
+  TEST_ASSERT(phys_rra_alloc_bulk(rra, 1, 5, pgs, 0) == 5);
+  for (size_t i = 0; i < 5; ++i) {
+    TEST_ASSERT(pgs[i] == rra->phys_offset + 2 * i * PG_SZ);
+  }
+  TEST_ASSERT(rra->allocated_pg == 10);
+
+  // Only 6 pages (3 order-1 blocks) are left.
+  TEST_ASSERT(phys_rra_alloc_bulk(rra, 1, 8, pgs + 5, 0) == 3);
+  TEST_ASSERT(!phys_rra_alloc_bulk(rra, 0, 1, pgs, 0));
+
+  // Everything coalesces back into a single block.
+  phys_rra_free_bulk(rra, 1, 8, pgs);
+  TEST_ASSERT(!rra->allocated_pg);
+  TEST_ASSERT(rra->zones[PHYS_ZONE_DMA].free_blocks[4] == 1);
+
+  phys_fixture_destroy_rra(rra);
+}
+
+/**
+ * Pages from the pre-zeroed pool (or zeroed on demand when it runs out) are
+ * zero-filled, and the pool is drained when allocations would otherwise fail.
+ */
+DEFINE_TEST(phys, rra_zeroed_pool) {
+  struct phys_rra *rra = phys_fixture_create_rra();
+  TEST_ASSERT(rra);
+
+  // Dirty all the pages first.
+  void *pgs[16];
+  TEST_ASSERT(phys_rra_alloc_bulk(rra, 0, 16, pgs, 0) == 16);
+  for (size_t i = 0; i < 16; ++i) {
+    memset(VM_TO_HHDM(pgs[i]), 0xab, PG_SZ);
+  }
+  phys_rra_free_bulk(rra, 0, 16, pgs);
+
+  TEST_ASSERT(phys_rra_zero_pages(rra, 4) == 4);
+  TEST_ASSERT(rra->zeroed_count == 4 && rra->allocated_pg == 4);
+
+  // 4 pages from the pool and 2 zeroed on demand.
+  TEST_ASSERT(phys_rra_alloc_zeroed_bulk(rra, 6, pgs) == 6);
+  TEST_ASSERT(!rra->zeroed_count && rra->allocated_pg == 6);
+  for (size_t i = 0; i < 6; ++i) {
+    const uint64_t *const words = VM_TO_HHDM(pgs[i]);
+    for (size_t j = 0; j < PG_SZ / sizeof(uint64_t); ++j) {
+      TEST_ASSERT(!words[j]);
+    }
+  }
+
+  // The rest of the free pages are moved into the pool, but can still be
+  // allocated.
+  TEST_ASSERT(phys_rra_zero_pages(rra, 16) == 10);
+  TEST_ASSERT(phys_rra_alloc_order(rra, 3, 0));
+  TEST_ASSERT(!rra->zeroed_count);
+
+  phys_fixture_destroy_rra(rra);
+}
+
+/**
+ * Only the first chunk of `struct page`s is initialized eagerly. The rest is
+ * initialized on demand (or explicitly, in the background).
+ *
+ * Like `rra_zones`, only the page metadata is allocated.
+ */
+DEFINE_TEST(phys, rra_deferred_init) {
+  const size_t length = (PHYS_INIT_CHUNK_PG + 64) * PG_SZ;
+
+  // The first chunk is reserved, and there is a hole in the second chunk.
+  struct limine_memmap_entry mmap_entries[] = {
+      {.base = 0x0,
+       .length = PHYS_INIT_CHUNK_PG * PG_SZ,
+       .type = LIMINE_MEMMAP_RESERVED},
+      {.base = PHYS_INIT_CHUNK_PG * PG_SZ,
+       .length = 32 * PG_SZ,
+       .type = LIMINE_MEMMAP_USABLE},
+      {.base = (PHYS_INIT_CHUNK_PG + 48) * PG_SZ,
+       .length = 16 * PG_SZ,
+       .type = LIMINE_MEMMAP_USABLE},
+  };
+  const unsigned md_order =
+      ilog2ceil(PG_COUNT(phys_rra_metadata_sz(length, mmap_entries, 3)));
+  void *md = phys_rra_alloc_order(phys_mem_get_rra(), md_order, 0);
+  TEST_ASSERT(md);
+
+  struct phys_rra rra;
+  phys_rra_init(&rra, md, length, mmap_entries, 3, NULL);
+  TEST_ASSERT(rra.init_pg == PHYS_INIT_CHUNK_PG);
+  TEST_ASSERT(rra.unusable_pg == PHYS_INIT_CHUNK_PG);
+
+  // Allocations that the second chunk can't satisfy don't initialize it.
+  TEST_ASSERT(!phys_rra_alloc_order(&rra, 0, PHYS_ALLOC_DMA));
+  TEST_ASSERT(!phys_rra_alloc_order(&rra, PHYS_HUGE_PMD, 0));
+  TEST_ASSERT(rra.init_pg == PHYS_INIT_CHUNK_PG);
+
+  // Allocating initializes the second chunk.
+  void *pg;
+  TEST_ASSERT(pg = phys_rra_alloc_order(&rra, 0, 0));
+  TEST_ASSERT((size_t)pg >= PHYS_INIT_CHUNK_PG * PG_SZ);
+  TEST_ASSERT(rra.init_pg == rra.total_pg && !rra.init_mmap);
+  TEST_ASSERT(rra.unusable_pg == PHYS_INIT_CHUNK_PG + 16);
+  TEST_ASSERT(!phys_rra_init_next_chunk(&rra));
+
+  // All 48 usable pages are available.
+  void *pgs[48];
+  pgs[0] = pg;
+  TEST_ASSERT(phys_rra_alloc_bulk(&rra, 0, 48, pgs + 1, 0) == 47);
+
+  phys_rra_free_order(phys_mem_get_rra(), md, md_order);
+}
+
+/**
+ * `struct page`s are only allocated for sections that contain usable memory,
+ * so large holes are (nearly) free.
+ *
+ * Like `rra_zones`, only the page metadata is allocated.
+ */
+DEFINE_TEST(phys, rra_sparse_sections) {
+  // 4GiB of physical address space, with 32 usable pages near either end. (Page
+  // 0 is avoided since its address would be NULL.)
+  const size_t length = 4 * GiB;
+  struct limine_memmap_entry mmap_entries[] = {
+      {.base = 32 * PG_SZ, .length = 32 * PG_SZ, .type = LIMINE_MEMMAP_USABLE},
+      {.base = length - 32 * PG_SZ,
+       .length = 32 * PG_SZ,
+       .type = LIMINE_MEMMAP_USABLE},
+  };
+  const size_t md_sz = phys_rra_metadata_sz(length, mmap_entries, 2);
+  TEST_ASSERT(md_sz < 2 * PHYS_SECTION_PG * sizeof(struct page) +
+                          PG_COUNT(length) / 4);
+  const unsigned md_order = ilog2ceil(PG_COUNT(md_sz));
+  void *md = phys_rra_alloc_order(phys_mem_get_rra(), md_order, 0);
+  TEST_ASSERT(md);
+
+  struct phys_rra rra;
+  phys_rra_init(&rra, md, length, mmap_entries, 2, NULL);
+  TEST_ASSERT(rra.sections[0] && rra.sections[rra.nr_sections - 1]);
+  for (size_t section = 1; section < rra.nr_sections - 1; ++section) {
+    TEST_ASSERT(!rra.sections[section]);
+  }
+
+  // Allocate all the pages. The last chunk is only initialized on demand, once
+  // the pages in the first section run out.
+  void *pgs[64];
+  TEST_ASSERT(phys_rra_alloc_bulk(&rra, 0, 64, pgs, 0) == 64);
+  TEST_ASSERT(!phys_rra_alloc_order(&rra, 0, 0));
+  TEST_ASSERT(rra.unusable_pg == rra.total_pg - 64);
+  for (size_t i = 0; i < 64; ++i) {
+    const size_t pfn = (size_t)pgs[i] >> PG_SZ_BITS;
+    TEST_ASSERT(i < 32 ? pfn < 64 : pfn >= rra.total_pg - 32);
+    struct page *const page = phys_rra_get_page(&rra, pgs[i]);
+    TEST_ASSERT(page->present);
+    TEST_ASSERT(page->section == pfn >> PHYS_SECTION_PG_BITS);
+  }
+
+  phys_rra_free_bulk(&rra, 0, 64, pgs);
+  TEST_ASSERT(!rra.allocated_pg);
+  phys_rra_free_order(phys_mem_get_rra(), md, md_order);
+}
+
+/**
+ * Movable pages for the compaction tests. The owner tracks its pages in
+ * `_compact_test_pages`, indexed by `context.private`.
+ */
+static void *_compact_test_pages[8];
+static enum phys_migrate_result
+_compact_test_migrate(struct phys_rra *rra, struct page *page, void *old_pg,
+                      void *new_pg) {
+  const size_t i = (size_t)page->context.private;
+  if (!new_pg || _compact_test_pages[i] != old_pg) {
+    return PHYS_MIGRATE_FAIL;
+  }
+  memcpy(VM_TO_HHDM(new_pg), VM_TO_HHDM(old_pg), PG_SZ);
+  phys_rra_get_page(rra, new_pg)->context.private = (void *)i;
+  phys_rra_set_movable(rra, new_pg, page->migrate_type);
+  _compact_test_pages[i] = new_pg;
+  return PHYS_MIGRATE_MOVED;
+}
+static const struct phys_migrate_ops _compact_test_ops = {
+    .migrate = _compact_test_migrate,
+};
+static unsigned _compact_test_migrate_type(void) {
+  static unsigned migrate_type;
+  if (!migrate_type) {
+    migrate_type = phys_register_migrate_ops(&_compact_test_ops);
+  }
+  return migrate_type;
+}
+
+/**
+ * A high-order allocation that fails due to fragmentation succeeds after
+ * movable pages are migrated out of the way, and the contents of the migrated
+ * pages are preserved.
+ */
+DEFINE_TEST(phys, rra_compact) {
+  const unsigned migrate_type = _compact_test_migrate_type();
+
+  struct phys_rra *rra = phys_fixture_create_rra();
+  TEST_ASSERT(rra);
+
+  // Fragment memory: every other page is free, the rest are movable.
+  void *pgs[16];
+  TEST_ASSERT(phys_rra_alloc_bulk(rra, 0, 16, pgs, 0) == 16);
+  for (size_t i = 0; i < 16; ++i) {
+    if (i & 1) {
+      memset(VM_TO_HHDM(pgs[i]), i, PG_SZ);
+      phys_rra_get_page(rra, pgs[i])->context.private = (void *)(i / 2);
+      phys_rra_set_movable(rra, pgs[i], migrate_type);
+      _compact_test_pages[i / 2] = pgs[i];
+    } else {
+      phys_rra_free_order(rra, pgs[i], 0);
+    }
+  }
+
+  // Two pages need to be moved to make room for an order-2 block.
+  void *pg = phys_rra_alloc_order(rra, 2, 0);
+  TEST_ASSERT(pg);
+  TEST_ASSERT(rra->compact_attempts == 1);
+  TEST_ASSERT(rra->compact_successes == 1);
+  TEST_ASSERT(rra->compact_moved == 2);
+  for (size_t i = 0; i < 8; ++i) {
+    TEST_ASSERT_NOVERLAP2(pg, 4 * PG_SZ, _compact_test_pages[i], PG_SZ);
+    const uint8_t *const data = VM_TO_HHDM(_compact_test_pages[i]);
+    TEST_ASSERT(data[0] == 2 * i + 1 && data[PG_SZ - 1] == 2 * i + 1);
+  }
+
+  // There aren't enough free pages to make room for an order-3 block. The
+  // attempt is rolled back once the free pages run out.
+  TEST_ASSERT(!phys_rra_alloc_order(rra, 3, 0));
+  TEST_ASSERT(rra->compact_attempts == 2);
+  TEST_ASSERT(rra->compact_successes == 1);
+  TEST_ASSERT(rra->allocated_pg == 12);
+
+  // Unmovable pages are never moved.
+  phys_rra_free_order(rra, pg, 2);
+  for (size_t i = 0; i < 8; ++i) {
+    phys_rra_set_movable(rra, _compact_test_pages[i], 0);
+  }
+  const size_t moved = rra->compact_moved;
+  TEST_ASSERT(!phys_rra_alloc_order(rra, 3, 0));
+  TEST_ASSERT(rra->compact_moved == moved);
+  for (size_t i = 0; i < 8; ++i) {
+    const uint8_t *const data = VM_TO_HHDM(_compact_test_pages[i]);
+    TEST_ASSERT(data[0] == 2 * i + 1);
+  }
+
+  for (size_t i = 0; i < 8; ++i) {
+    phys_rra_free_order(rra, _compact_test_pages[i], 0);
+  }
+  TEST_ASSERT(!rra->allocated_pg);
+  phys_fixture_destroy_rra(rra);
+}
+
+/**
+ * Contiguous allocations from the CMA area, lending free CMA pages to movable
+ * allocations, and falling back to the CMA area when the buddy allocator is out
+ * of high-order blocks.
+ */
+DEFINE_TEST(phys, rra_cma) {
+  const unsigned migrate_type = _compact_test_migrate_type();
+
+  struct phys_rra *rra = phys_fixture_create_rra();
+  TEST_ASSERT(rra);
+  TEST_ASSERT(phys_rra_cma_reserve(rra, 3, 0));
+  const size_t cma_pfn = rra->cma.start_pg;
+  TEST_ASSERT(rra->allocated_pg == 8 && !(cma_pfn & 7));
+#define IN_CMA(pg)                                                             \
+  (((size_t)((void *)(pg) - rra->phys_offset) >> PG_SZ_BITS) - cma_pfn < 8)
+
+  // Non-power-of-two allocations.
+  void *pg1 = phys_rra_cma_alloc(rra, 3, 0);
+  void *pg2 = phys_rra_cma_alloc(rra, 5, 0);
+  TEST_ASSERT(pg1 && pg2 && IN_CMA(pg1) && IN_CMA(pg2));
+  TEST_ASSERT_NOVERLAP2(pg1, 3 * PG_SZ, pg2, 5 * PG_SZ);
+  TEST_ASSERT(!phys_rra_cma_alloc(rra, 1, 0));
+  phys_rra_cma_free(rra, pg1, 3);
+  phys_rra_cma_free(rra, pg2, 5);
+  TEST_ASSERT(!rra->cma.used_pg);
+
+  // Movable pages are borrowed from the CMA area, and are taken back when the
+  // CMA area needs them.
+  for (size_t i = 0; i < 2; ++i) {
+    void *const pg = phys_rra_alloc_order(rra, 0, PHYS_ALLOC_MOVABLE);
+    TEST_ASSERT(pg && IN_CMA(pg));
+    memset(VM_TO_HHDM(pg), i + 1, PG_SZ);
+    phys_rra_get_page(rra, pg)->context.private = (void *)i;
+    phys_rra_set_movable(rra, pg, migrate_type);
+    _compact_test_pages[i] = pg;
+  }
+  TEST_ASSERT(rra->cma.lent_pg == 2);
+  void *pg = phys_rra_cma_alloc(rra, 8, 3);
+  TEST_ASSERT(pg);
+  TEST_ASSERT(!rra->cma.lent_pg && rra->cma.reclaimed_pg == 2);
+  for (size_t i = 0; i < 2; ++i) {
+    TEST_ASSERT(!IN_CMA(_compact_test_pages[i]));
+    TEST_ASSERT(*(uint8_t *)VM_TO_HHDM(_compact_test_pages[i]) == i + 1);
+    phys_rra_free_order(rra, _compact_test_pages[i], 0);
+  }
+  phys_rra_cma_free(rra, pg, 8);
+
+  // High-order allocations fall back to the CMA area, and may be freed as
+  // usual.
+  void *pg3 = phys_rra_alloc_order(rra, 3, 0);
+  TEST_ASSERT(pg3 && !IN_CMA(pg3));
+  void *pg4 = phys_rra_alloc_order(rra, 3, 0);
+  TEST_ASSERT(pg4 && IN_CMA(pg4));
+  TEST_ASSERT(rra->cma.used_pg == 8);
+  phys_rra_free_order(rra, pg4, 3);
+  phys_rra_free_order(rra, pg3, 3);
+  TEST_ASSERT(!rra->cma.used_pg);
+  TEST_ASSERT(rra->allocated_pg == 8);
+#undef IN_CMA
+
+  phys_fixture_destroy_rra(rra);
+}
+
+/**
+ * Pages are allocated with a single reference, and are freed when the last
+ * reference is dropped. Flags don't survive the page being freed.
+ */
+DEFINE_TEST(phys, rra_page_refcount) {
+  struct phys_rra *rra = phys_fixture_create_rra();
+  TEST_ASSERT(rra);
+
+  void *pg = phys_rra_alloc_order(rra, 0, 0);
+  TEST_ASSERT(pg);
+  struct page *const page = phys_rra_get_page(rra, pg);
+  TEST_ASSERT(!((size_t)page & 63));
+  TEST_ASSERT(page->refcount == 1 && !page->mapcount && !page->flags);
+  page->flags |= PHYS_PG_DIRTY;
+
+  phys_rra_page_get(rra, pg);
+  TEST_ASSERT(page->refcount == 2);
+  phys_rra_page_put(rra, pg);
+  TEST_ASSERT(page->present && page->refcount == 1);
+  phys_rra_page_put(rra, pg);
+  TEST_ASSERT(!page->present && !page->flags);
+  TEST_ASSERT(!rra->allocated_pg);
+
+  phys_fixture_destroy_rra(rra);
+}
+
+DEFINE_TEST(phys, huge) {
+  // The fixture is too small for huge pages, so use the main allocator.
+  struct phys_rra *rra = phys_mem_get_rra();
+
+  void *pg = phys_rra_alloc_huge(rra, PHYS_HUGE_PMD, 0);
+  TEST_ASSERT(pg);
+  TEST_ASSERT(!((size_t)pg & (2 * MiB - 1)));
+  struct page *const page = phys_rra_get_page(rra, pg);
+  TEST_ASSERT(page->present && page->huge && page->order == PHYS_HUGE_PMD);
+
+  // References are to the whole huge page.
+  phys_rra_page_get(rra, pg);
+  phys_rra_page_put(rra, pg);
+  TEST_ASSERT(page->present && page->huge);
+  phys_rra_page_put(rra, pg);
+  TEST_ASSERT(!page->present && !page->huge);
+
+  // There may not be 1GiB of contiguous free memory.
+  pg = phys_rra_alloc_huge(rra, PHYS_HUGE_PUD, 0);
+  if (pg) {
+    TEST_ASSERT(!((size_t)pg & (GiB - 1)));
+    TEST_ASSERT(phys_rra_get_page(rra, pg)->huge);
+    phys_rra_free_huge(rra, pg);
+  }
+
+  void *hhdm_pg = phys_alloc_huge(PHYS_HUGE_PMD);
+  TEST_ASSERT(hhdm_pg);
+  TEST_ASSERT(!((size_t)VM_TO_IDM(hhdm_pg) & (2 * MiB - 1)));
+  phys_free_huge(hhdm_pg);
+
+  // A huge page counts as 512 allocated pages.
+  bool counted = false;
+  for (unsigned i = 0; i < MEM_TEST_RETRIES && !counted; ++i) {
+    const size_t allocated_pg = rra->allocated_pg;
+    TEST_ASSERT(pg = phys_rra_alloc_huge(rra, PHYS_HUGE_PMD, 0));
+    counted = rra->allocated_pg == allocated_pg + 512;
+    phys_rra_free_huge(rra, pg);
+    counted = counted && rra->allocated_pg == allocated_pg;
+  }
+  TEST_ASSERT(counted);
+}
@@ -0,0 +1,73 @@
+#include "mem/reclaim.h"
+
+#include "common/opcodes.h" // for op_irq_*
+#include "mem/phys.h"
+#include "test/mem_harness.h"
+#include "test/test.h"
+
+static void *_reclaim_test_pgs[4];
+static size_t _reclaim_test_count;
+static size_t _reclaim_test_calls;
+
+static size_t _reclaim_test_shrink(size_t nr_pg) {
+  ++_reclaim_test_calls;
+  size_t freed = 0;
+  for (; freed < nr_pg && _reclaim_test_count; ++freed) {
+    phys_free_page(_reclaim_test_pgs[--_reclaim_test_count]);
+  }
+  return freed;
+}
+
+DEFINE_TEST(reclaim, shrink) {
+  struct shrinker shrinker = {.shrink = _reclaim_test_shrink};
+  for (; _reclaim_test_count < 4; ++_reclaim_test_count) {
+    TEST_ASSERT(_reclaim_test_pgs[_reclaim_test_count] = phys_alloc_page());
+  }
+  _reclaim_test_calls = 0;
+  reclaim_register_shrinker(&shrinker);
+
+  // Other shrinkers (e.g., for the slab caches) may free pages too.
+  TEST_ASSERT(reclaim_shrink(~0lu) >= 4);
+  TEST_ASSERT(_reclaim_test_calls == 1);
+  TEST_ASSERT(!_reclaim_test_count);
+
+  reclaim_unregister_shrinker(&shrinker);
+  reclaim_shrink(~0lu);
+  TEST_ASSERT(_reclaim_test_calls == 1);
+}
+
+DEFINE_TEST(reclaim, free_pg) {
+  struct phys_rra *const rra = phys_mem_get_rra();
+  bool counted = false;
+  for (unsigned i = 0; i < MEM_TEST_RETRIES && !counted; ++i) {
+    const size_t free_pg = phys_rra_free_pg(rra);
+    void *pg = phys_rra_alloc_order(rra, 2, 0);
+    TEST_ASSERT(pg);
+    counted = phys_rra_free_pg(rra) == free_pg - 4;
+    phys_rra_free_order(rra, pg, 2);
+    counted = counted && phys_rra_free_pg(rra) == free_pg;
+  }
+  TEST_ASSERT(counted);
+}
+
+/**
+ * Failing allocations larger than PHYS_RECLAIM_MAX_ORDER don't shrink caches.
+ */
+DEFINE_TEST(reclaim, direct_max_order) {
+  struct phys_rra *const rra = phys_mem_get_rra();
+  struct shrinker shrinker = {.shrink = _reclaim_test_shrink};
+  _reclaim_test_calls = 0;
+
+  // Keep `reclaim_task()` from calling the shrinker in the meantime.
+  const uint64_t irq = op_irq_save();
+  reclaim_register_shrinker(&shrinker);
+  // There may be a free block of the largest order.
+  void *const pg = phys_rra_alloc_order(rra, PHYS_MAX_ORDER, 0);
+  reclaim_unregister_shrinker(&shrinker);
+  op_irq_restore(irq);
+
+  if (pg) {
+    phys_rra_free_order(rra, pg, PHYS_MAX_ORDER);
+  }
+  TEST_ASSERT(!_reclaim_test_calls);
+}
@@ -9,7 +9,9 @@
 
 #include <stdint.h>
 
-#include "common/util.h" // for static_assert
+#include "common/percpu.h" // for NR_CPUS, cpu_id
+#include "common/util.h"   // for static_assert
+#include "mem/vm.h"        // for VM_TO_IDM
 #include "test/mem_harness.h"
 #include "test/test.h"
 
@@ -47,14 +49,71 @@ DEFINE_TEST(slab, kmalloc_unaligned) {
   TEST_ASSERT(ALIGNED(alloc3, 512));
   kfree(alloc3);
 
+  // In the 1536-byte size class.
   void *alloc4 = kmalloc(1203);
   TEST_ASSERT(alloc4);
-  TEST_ASSERT(ALIGNED(alloc4, 2048));
+  TEST_ASSERT(ALIGNED(alloc4, 512));
   kfree(alloc4);
 }
 
+/**
+ * Requests go to the smallest size class that fits, including the
+ * intermediate (non-power-of-two) classes.
+ */
+DEFINE_TEST(slab, kmalloc_size_classes) {
+  static const struct {
+    size_t sz, class_sz;
+  } cases[] = {
+      {0, 16},         {1, 16},         {16, 16},        {17, 32},
+      {33, 48},        {48, 48},        {49, 64},        {65, 96},
+      {129, 192},      {192, 192},      {193, 256},      {257, 384},
+      {1203, 1536},    {2049, 3072},    {4097, 6144},    {9216, 12288},
+      {12289, 16384},  {16385, 32768},  {65536, 65536},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); ++i) {
+    void *obj;
+    TEST_ASSERT(obj = kmalloc(cases[i].sz));
+    const size_t class_sz = ksize(obj);
+    kfree(obj);
+    TEST_ASSERT(class_sz == cases[i].class_sz);
+
+    const size_t align = class_sz & -class_sz;
+    TEST_ASSERT(ALIGNED(obj, align));
+  }
+}
+
 #undef ALIGNED
 
+/**
+ * `kmalloc()`s of constant sizes resolve the size class at compile time. This
+ * should agree with the run-time lookup (`_kmalloc()`).
+ */
+#define TEST_ASSERT_CONST_CLASS(sz)                                            \
+  do {                                                                         \
+    void *const_obj, *obj;                                                     \
+    TEST_ASSERT(const_obj = kmalloc(sz));                                      \
+    TEST_ASSERT(obj = _kmalloc(sz));                                           \
+    const bool same_class = ksize(const_obj) == ksize(obj);                    \
+    kfree(const_obj);                                                          \
+    kfree(obj);                                                                \
+    TEST_ASSERT(same_class);                                                   \
+  } while (0)
+DEFINE_TEST(slab, kmalloc_const_size_classes) {
+  TEST_ASSERT_CONST_CLASS(1);
+  TEST_ASSERT_CONST_CLASS(16);
+  TEST_ASSERT_CONST_CLASS(17);
+  TEST_ASSERT_CONST_CLASS(48);
+  TEST_ASSERT_CONST_CLASS(49);
+  TEST_ASSERT_CONST_CLASS(192);
+  TEST_ASSERT_CONST_CLASS(193);
+  TEST_ASSERT_CONST_CLASS(1203);
+  TEST_ASSERT_CONST_CLASS(4097);
+  TEST_ASSERT_CONST_CLASS(12289);
+  TEST_ASSERT_CONST_CLASS(1u << SLAB_MAX_ORDER);
+  TEST_ASSERT(!kmalloc((1u << SLAB_MAX_ORDER) + 1));
+}
+#undef TEST_ASSERT_CONST_CLASS
+
 DEFINE_TEST(slab, kmalloc_extreme_orders) {
   // Can alloc largest alloc order.
   void *alloc1 = kmalloc(1u << SLAB_MAX_ORDER);
@@ -76,6 +135,35 @@ DEFINE_TEST(slab, kmalloc_extreme_orders) {
   kfree(alloc4);
 }
 
+/**
+ * `krealloc()` resizes in place within a size class, and moves the data across
+ * size classes.
+ */
+DEFINE_TEST(slab, krealloc) {
+  uint8_t *obj, *obj2;
+  TEST_ASSERT(obj = krealloc(NULL, 20));
+  TEST_ASSERT(ksize(obj) == 32);
+  for (size_t i = 0; i < 20; ++i) {
+    obj[i] = i;
+  }
+
+  // Grow and shrink within the size class.
+  TEST_ASSERT(krealloc(obj, 32) == obj);
+  TEST_ASSERT(krealloc(obj, 8) == obj);
+
+  // Grow across size classes.
+  TEST_ASSERT(obj2 = krealloc(obj, 1000));
+  TEST_ASSERT(ksize(obj2) == 1024);
+  for (size_t i = 0; i < 20; ++i) {
+    TEST_ASSERT(obj2[i] == i);
+  }
+
+  // The region is kept if it can't be resized.
+  TEST_ASSERT(!krealloc(obj2, (1u << SLAB_MAX_ORDER) + 1));
+  TEST_ASSERT(obj2[19] == 19);
+  TEST_ASSERT(!krealloc(obj2, 0));
+}
+
 DEFINE_TEST(slab, kmalloc_not_same_address) {
   void *alloc1 = kmalloc(16);
   TEST_ASSERT(alloc1);
@@ -383,3 +471,581 @@ DEFINE_TEST(slab, stress_test) {
 
   slab_fixture_destroy_slab_cache(cache);
 }
+
+/**
+ * Small-order slabs span multiple pages, and hold more objects than fit in an
+ * 8-bit index.
+ */
+DEFINE_TEST(slab, small_multipage) {
+  struct slab_cache *cache;
+  TEST_ASSERT(cache = slab_fixture_create_slab_cache(SLAB_MIN_ORDER));
+  TEST_ASSERT(cache->pages > 1);
+  TEST_ASSERT(cache->elements > UINT8_MAX);
+
+  // Fill one slab.
+  const size_t elements = cache->elements;
+  uint8_t **objs;
+  TEST_ASSERT(objs = kmalloc(elements * sizeof(*objs)));
+  for (size_t i = 0; i < elements; ++i) {
+    TEST_ASSERT(objs[i] = slab_cache_alloc(cache));
+    TEST_ASSERT(!((size_t)objs[i] & ((1u << SLAB_MIN_ORDER) - 1)));
+    if (i) {
+      TEST_ASSERT(objs[i] == objs[i - 1] + (1u << SLAB_MIN_ORDER));
+    }
+  }
+  TEST_ASSERT(list_empty(&cache->partial_slabs));
+  TEST_ASSERT(list_empty(&cache->empty_slabs));
+  TEST_ASSERT(cache->full_slabs.next == cache->full_slabs.prev);
+
+  // Objects beyond the 8-bit indices (and the first page) are freed and
+  // reallocated in LIFO order.
+  slab_cache_free(cache, NULL, objs[UINT8_MAX + 1]);
+  slab_cache_free(cache, NULL, objs[elements - 1]);
+  slab_cache_free(cache, NULL, objs[1]);
+  TEST_ASSERT(slab_cache_alloc(cache) == objs[1]);
+  TEST_ASSERT(slab_cache_alloc(cache) == objs[elements - 1]);
+  TEST_ASSERT(slab_cache_alloc(cache) == objs[UINT8_MAX + 1]);
+
+  for (size_t i = 0; i < elements; ++i) {
+    slab_cache_free(cache, NULL, objs[i]);
+  }
+  TEST_ASSERT(list_empty(&cache->partial_slabs));
+  TEST_ASSERT(list_empty(&cache->full_slabs));
+
+  kfree(objs);
+  slab_fixture_destroy_slab_cache(cache);
+}
+
+/**
+ * New small-order slabs cycle through the cache's colours, which shift the
+ * objects by multiples of a cache line.
+ */
+DEFINE_TEST(slab, colouring) {
+  struct slab_cache *cache;
+  TEST_ASSERT(cache = slab_fixture_create_slab_cache(SLAB_MIN_ORDER));
+  TEST_ASSERT(cache->colours >= SLAB_MIN_COLOURS);
+
+  // Fill SLAB_MIN_COLOURS slabs, and note the first object of each.
+  const size_t slab_sz = (size_t)cache->pages << PG_SZ_BITS;
+  uint8_t *firsts[SLAB_MIN_COLOURS];
+  for (size_t i = 0; i < SLAB_MIN_COLOURS; ++i) {
+    for (size_t j = 0; j < cache->elements; ++j) {
+      uint8_t *obj;
+      TEST_ASSERT(obj = slab_cache_alloc(cache));
+      TEST_ASSERT(!((size_t)obj & ((1u << SLAB_MIN_ORDER) - 1)));
+      if (!j) {
+        firsts[i] = obj;
+      }
+    }
+  }
+  for (size_t i = 1; i < SLAB_MIN_COLOURS; ++i) {
+    TEST_ASSERT(((size_t)firsts[i] & (slab_sz - 1)) ==
+                ((size_t)firsts[0] & (slab_sz - 1)) + i * SLAB_COLOUR_ALIGN);
+  }
+
+  slab_fixture_destroy_slab_cache(cache);
+}
+
+/**
+ * Empty single-page slabs are released by compaction when a high-order
+ * allocation would fail otherwise.
+ */
+DEFINE_TEST(slab, compact_empty_slabs) {
+  struct slab_cache *cache;
+  TEST_ASSERT(cache = slab_fixture_create_slab_cache(SLAB_LARGE_MIN_ORDER));
+  TEST_ASSERT(cache->pages == 1);
+  struct phys_rra *const rra = cache->allocator;
+
+  // Fill the allocator with empty slabs.
+  for (size_t i = 0; i < 16; ++i) {
+    slab_cache_alloc_slab(cache);
+  }
+  TEST_ASSERT(rra->allocated_pg == 16);
+
+  void *pg = phys_rra_alloc_order(rra, 4, 0);
+  TEST_ASSERT(pg);
+  TEST_ASSERT(rra->compact_successes == 1);
+  TEST_ASSERT(rra->compact_moved == 16);
+  TEST_ASSERT(list_empty(&cache->empty_slabs));
+  phys_rra_free_order(rra, pg, 4);
+
+  // Slabs that aren't empty are kept.
+  void *obj = slab_cache_alloc(cache);
+  TEST_ASSERT(obj);
+  TEST_ASSERT(!phys_rra_alloc_order(rra, 4, 0));
+  TEST_ASSERT(rra->compact_successes == 1);
+  slab_cache_free(cache, NULL, obj);
+
+  slab_fixture_destroy_slab_cache(cache);
+}
+
+/**
+ * Bulk allocations span slabs, and are all-or-nothing.
+ */
+DEFINE_TEST(slab, bulk) {
+  for (unsigned backend = SLAB_BACKEND_SLAB; backend <= SLAB_BACKEND_SLUB;
+       ++backend) {
+    struct slab_cache *cache;
+    TEST_ASSERT(cache = slab_fixture_create_slab_cache_backend(
+                    SLAB_LARGE_MIN_ORDER, backend));
+
+    // The allocator only has room for 16 single-page slabs.
+    TEST_ASSERT(cache->pages == 1);
+    const size_t max_n = 16 * cache->elements;
+    void **objs;
+    TEST_ASSERT(objs = kmalloc((max_n + 1) * sizeof(*objs)));
+
+    // One full slab and one partially-full slab.
+    const size_t n = cache->elements + 3;
+    TEST_ASSERT(slab_cache_alloc_bulk(cache, n, objs));
+    for (size_t i = 0; i < n; ++i) {
+      TEST_ASSERT(objs[i]);
+      for (size_t j = 0; j < i; ++j) {
+        TEST_ASSERT(objs[i] != objs[j]);
+      }
+    }
+    TEST_ASSERT(cache->full_slabs.next == cache->full_slabs.prev);
+    TEST_ASSERT(cache->partial_slabs.next == cache->partial_slabs.prev);
+    TEST_ASSERT(!list_empty(&cache->full_slabs));
+    TEST_ASSERT(!list_empty(&cache->partial_slabs));
+
+    slab_cache_free_bulk(cache, n, objs);
+    TEST_ASSERT(list_empty(&cache->full_slabs));
+    TEST_ASSERT(list_empty(&cache->partial_slabs));
+
+    TEST_ASSERT(!slab_cache_alloc_bulk(cache, max_n + 1, objs));
+    TEST_ASSERT(list_empty(&cache->full_slabs));
+    TEST_ASSERT(list_empty(&cache->partial_slabs));
+    TEST_ASSERT(slab_cache_alloc_bulk(cache, max_n, objs));
+    slab_cache_free_bulk(cache, max_n, objs);
+
+    kfree(objs);
+    slab_fixture_destroy_slab_cache(cache);
+  }
+}
+
+DEFINE_TEST(slab, purge) {
+  struct slab_cache *cache;
+  TEST_ASSERT(cache = slab_fixture_create_slab_cache(SLAB_LARGE_MIN_ORDER));
+  struct phys_rra *const rra = cache->allocator;
+
+  for (size_t i = 0; i < 4; ++i) {
+    slab_cache_alloc_slab(cache);
+  }
+  void *obj = slab_cache_alloc(cache);
+  TEST_ASSERT(obj);
+  TEST_ASSERT(rra->allocated_pg == 4);
+
+  // The descriptors of purged slabs go straight back to their slabs, not to the
+  // magazines (which may need to allocate a new magazine during reclaim).
+  const struct slab *const desc =
+      phys_rra_get_page(rra, VM_TO_IDM(obj))->context.slab;
+  const struct slab_cpu_cache *const cc =
+      &_slab_caches[_slab_kmalloc_const_index(ksize(desc))]
+           .cpu_caches[cpu_id()];
+  const struct slab_cpu_cache orig_cc = *cc;
+  const size_t orig_rounds = cc->loaded ? cc->loaded->rounds : 0;
+
+  // Only empty slabs are purged.
+  TEST_ASSERT(slab_cache_purge(cache, 2) == 2);
+  TEST_ASSERT(rra->allocated_pg == 2);
+  TEST_ASSERT(cc->loaded == orig_cc.loaded &&
+              cc->previous == orig_cc.previous);
+  TEST_ASSERT((cc->loaded ? cc->loaded->rounds : 0) == orig_rounds);
+  TEST_ASSERT(slab_cache_purge(cache, 16) == 1);
+  TEST_ASSERT(rra->allocated_pg == 1);
+  TEST_ASSERT(list_empty(&cache->empty_slabs));
+  TEST_ASSERT(!slab_cache_purge(cache, 16));
+
+  slab_cache_free(cache, NULL, obj);
+  TEST_ASSERT(slab_cache_purge(cache, 16) == 1);
+  TEST_ASSERT(!rra->allocated_pg);
+
+  slab_fixture_destroy_slab_cache(cache);
+}
+
+DEFINE_TEST(slab, slub_cache_alloc) {
+  struct slab_cache *cache;
+  TEST_ASSERT(cache = slab_fixture_create_slab_cache_backend(
+                  8, SLAB_BACKEND_SLUB));
+
+  void *objs[32];
+  for (unsigned i = 0; i < 32; ++i) {
+    TEST_ASSERT(objs[i] = slab_cache_alloc(cache));
+    TEST_ASSERT(!((size_t)objs[i] & 255));
+  }
+  for (unsigned i = 0; i < 32; ++i) {
+    TEST_ASSERT_NOVERLAP2(objs[i], 256, objs[(i + 1) % 32], 256);
+  }
+
+  // The last freed object is allocated next.
+  slab_cache_free(cache, NULL, objs[7]);
+  slab_cache_free(cache, NULL, objs[3]);
+  TEST_ASSERT(slab_cache_alloc(cache) == objs[3]);
+  TEST_ASSERT(slab_cache_alloc(cache) == objs[7]);
+
+  for (unsigned i = 0; i < 32; ++i) {
+    slab_cache_free(cache, NULL, objs[i]);
+  }
+  TEST_ASSERT(list_empty(&cache->partial_slabs));
+  TEST_ASSERT(list_empty(&cache->full_slabs));
+
+  slab_fixture_destroy_slab_cache(cache);
+}
+
+/**
+ * SLUB slabs have no descriptor or freelist array, so whole pages go to
+ * objects.
+ */
+DEFINE_TEST(slab, slub_no_overhead) {
+  struct slab_cache *slub, *slab;
+  TEST_ASSERT(slub = slab_fixture_create_slab_cache_backend(
+                  SLAB_MIN_ORDER, SLAB_BACKEND_SLUB));
+  TEST_ASSERT(slab = slab_fixture_create_slab_cache(SLAB_MIN_ORDER));
+  TEST_ASSERT(slub->elements == PG_SZ >> SLAB_MIN_ORDER);
+  TEST_ASSERT(slab->elements < slub->elements * slab->pages);
+  slab_fixture_destroy_slab_cache(slab);
+  slab_fixture_destroy_slab_cache(slub);
+
+  TEST_ASSERT(slub = slab_fixture_create_slab_cache_backend(
+                  15, SLAB_BACKEND_SLUB));
+  TEST_ASSERT(slub->pages == 8 && slub->elements == 1);
+  slab_fixture_destroy_slab_cache(slub);
+}
+
+DEFINE_TEST(slab, slub_oom) {
+  struct slab_cache *cache;
+  TEST_ASSERT(cache = slab_fixture_create_slab_cache_backend(
+                  8, SLAB_BACKEND_SLUB));
+
+  void *last_alloc_obj;
+  for (size_t i = 0; i < 256; ++i) {
+    TEST_ASSERT(last_alloc_obj = slab_cache_alloc(cache));
+  }
+  TEST_ASSERT(!slab_cache_alloc(cache));
+
+  slab_cache_free(cache, NULL, last_alloc_obj);
+  TEST_ASSERT(slab_cache_alloc(cache));
+  TEST_ASSERT(!slab_cache_alloc(cache));
+
+  // Multi-page slabs.
+  struct slab_cache *large;
+  TEST_ASSERT(large = slab_fixture_create_slab_cache_backend(
+                  15, SLAB_BACKEND_SLUB));
+  void *obj1, *obj2;
+  TEST_ASSERT(obj1 = slab_cache_alloc(large));
+  TEST_ASSERT(obj2 = slab_cache_alloc(large));
+  TEST_ASSERT(!slab_cache_alloc(large));
+  slab_cache_free(large, NULL, obj1);
+  slab_cache_free(large, NULL, obj2);
+
+  slab_fixture_destroy_slab_cache(large);
+  slab_fixture_destroy_slab_cache(cache);
+}
+
+/**
+ * `kfree()` works on objects from any SLUB cache on the main allocator.
+ */
+DEFINE_TEST(slab, slub_kfree) {
+  struct phys_rra *const rra = phys_mem_get_rra();
+  struct slab_cache *cache = kmalloc(sizeof(struct slab_cache));
+  TEST_ASSERT(cache);
+  slab_cache_init_backend(cache, rra, 6, SLAB_BACKEND_SLUB);
+
+  void *obj1, *obj2;
+  TEST_ASSERT(obj1 = slab_cache_alloc(cache));
+  TEST_ASSERT(obj2 = slab_cache_alloc(cache));
+  kfree(obj1);
+  kfree(obj2);
+  TEST_ASSERT(list_empty(&cache->partial_slabs));
+  TEST_ASSERT(!list_empty(&cache->empty_slabs));
+
+  const size_t free_pg = phys_rra_free_pg(rra);
+  slab_cache_destroy(cache);
+  TEST_ASSERT(phys_rra_free_pg(rra) > free_pg);
+  kfree(cache);
+}
+
+DEFINE_TEST(slab, slub_purge_and_compact) {
+  struct slab_cache *cache;
+  TEST_ASSERT(cache = slab_fixture_create_slab_cache_backend(
+                  SLAB_SMALL_MAX_ORDER, SLAB_BACKEND_SLUB));
+  struct phys_rra *const rra = cache->allocator;
+
+  // Empty single-page slabs are released by compaction.
+  for (size_t i = 0; i < 16; ++i) {
+    slab_cache_alloc_slab(cache);
+  }
+  TEST_ASSERT(rra->allocated_pg == 16);
+  void *pg = phys_rra_alloc_order(rra, 4, 0);
+  TEST_ASSERT(pg);
+  TEST_ASSERT(list_empty(&cache->empty_slabs));
+  phys_rra_free_order(rra, pg, 4);
+
+  // Only empty slabs are purged.
+  for (size_t i = 0; i < 2; ++i) {
+    slab_cache_alloc_slab(cache);
+  }
+  void *obj = slab_cache_alloc(cache);
+  TEST_ASSERT(obj);
+  TEST_ASSERT(slab_cache_purge(cache, 16) == 1);
+  TEST_ASSERT(rra->allocated_pg == 1);
+  slab_cache_free(cache, NULL, obj);
+  TEST_ASSERT(slab_cache_purge(cache, 16) == 1);
+  TEST_ASSERT(!rra->allocated_pg);
+
+  slab_fixture_destroy_slab_cache(cache);
+}
+
+/**
+ * SLUB has no per-object overhead, so its slabs hold as many objects as fit in
+ * their pages, and it never needs more pages than SLAB for the same objects.
+ */
+DEFINE_TEST(slab, backends_pages) {
+  static const unsigned orders[] = {4, 6, 8, 10};
+  // Eight pages' worth of objects fit in the fixture with either backend.
+  void **objs = kmalloc(((8 * PG_SZ) >> SLAB_MIN_ORDER) * sizeof(void *));
+  TEST_ASSERT(objs);
+
+  for (unsigned o = 0; o < sizeof(orders) / sizeof(orders[0]); ++o) {
+    const size_t n = (8 * PG_SZ) >> orders[o];
+    size_t pages[2];
+    for (unsigned backend = SLAB_BACKEND_SLAB; backend <= SLAB_BACKEND_SLUB;
+         ++backend) {
+      struct slab_cache *cache;
+      TEST_ASSERT(cache = slab_fixture_create_slab_cache_backend(orders[o],
+                                                                 backend));
+      if (backend == SLAB_BACKEND_SLUB) {
+        TEST_ASSERT(cache->elements ==
+                    ((size_t)cache->pages << PG_SZ_BITS) >> orders[o]);
+      }
+
+      for (size_t i = 0; i < n; ++i) {
+        TEST_ASSERT(objs[i] = slab_cache_alloc(cache));
+      }
+      pages[backend] = cache->allocator->allocated_pg;
+      for (size_t i = 0; i < n; ++i) {
+        slab_cache_free(cache, NULL, objs[i]);
+      }
+      slab_fixture_destroy_slab_cache(cache);
+    }
+    TEST_ASSERT(pages[SLAB_BACKEND_SLUB] == 8);
+    TEST_ASSERT(pages[SLAB_BACKEND_SLUB] <= pages[SLAB_BACKEND_SLAB]);
+  }
+  kfree(objs);
+}
+
+/**
+ * Objects freed to a slab cache with magazines stay in the current CPU's
+ * magazines (and the depot) until the slab cache is drained.
+ */
+DEFINE_TEST(slab, magazines) {
+  static struct slab_cpu_cache cpu_caches[NR_CPUS];
+  struct slab_cache *cache;
+  TEST_ASSERT(cache = slab_fixture_create_slab_cache(6));
+  slab_cache_init_magazines(cache, cpu_caches);
+
+  void *obj1, *obj2;
+  TEST_ASSERT(obj1 = slab_cache_alloc(cache));
+  TEST_ASSERT(obj2 = slab_cache_alloc(cache));
+  slab_cache_free(cache, NULL, obj1);
+  slab_cache_free(cache, NULL, obj2);
+
+  // The slab still looks partially full, and the objects come back in LIFO
+  // order.
+  TEST_ASSERT(list_empty(&cache->empty_slabs));
+  TEST_ASSERT(cpu_caches[cpu_id()].loaded->rounds == 2);
+  TEST_ASSERT(slab_cache_alloc(cache) == obj2);
+  TEST_ASSERT(slab_cache_alloc(cache) == obj1);
+
+  // Overflow the per-CPU magazines into the depot.
+  enum { N = 3 * SLAB_MAGAZINE_ROUNDS + 1 };
+  void *objs[N];
+  objs[0] = obj1;
+  objs[1] = obj2;
+  for (size_t i = 2; i < N; ++i) {
+    TEST_ASSERT(objs[i] = slab_cache_alloc(cache));
+  }
+  for (size_t i = 0; i < N; ++i) {
+    slab_cache_free(cache, NULL, objs[i]);
+  }
+  TEST_ASSERT(!list_empty(&cache->depot_full));
+
+  // Allocations take full magazines back from the depot.
+  for (size_t i = 0; i < N; ++i) {
+    TEST_ASSERT(objs[i] = slab_cache_alloc(cache));
+  }
+  TEST_ASSERT(list_empty(&cache->depot_full));
+  TEST_ASSERT(!list_empty(&cache->depot_empty));
+  for (size_t i = 0; i < N; ++i) {
+    slab_cache_free(cache, NULL, objs[i]);
+  }
+
+  // Draining returns everything to the slabs.
+  TEST_ASSERT(slab_cache_drain(cache) == N);
+  TEST_ASSERT(list_empty(&cache->depot_full));
+  TEST_ASSERT(list_empty(&cache->depot_empty));
+  TEST_ASSERT(list_empty(&cache->partial_slabs));
+  TEST_ASSERT(list_empty(&cache->full_slabs));
+  const size_t allocated_pg = cache->allocator->allocated_pg;
+  TEST_ASSERT(slab_cache_purge(cache, 16) == allocated_pg);
+  TEST_ASSERT(!cache->allocator->allocated_pg);
+
+  // Destroying a slab cache also drains it.
+  TEST_ASSERT(obj1 = slab_cache_alloc(cache));
+  slab_cache_free(cache, NULL, obj1);
+  slab_fixture_destroy_slab_cache(cache);
+}
+
+/**
+ * A hot alloc/free loop with a small working set only touches the current
+ * CPU's loaded magazine: it keeps getting the same objects back, and the slabs
+ * and depot are left alone.
+ */
+#define _SLAB_TEST_N 8
+DEFINE_TEST(slab, magazines_hot) {
+  static struct slab_cpu_cache cpu_caches[NR_CPUS];
+
+  for (unsigned backend = SLAB_BACKEND_SLAB; backend <= SLAB_BACKEND_SLUB;
+       ++backend) {
+    struct slab_cache *cache;
+    TEST_ASSERT(cache = slab_fixture_create_slab_cache_backend(6, backend));
+    slab_cache_init_magazines(cache, cpu_caches);
+    struct slab_cpu_cache *const cpu_cache = &cpu_caches[cpu_id()];
+
+    void *warm[_SLAB_TEST_N], *objs[_SLAB_TEST_N];
+    for (size_t i = 0; i < _SLAB_TEST_N; ++i) {
+      TEST_ASSERT(warm[i] = slab_cache_alloc(cache));
+    }
+    for (size_t i = 0; i < _SLAB_TEST_N; ++i) {
+      slab_cache_free(cache, NULL, warm[i]);
+    }
+    const size_t allocated_pg = cache->allocator->allocated_pg;
+
+    for (unsigned round = 0; round < 1024; ++round) {
+      for (size_t i = 0; i < _SLAB_TEST_N; ++i) {
+        TEST_ASSERT(objs[i] = slab_cache_alloc(cache));
+        TEST_ASSERT(objs[i] == warm[_SLAB_TEST_N - 1 - i]);
+      }
+      for (size_t i = 0; i < _SLAB_TEST_N; ++i) {
+        slab_cache_free(cache, NULL, objs[_SLAB_TEST_N - 1 - i]);
+      }
+    }
+    TEST_ASSERT(cpu_cache->loaded->rounds == _SLAB_TEST_N);
+    TEST_ASSERT(list_empty(&cache->depot_full));
+    TEST_ASSERT(list_empty(&cache->empty_slabs));
+    TEST_ASSERT(!list_empty(&cache->partial_slabs));
+    TEST_ASSERT(cache->allocator->allocated_pg == allocated_pg);
+
+    slab_fixture_destroy_slab_cache(cache);
+  }
+}
+#undef _SLAB_TEST_N
+
+/**
+ * Named caches hold objects of exactly their (aligned) size, and objects stay
+ * constructed while they are free.
+ */
+struct _slab_test_obj {
+  uint64_t magic;
+  char buf[16];
+};
+static size_t _slab_test_ctor_calls;
+static void _slab_test_ctor(void *obj) {
+  ((struct _slab_test_obj *)obj)->magic = 0xdeadbeef;
+  ++_slab_test_ctor_calls;
+}
+DEFINE_TEST(slab, kmem_cache) {
+  struct slab_cache *cache;
+  _slab_test_ctor_calls = 0;
+  TEST_ASSERT(cache = kmem_cache_create("test", sizeof(struct _slab_test_obj),
+                                        0, _slab_test_ctor));
+  TEST_ASSERT(cache->size == 24);
+  TEST_ASSERT(cache->elements > PG_SZ / 32);
+
+  // Fill one slab, and one object in a second slab.
+  const size_t n = cache->elements + 1;
+  struct _slab_test_obj **objs;
+  TEST_ASSERT(objs = kmalloc(n * sizeof(*objs)));
+  for (size_t i = 0; i < n; ++i) {
+    TEST_ASSERT(objs[i] = slab_cache_alloc(cache));
+    TEST_ASSERT(!((uint64_t)objs[i] & 7));
+    TEST_ASSERT(objs[i]->magic == 0xdeadbeef);
+    if (i) {
+      TEST_ASSERT_NOVERLAP2(objs[i - 1], 24, objs[i], 24);
+    }
+  }
+  TEST_ASSERT(_slab_test_ctor_calls == 2 * cache->elements);
+
+  // Freed objects (with either function) are reused without being constructed
+  // again.
+  for (size_t i = 0; i < n; ++i) {
+    if (i & 1) {
+      kfree(objs[i]);
+    } else {
+      slab_cache_free(cache, NULL, objs[i]);
+    }
+  }
+  TEST_ASSERT(objs[0] = slab_cache_alloc(cache));
+  TEST_ASSERT(objs[0]->magic == 0xdeadbeef);
+  TEST_ASSERT(_slab_test_ctor_calls == 2 * cache->elements);
+  slab_cache_free(cache, NULL, objs[0]);
+  kfree(objs);
+  kmem_cache_destroy(cache);
+
+  // Objects are padded to their alignment.
+  void *obj1, *obj2;
+  TEST_ASSERT(cache = kmem_cache_create("test_aligned", 40, 64, NULL));
+  TEST_ASSERT(cache->size == 64);
+  TEST_ASSERT(obj1 = slab_cache_alloc(cache));
+  TEST_ASSERT(obj2 = slab_cache_alloc(cache));
+  TEST_ASSERT(!((uint64_t)obj1 & 63) && !((uint64_t)obj2 & 63));
+  kfree(obj1);
+  kfree(obj2);
+  kmem_cache_destroy(cache);
+
+  TEST_ASSERT(
+      !kmem_cache_create("test_large", (1u << SLAB_MAX_ORDER) + 1, 0, NULL));
+}
+
+/**
+ * Replay a representative `kmalloc()` trace (object sizes of typical kernel
+ * structures and buffers). With the intermediate size classes, no object is
+ * rounded up by half its size or more, and internal fragmentation over the
+ * whole trace is under a third of the requested bytes. (It is about 26%, vs.
+ * 64% with only power-of-two size classes.)
+ */
+DEFINE_TEST(slab, kmalloc_trace_fragmentation) {
+  static const struct {
+    uint32_t sz, count;
+  } trace[] = {
+      {24, 400},  {40, 300},  {56, 200},  {72, 200},   {100, 150}, {136, 150},
+      {200, 100}, {264, 100}, {320, 80},  {600, 60},   {700, 60},  {1100, 40},
+      {1400, 40}, {2100, 20}, {2600, 20}, {5000, 8},   {9216, 8},  {11000, 4},
+  };
+  static void *objs[2000];
+
+  size_t n = 0, requested = 0, allocated = 0;
+  bool ok = true;
+  for (size_t i = 0; i < sizeof(trace) / sizeof(*trace); ++i) {
+    for (size_t j = 0; j < trace[i].count; ++j) {
+      assert(n < sizeof(objs) / sizeof(*objs));
+      void *const obj = objs[n++] = kmalloc(trace[i].sz);
+      if (!obj) {
+        ok = false;
+        continue;
+      }
+      const size_t sz = ksize(obj);
+      ok &= sz >= trace[i].sz && 2 * sz < 3 * trace[i].sz;
+      requested += trace[i].sz;
+      allocated += sz;
+    }
+  }
+  for (size_t i = 0; i < n; ++i) {
+    if (objs[i]) {
+      kfree(objs[i]);
+    }
+  }
+  TEST_ASSERT(ok);
+  TEST_ASSERT(3 * (allocated - requested) < requested);
+}
@@ -0,0 +1,48 @@
+#include "mem/stat.h"
+
+#include "mem/phys.h"
+#include "test/mem_harness.h"
+#include "test/test.h"
+
+DEFINE_TEST(stat, bucket) {
+  TEST_ASSERT(mem_stat_bucket(0) == 0);
+  TEST_ASSERT(mem_stat_bucket(1) == 0);
+  TEST_ASSERT(mem_stat_bucket(2) == 1);
+  TEST_ASSERT(mem_stat_bucket(3) == 1);
+  TEST_ASSERT(mem_stat_bucket(1024) == 10);
+  TEST_ASSERT(mem_stat_bucket(~0lu) == MEM_STAT_BUCKETS - 1);
+}
+
+#ifdef MEMSTAT
+
+// Statistics are never reset here, since they are dumped at the end of the test
+// run. Instead, compare against a snapshot.
+DEFINE_TEST(stat, phys_record) {
+  struct phys_rra *rra = phys_fixture_create_rra();
+  TEST_ASSERT(rra);
+
+  const struct mem_stat_order *const stat = mem_stat_get(MEM_STAT_PHYS, 1);
+  TEST_ASSERT(stat);
+  const struct mem_stat_order before = *stat;
+
+  void *pg = phys_rra_alloc_order(rra, 1, 0);
+  TEST_ASSERT(pg);
+  phys_rra_free_order(rra, pg, 1);
+
+  TEST_ASSERT(stat->hist[MEM_STAT_ALLOC].count ==
+              before.hist[MEM_STAT_ALLOC].count + 1);
+  TEST_ASSERT(stat->hist[MEM_STAT_FREE].count ==
+              before.hist[MEM_STAT_FREE].count + 1);
+  TEST_ASSERT(stat->failures == before.failures);
+  TEST_ASSERT(stat->scan > before.scan);
+
+  // The fixture only has 16 pages.
+  const struct mem_stat_order *const big = mem_stat_get(MEM_STAT_PHYS, 5);
+  const uint64_t failures = big->failures;
+  TEST_ASSERT(!phys_rra_alloc_order(rra, 5, 0));
+  TEST_ASSERT(big->failures == failures + 1);
+
+  phys_fixture_destroy_rra(rra);
+}
+
+#endif // MEMSTAT
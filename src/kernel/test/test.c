@@ -2,6 +2,7 @@
 
 #include "common/vt100.h"
 #include "drivers/acpi.h"
+#include "mem/stat.h" // for mem_stat_dump
 
 // Special __start_<section> and __stop_<section> symbols generated by GCC.
 extern const struct test_info __start_test_rodata;
@@ -102,6 +103,10 @@ void run_tests(const char *selection) {
   printf(TEST_PREFIX "Done. %u/%u tests passed.\r\n", tests_passed,
          tests_collected);
 #ifdef RUNTEST
+#ifdef MEMSTAT
+  // For benchmarks.
+  mem_stat_dump();
+#endif // MEMSTAT
   acpi_shutdown();
 #endif // RUNTEST
 }
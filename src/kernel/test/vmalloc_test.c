@@ -0,0 +1,98 @@
+#include "mem/vmalloc.h"
+
+#include "mem/phys.h"
+#include "mem/slab.h"
+#include "test/mem_harness.h"
+#include "test/test.h"
+
+/**
+ * Allocations beyond the `kmalloc()` limit are mapped and writable.
+ */
+DEFINE_TEST(vmalloc, alloc_free) {
+  const size_t sz = 4 << SLAB_MAX_ORDER;
+  TEST_ASSERT(!kmalloc(sz));
+
+  uint64_t *buf;
+  TEST_ASSERT(buf = vmalloc(sz));
+  TEST_ASSERT(is_vmalloc_addr(buf));
+  TEST_ASSERT(PG_ALIGNED(buf));
+  for (size_t i = 0; i < sz / sizeof(*buf); ++i) {
+    buf[i] = i;
+  }
+  for (size_t i = 0; i < sz / sizeof(*buf); ++i) {
+    TEST_ASSERT(buf[i] == i);
+  }
+  vfree(buf);
+
+  TEST_ASSERT(!vmalloc(0));
+  vfree(NULL);
+}
+
+/**
+ * Pages are freed immediately, but address ranges aren't reused until the TLB
+ * is flushed.
+ */
+DEFINE_TEST(vmalloc, lazy_free) {
+  struct phys_rra *const rra = phys_mem_get_rra();
+  void *buf1, *buf2, *buf3;
+
+  // Warm up, so that the page tables and area descriptor already exist.
+  TEST_ASSERT(buf1 = vmalloc(4 * PG_SZ));
+  vfree(buf1);
+  vmalloc_purge();
+
+  bool freed = false;
+  for (unsigned i = 0; i < MEM_TEST_RETRIES && !freed; ++i) {
+    // Release an earlier attempt's range, so that `buf1` is first-fit.
+    vmalloc_purge();
+    const size_t free_pg = phys_rra_free_pg(rra);
+    TEST_ASSERT(buf1 = vmalloc(4 * PG_SZ));
+    vfree(buf1);
+    freed = phys_rra_free_pg(rra) == free_pg;
+  }
+  TEST_ASSERT(freed);
+
+  // First-fit would reuse `buf1`'s range, but it's still lazily freed. The
+  // guard page separates the areas.
+  TEST_ASSERT(buf2 = vmalloc(PG_SZ));
+  TEST_ASSERT(buf2 >= buf1 + 5 * PG_SZ);
+
+  vmalloc_purge();
+  TEST_ASSERT(buf3 = vmalloc(PG_SZ));
+  TEST_ASSERT(buf3 == buf1);
+
+  vfree(buf2);
+  vfree(buf3);
+}
+
+/**
+ * `vrealloc()` grows an area in place if the address range after it is free,
+ * and moves the data otherwise.
+ */
+DEFINE_TEST(vmalloc, vrealloc) {
+  uint64_t *buf1, *buf2, *buf3;
+
+  // Make room for an 8-page area, and start a smaller one in its place.
+  TEST_ASSERT(buf1 = vmalloc(8 * PG_SZ));
+  vfree(buf1);
+  vmalloc_purge();
+  TEST_ASSERT(vrealloc(NULL, PG_SZ) == buf1);
+  buf1[0] = 1;
+
+  // Shrink and grow in place.
+  TEST_ASSERT(vrealloc(buf1, 16) == buf1);
+  TEST_ASSERT(vrealloc(buf1, 4 * PG_SZ) == buf1);
+  buf1[4 * PG_SZ / sizeof(*buf1) - 1] = 2;
+
+  // The next area goes right after the guard page, so `buf1` has to move.
+  TEST_ASSERT(buf2 = vmalloc(PG_SZ));
+  TEST_ASSERT((void *)buf2 == (void *)buf1 + 5 * PG_SZ);
+  TEST_ASSERT(buf3 = vrealloc(buf1, 6 * PG_SZ));
+  TEST_ASSERT(buf3 != buf1);
+  TEST_ASSERT(buf3[0] == 1);
+  TEST_ASSERT(buf3[4 * PG_SZ / sizeof(*buf3) - 1] == 2);
+  buf3[6 * PG_SZ / sizeof(*buf3) - 1] = 3;
+
+  TEST_ASSERT(!vrealloc(buf3, 0));
+  vfree(buf2);
+}